@@ -0,0 +1,974 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compare.h"
+#include "opts.h"
+
+/*
+ * Native version of ramon-compare.py, for trees with many thousands of
+ * runs. Both trees are scanned, and the files read, by a pool of
+ * threads. We only want a few summary keys. Files written by a recent
+ * ramon end with a fixed-size trailer that has them all, otherwise we
+ * read the tail of the file, where the summary is, and only go through
+ * the whole thing if they are not there.
+ *
+ * Files named X.ramon0, X.ramon1, ... (as left by --noclobber) are
+ * taken as repeated runs of X. Their means are compared, and when both
+ * sides have repeats, we also say whether the change is significant.
+ *
+ * The output is the same as the Python script's, with an additional
+ * section for significance.
+ */
+
+#define TAIL_LEN 8192
+#define TRAILER_LEN 256    /* RAMON_TRAILER_LEN */
+#define TRAILER_MAGIC "#ramon-trailer 1 "
+#define MAX_THREADS 16
+#define TOP 20
+
+struct sample
+{
+	char *path;        /* full, as found */
+	char *fn;          /* full, without the .ramon suffix */
+	const char *rel;   /* fn relative to the root */
+	int side;
+	bool ok;
+	int rc;
+	double time;
+	long mem;
+	double interference; /* -1 if absent */
+};
+
+/* All the samples of a file, on one side */
+struct run
+{
+	const char *fn;
+	const char *rel;
+	struct sample **samples;
+	int n;
+	int rc;            /* 0 if all repeats succeeded */
+	double time, mem;  /* means */
+	double interference;
+};
+
+struct match
+{
+	const char *rel;
+	struct run *l, *r;
+	double p_time, p_mem; /* -1 if not enough repeats */
+};
+
+static struct {
+	const char *roots[2];
+
+	/* directories to scan */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct { char *path; int side; } *dirs;
+	int ndirs, capdirs;
+	int active;
+
+	/* files found */
+	struct sample *samples;
+	int nsamples, capsamples;
+	int next;          /* next sample to parse */
+} cmp = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+/* Whether name is X.ramon or X.ramon<digits> */
+static bool is_ramon_file(const char *name, size_t *baselen)
+{
+	const char *p = strstr(name, ".ramon");
+	const char *last = NULL;
+
+	for (; p; p = strstr(p + 1, ".ramon"))
+		last = p;
+	if (!last)
+		return false;
+	for (p = last + 6; *p; p++)
+		if (*p < '0' || *p > '9')
+			return false;
+	*baselen = last - name;
+	return true;
+}
+
+/* With cmp.lock held */
+static void push_dir(char *path, int side)
+{
+	if (cmp.ndirs == cmp.capdirs) {
+		cmp.capdirs = cmp.capdirs ? 2 * cmp.capdirs : 64;
+		cmp.dirs = xrealloc(cmp.dirs, cmp.capdirs * sizeof cmp.dirs[0]);
+	}
+	cmp.dirs[cmp.ndirs].path = path;
+	cmp.dirs[cmp.ndirs].side = side;
+	cmp.ndirs++;
+	pthread_cond_signal(&cmp.cond);
+}
+
+static void scan_dir(const char *path, int side)
+{
+	DIR *d = opendir(path);
+	struct dirent *de;
+
+	if (!d) {
+		fprintf(stderr, "Warning: cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		unsigned char type = de->d_type;
+		size_t baselen;
+		char *full;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (asprintf(&full, "%s/%s", path, de->d_name) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (stat(full, &st) == 0)
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			pthread_mutex_lock(&cmp.lock);
+			push_dir(full, side);
+			pthread_mutex_unlock(&cmp.lock);
+		} else if (type == DT_REG && is_ramon_file(de->d_name, &baselen)) {
+			struct sample s = {
+				.path = full,
+				.fn = strndup(full, strlen(path) + 1 + baselen),
+				.side = side,
+			};
+			s.rel = s.fn + strlen(cmp.roots[side]) + 1;
+
+			pthread_mutex_lock(&cmp.lock);
+			if (cmp.nsamples == cmp.capsamples) {
+				cmp.capsamples = cmp.capsamples ? 2 * cmp.capsamples : 1024;
+				cmp.samples = xrealloc(cmp.samples, cmp.capsamples * sizeof cmp.samples[0]);
+			}
+			cmp.samples[cmp.nsamples++] = s;
+			pthread_mutex_unlock(&cmp.lock);
+		} else {
+			free(full);
+		}
+	}
+	closedir(d);
+}
+
+static void *scan_worker(void *unused __attribute__((unused)))
+{
+	pthread_mutex_lock(&cmp.lock);
+	for (;;) {
+		while (cmp.ndirs == 0 && cmp.active > 0)
+			pthread_cond_wait(&cmp.cond, &cmp.lock);
+		if (cmp.ndirs == 0)
+			break;
+
+		cmp.ndirs--;
+		char *path = cmp.dirs[cmp.ndirs].path;
+		int side = cmp.dirs[cmp.ndirs].side;
+		cmp.active++;
+		pthread_mutex_unlock(&cmp.lock);
+
+		scan_dir(path, side);
+		free(path);
+
+		pthread_mutex_lock(&cmp.lock);
+		cmp.active--;
+		if (cmp.ndirs == 0 && cmp.active == 0)
+			pthread_cond_broadcast(&cmp.cond);
+	}
+	pthread_mutex_unlock(&cmp.lock);
+	return NULL;
+}
+
+/*
+ * Same as parse_mem() in ramon-compare.py, units included. ramon's
+ * humanize() divides by 1024, so these do too, to agree with the exact
+ * bytes in the trailer.
+ */
+static long parse_mem(const char *v)
+{
+	static const char *sufs[] = { "KiB", "MiB", "GiB", "TiB", "PiB" };
+	char *end;
+	long m = strtol(v, &end, 10);
+
+	for (int i = 0; i < 5; i++)
+		if (!strncmp(end, sufs[i], 3))
+			return m << (10 * (i + 1));
+	return m;
+}
+
+/* Returns the bitmask of keys found, the last occurrence wins */
+#define K_TIME 1
+#define K_MEM  2
+#define K_RC   4
+#define K_ALL  (K_TIME | K_MEM | K_RC)
+
+static int parse_lines(struct sample *s, char *buf, int skip_first)
+{
+	int found = 0;
+	char *line, *save = NULL;
+
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		const char *val;
+
+		/* maybe cut in half */
+		if (skip_first) {
+			skip_first = 0;
+			continue;
+		}
+		/* most lines are polls, skip them quickly */
+		if (line[0] != 'g' && line[0] != 'e' && line[0] != 'i')
+			continue;
+		val = line + strcspn(line, " \t");
+		if (!*val)
+			continue;
+		*(char *)val++ = 0;
+		val += strspn(val, " \t");
+
+		if (!strcmp(line, "group.total")) {
+			s->time = strtod(val, NULL);
+			found |= K_TIME;
+		} else if (!strcmp(line, "group.mempeak")) {
+			s->mem = parse_mem(val);
+			found |= K_MEM;
+		} else if (!strcmp(line, "exitcode")) {
+			s->rc = atoi(val);
+			found |= K_RC;
+		} else if (!strcmp(line, "interference")) {
+			s->interference = strtod(val, NULL);
+		}
+	}
+	return found;
+}
+
+/* Returns 0 if the file had a trailer */
+static int parse_trailer(struct sample *s, int fd, off_t size)
+{
+	char buf[TRAILER_LEN + 1];
+	long total_us, mempeak;
+
+	if (size < TRAILER_LEN || pread(fd, buf, TRAILER_LEN, size - TRAILER_LEN) != TRAILER_LEN)
+		return -1;
+	buf[TRAILER_LEN] = 0;
+	if (strncmp(buf, TRAILER_MAGIC, strlen(TRAILER_MAGIC)))
+		return -1;
+
+	if (sscanf(buf + strlen(TRAILER_MAGIC), "total_us=%li mempeak=%li exitcode=%i wall_us=%*i interference=%lf",
+		   &total_us, &mempeak, &s->rc, &s->interference) != 4)
+		return -1;
+	s->time = total_us / 1e6;
+	s->mem = mempeak;
+	/* as if group.mempeak was missing */
+	s->ok = mempeak > 0;
+	return 0;
+}
+
+static void parse_sample(struct sample *s)
+{
+	struct stat st;
+	char *buf;
+	off_t off, len;
+	int fd, found;
+
+	s->interference = -1;
+	fd = open(s->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	if (parse_trailer(s, fd, st.st_size) == 0) {
+		close(fd);
+		return;
+	}
+
+	/* the summary is at the end */
+	off = st.st_size > TAIL_LEN ? st.st_size - TAIL_LEN : 0;
+	len = st.st_size - off;
+	buf = xrealloc(NULL, len + 1);
+	len = pread(fd, buf, len, off);
+	buf[len > 0 ? len : 0] = 0;
+	found = parse_lines(s, buf, off > 0);
+
+	if (found != K_ALL && off > 0) {
+		s->interference = -1;
+		buf = xrealloc(buf, st.st_size + 1);
+		len = pread(fd, buf, st.st_size, 0);
+		buf[len > 0 ? len : 0] = 0;
+		found = parse_lines(s, buf, 0);
+	}
+
+	s->ok = found == K_ALL;
+	free(buf);
+	close(fd);
+}
+
+static void *parse_worker(void *unused __attribute__((unused)))
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&cmp.next, 1, __ATOMIC_RELAXED)) < cmp.nsamples)
+		parse_sample(&cmp.samples[i]);
+	return NULL;
+}
+
+static void run_pool(int nthreads, void *(*fn)(void *))
+{
+	pthread_t th[MAX_THREADS];
+
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&th[i], NULL, fn, NULL)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(th[i], NULL);
+}
+
+/*
+ * Welch's t-test, two-sided. The p-value comes from Student's t
+ * distribution through the regularized incomplete beta function,
+ * with the continued fraction from Numerical Recipes.
+ */
+static double betacf(double a, double b, double x)
+{
+	const double tiny = 1e-300;
+	double c = 1, d = 1 - (a + b) * x / (a + 1), h;
+
+	if (fabs(d) < tiny)
+		d = tiny;
+	d = 1 / d;
+	h = d;
+	for (int m = 1; m <= 200; m++) {
+		double aa, del;
+
+		aa = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+		d = 1 + aa * d;
+		c = 1 + aa / c;
+		if (fabs(d) < tiny)
+			d = tiny;
+		if (fabs(c) < tiny)
+			c = tiny;
+		d = 1 / d;
+		h *= d * c;
+
+		aa = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+		d = 1 + aa * d;
+		c = 1 + aa / c;
+		if (fabs(d) < tiny)
+			d = tiny;
+		if (fabs(c) < tiny)
+			c = tiny;
+		d = 1 / d;
+		del = d * c;
+		h *= del;
+		if (fabs(del - 1) < 1e-12)
+			break;
+	}
+	return h;
+}
+
+static double betai(double a, double b, double x)
+{
+	double bt;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+	bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+	if (x < (a + 1) / (a + b + 2))
+		return bt * betacf(a, b, x) / a;
+	return 1 - bt * betacf(b, a, 1 - x) / b;
+}
+
+static void mean_var(const double *xs, int n, double *mean, double *var)
+{
+	double m = 0, v = 0;
+
+	for (int i = 0; i < n; i++)
+		m += xs[i];
+	m /= n;
+	for (int i = 0; i < n; i++)
+		v += (xs[i] - m) * (xs[i] - m);
+	*mean = m;
+	*var = n > 1 ? v / (n - 1) : 0;
+}
+
+double welch_p(double m1, double v1, int n1, double m2, double v2, int n2)
+{
+	double se, t, df;
+
+	se = v1 / n1 + v2 / n2;
+	if (se == 0)
+		return m1 == m2 ? 1 : 0;
+	t = (m1 - m2) / sqrt(se);
+	df = se * se / ((v1 / n1) * (v1 / n1) / (n1 - 1) + (v2 / n2) * (v2 / n2) / (n2 - 1));
+	return betai(df / 2, 0.5, df / (df + t * t));
+}
+
+static double welch(const double *x1, int n1, const double *x2, int n2)
+{
+	double m1, v1, m2, v2;
+
+	mean_var(x1, n1, &m1, &v1);
+	mean_var(x2, n2, &m2, &v2);
+	return welch_p(m1, v1, n1, m2, v2, n2);
+}
+
+/*
+ * Formatting as Python would, so that we print exactly the same as the
+ * script. pyfloat() is repr() of a float: the shortest string that reads
+ * back to the same number.
+ */
+static void pyfloat(char *buf, size_t sz, double x)
+{
+	int p, e;
+
+	if (isnan(x) || isinf(x)) {
+		snprintf(buf, sz, isnan(x) ? "nan" : x > 0 ? "inf" : "-inf");
+		return;
+	}
+
+	for (p = 0; p < 17; p++) {
+		snprintf(buf, sz, "%.*e", p, x);
+		if (strtod(buf, NULL) == x)
+			break;
+	}
+	e = atoi(strchr(buf, 'e') + 1);
+	if (e < -4 || e >= 16)
+		return;
+
+	snprintf(buf, sz, "%.*f", p - e > 0 ? p - e : 0, x);
+	if (!strchr(buf, '.'))
+		strncat(buf, ".0", sz - strlen(buf) - 1);
+}
+
+static double pyround(double x, int nd)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof buf, "%.*f", nd, x);
+	return strtod(buf, NULL);
+}
+
+/* humanize() in ramon-compare.py, cut to maxlen characters */
+static void pyhumanize(char *buf, size_t sz, double n, bool isint, int maxlen)
+{
+	static const char *sufs[] = { "", "Ki", "Mi", "Gi", "Ti" };
+	int suf = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (n > 10000) {
+			n /= 1000;
+			suf++;
+			isint = false;
+		}
+	}
+
+	if (isint)
+		snprintf(buf, sz, "%.0f", n);
+	else
+		pyfloat(buf, sz, n);
+	strncat(buf, sufs[suf], sz - strlen(buf) - 1);
+	if ((int)strlen(buf) > maxlen)
+		buf[maxlen] = 0;
+}
+
+static void begin_section(const char *hdr)
+{
+	printf("\n\n## %s\n\n<details><summary>%s</summary>\n\n", hdr, hdr);
+}
+
+static void end_section()
+{
+	printf("</details>\n");
+}
+
+/* Sorting, stable like Python's, by the key function and then position */
+static double (*sort_key)(const void *);
+static bool sort_reverse;
+
+static int key_cmp(const void *a, const void *b)
+{
+	double ka = sort_key(*(void * const *)a), kb = sort_key(*(void * const *)b);
+	char *pa = *(char * const *)a, *pb = *(char * const *)b;
+
+	/* nan sorts low, either way */
+	if (isnan(ka) != isnan(kb))
+		return isnan(ka) ? 1 : -1;
+	if (ka != kb && !isnan(ka))
+		return (ka < kb) != sort_reverse ? -1 : 1;
+	return (pa > pb) - (pa < pb);
+}
+
+/* Returns an array of pointers into base, sorted, or as is if no key */
+static void **sorted(void *base, int n, size_t size, double (*key)(const void *), bool reverse)
+{
+	void **ptrs = malloc((n ? n : 1) * sizeof ptrs[0]);
+
+	if (!ptrs) {
+		perror("malloc");
+		exit(1);
+	}
+	for (int i = 0; i < n; i++)
+		ptrs[i] = (char *)base + i * size;
+	if (key) {
+		sort_key = key;
+		sort_reverse = reverse;
+		qsort(ptrs, n, sizeof ptrs[0], key_cmp);
+	}
+	return ptrs;
+}
+
+static double m_timediff(const void *p)
+{
+	const struct match *m = p;
+	return m->r->time - m->l->time;
+}
+
+static double m_timepercdiff(const void *p)
+{
+	const struct match *m = p;
+	return (m->r->time - m->l->time) / m->l->time;
+}
+
+static double m_memdiff(const void *p)
+{
+	const struct match *m = p;
+	return m->r->mem - m->l->mem;
+}
+
+static double m_mempercdiff(const void *p)
+{
+	const struct match *m = p;
+	return (m->r->mem - m->l->mem) / m->l->mem;
+}
+
+static double m_p_time(const void *p)
+{
+	const struct match *m = p;
+	return m->p_time;
+}
+
+static double r_time(const void *p)
+{
+	return ((const struct run *)p)->time;
+}
+
+static double r_mem(const void *p)
+{
+	return ((const struct run *)p)->mem;
+}
+
+static double r_interference(const void *p)
+{
+	return ((const struct run *)p)->interference;
+}
+
+static void print_match(struct match *ms, int nms, double (*key)(const void *), bool reverse, int n)
+{
+	void **order = sorted(ms, nms, sizeof ms[0], key, reverse);
+
+	printf("|%-90s  |%-9s  |%-9s  |%-9s  |%-5s|\n", "FILE", "TIME_L", "TIME_R", "DIFF(s)", "DIFF(%)");
+	printf("|-------------|-------------:|-------------:|--------------:|------------:|\n");
+	for (int i = 0; i < nms && (n < 0 || i < n); i++) {
+		struct match *m = order[i];
+		double tdiff = pyround(m->r->time - m->l->time, 3);
+		char perc[32];
+
+		pyfloat(perc, sizeof perc, pyround(100 * (tdiff / m->l->time), 1));
+		printf("|%-90s  |%8.3fs  |%8.3fs  |%8.3fs  |%4s%%|\n",
+		       m->rel, m->l->time, m->r->time, tdiff, perc);
+	}
+	free(order);
+}
+
+static void print_match_mem(struct match *ms, int nms, double (*key)(const void *), bool reverse, int n)
+{
+	void **order = sorted(ms, nms, sizeof ms[0], key, reverse);
+
+	printf("|%-90s  |%-12s  |%-12s  |%-12s    |%-5s|\n", "FILE", "MEM_L", "MEM_R", "DIFF", "DIFF(%)");
+	printf("|-------------|-------------:|-------------:|--------------:|------------:|\n");
+	for (int i = 0; i < nms && (n < 0 || i < n); i++) {
+		struct match *m = order[i];
+		bool isint = m->l->n == 1 && m->r->n == 1;
+		double mdiff = pyround(m->r->mem - m->l->mem, 3);
+		char l[32], r[32], d[32], perc[32];
+
+		pyhumanize(l, sizeof l, m->l->mem, isint, 9);
+		pyhumanize(r, sizeof r, m->r->mem, isint, 9);
+		pyhumanize(d, sizeof d, mdiff, isint, 9);
+		pyfloat(perc, sizeof perc, pyround(100 * (mdiff / m->l->mem), 1));
+		printf("|%-90s  |%sB|%sB|%sB|%4s%%|\n", m->rel, l, r, d, perc);
+	}
+	free(order);
+}
+
+static void print_runs(struct run *rs, int nrs, double (*key)(const void *), int n)
+{
+	void **order = sorted(rs, nrs, sizeof rs[0], key, true);
+
+	printf("|%-90s |%-8s |%-11s|\n", "FILE", "TIME", "MEM");
+	printf("|------------|----------:|---------:|\n");
+	for (int i = 0; i < nrs && i < n; i++) {
+		struct run *r = order[i];
+		char mem[32];
+
+		pyhumanize(mem, sizeof mem, r->mem, r->n == 1, 8);
+		printf("|%-90s |%8.3fs |%sB|\n", r->rel, r->time, mem);
+	}
+	free(order);
+}
+
+static void print_noisy(double thr, struct run *rs, int nrs)
+{
+	void **order = sorted(rs, nrs, sizeof rs[0], r_interference, true);
+
+	printf("|%-90s |%-8s |%-12s|\n", "FILE", "TIME", "INTERFERENCE");
+	printf("|------------|----------:|---------:|\n");
+	for (int i = 0; i < nrs; i++) {
+		struct run *r = order[i];
+		if (r->interference > thr)
+			printf("|%-90s |%8.3fs |%11.2f%%|\n", r->fn, r->time, r->interference);
+	}
+	free(order);
+}
+
+static void print_significant(struct match *ms, int nms)
+{
+	void **order = sorted(ms, nms, sizeof ms[0], m_p_time, false);
+
+	printf("|%-90s  |%-6s |%-9s  |%-9s  |%-7s |%-7s |%-7s|\n",
+	       "FILE", "RUNS", "TIME_L", "TIME_R", "DIFF(%)", "P_TIME", "P_MEM");
+	printf("|-------------|------:|-------------:|-------------:|--------:|--------:|-------:|\n");
+	for (int i = 0; i < nms; i++) {
+		struct match *m = order[i];
+		if (m->p_time < 0 || (m->p_time >= 0.05 && m->p_mem >= 0.05))
+			continue;
+		printf("|%-90s  |%2i/%-3i |%8.3fs  |%8.3fs  |%7.1f%% |%8.4f |%7.4f|\n",
+		       m->rel, m->l->n, m->r->n, m->l->time, m->r->time,
+		       100 * (m->r->time - m->l->time) / m->l->time, m->p_time, m->p_mem);
+	}
+	free(order);
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	const struct sample *x = a, *y = b;
+	int c;
+
+	if (x->side != y->side)
+		return x->side - y->side;
+	if ((c = strcmp(x->fn, y->fn)))
+		return c;
+	return strcmp(x->path, y->path);
+}
+
+/* Group the samples of a side into runs, samples must be sorted */
+static struct run *mkruns(int side, int *nruns)
+{
+	struct run *rs = NULL;
+	int n = 0;
+
+	for (int i = 0; i < cmp.nsamples; i++) {
+		struct sample *s = &cmp.samples[i];
+
+		if (s->side != side || !s->ok)
+			continue;
+		if (n == 0 || strcmp(rs[n - 1].fn, s->fn)) {
+			rs = xrealloc(rs, (n + 1) * sizeof rs[0]);
+			memset(&rs[n], 0, sizeof rs[n]);
+			rs[n].fn = s->fn;
+			rs[n].rel = s->rel;
+			rs[n].interference = -1;
+			n++;
+		}
+
+		struct run *r = &rs[n - 1];
+		r->samples = xrealloc(r->samples, (r->n + 1) * sizeof r->samples[0]);
+		r->samples[r->n++] = s;
+		if (s->rc && !r->rc)
+			r->rc = s->rc;
+		r->time += s->time;
+		r->mem += s->mem;
+		if (s->interference > r->interference)
+			r->interference = s->interference;
+	}
+
+	for (int i = 0; i < n; i++) {
+		rs[i].time /= rs[i].n;
+		rs[i].mem /= rs[i].n;
+	}
+
+	*nruns = n;
+	return rs;
+}
+
+/* Hash of relative paths to runs, open addressing */
+static uint64_t hash_str(const char *s)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ull;
+	return h;
+}
+
+static struct match *mkmatching(struct run *ls, int nl, struct run *rs, int nr, int *nmatches)
+{
+	size_t cap = 1;
+	struct run **tab;
+	struct match *ms = NULL;
+	int n = 0;
+
+	while (cap < 2 * (size_t)nl + 1)
+		cap *= 2;
+	tab = calloc(cap, sizeof tab[0]);
+	if (!tab) {
+		perror("calloc");
+		exit(1);
+	}
+	for (int i = 0; i < nl; i++) {
+		size_t h = hash_str(ls[i].rel) & (cap - 1);
+		while (tab[h])
+			h = (h + 1) & (cap - 1);
+		tab[h] = &ls[i];
+	}
+
+	/* rs is sorted by path, and so will be the matches */
+	for (int i = 0; i < nr; i++) {
+		size_t h = hash_str(rs[i].rel) & (cap - 1);
+		struct run *l = NULL;
+
+		for (; tab[h]; h = (h + 1) & (cap - 1)) {
+			if (!strcmp(tab[h]->rel, rs[i].rel)) {
+				l = tab[h];
+				break;
+			}
+		}
+
+		/* We do not compare failed runs, nor failed vs successful */
+		if (!l || l->rc != 0 || rs[i].rc != 0)
+			continue;
+
+		ms = xrealloc(ms, (n + 1) * sizeof ms[0]);
+		ms[n].rel = rs[i].rel;
+		ms[n].l = l;
+		ms[n].r = &rs[i];
+		ms[n].p_time = ms[n].p_mem = -1;
+		if (l->n >= 2 && rs[i].n >= 2) {
+			double lt[l->n], lm[l->n], rt[rs[i].n], rm[rs[i].n];
+			for (int j = 0; j < l->n; j++) {
+				lt[j] = l->samples[j]->time;
+				lm[j] = l->samples[j]->mem;
+			}
+			for (int j = 0; j < rs[i].n; j++) {
+				rt[j] = rs[i].samples[j]->time;
+				rm[j] = rs[i].samples[j]->mem;
+			}
+			ms[n].p_time = welch(lt, l->n, rt, rs[i].n);
+			ms[n].p_mem = welch(lm, l->n, rm, rs[i].n);
+		}
+		n++;
+	}
+
+	free(tab);
+	*nmatches = n;
+	return ms;
+}
+
+static void cmp_help(const char *progname)
+{
+	fprintf(stderr, "Usage: %s compare [options] <old-dir> <new-dir>\n", progname);
+	fprintf(stderr, "Compare the .ramon files of two runs of a test suite.\n");
+}
+
+int ramon_compare(int argc, char **argv)
+{
+	long opt_jobs = 0;
+	const char *opt_noisy = "5.0";
+	struct opt cmp_opts[] = {
+		OPT_STR("noisy", 0, "Flag runs where other workloads used more than this % of the host CPU (default 5)", &opt_noisy),
+		OPT_INT("jobs", 'j', "Use <int> threads to read the files (default: one per CPU, up to 16)", &opt_jobs),
+		OPT_END,
+	};
+	struct run *lhs, *rhs, *all;
+	struct match *ms;
+	int nl, nr, nms, optind;
+	double noisy;
+	char roots[2][4096];
+
+	optind = parse_opts(argc, argv, false, cmp_opts);
+	if (optind < 0 || argc - optind != 2) {
+		cmp_help("ramon");
+		print_opts(stderr, cmp_opts);
+		return 1;
+	}
+	noisy = strtod(opt_noisy, NULL);
+
+	printf("Comparing %s and %s\n", argv[optind], argv[optind + 1]);
+
+	for (int i = 0; i < 2; i++) {
+		const char *arg = argv[optind + i];
+		size_t len = strlen(arg);
+
+		if (strstr(arg, "://")) {
+			fprintf(stderr, "%s: URLs are only supported by ramon-compare.py\n", arg);
+			return 1;
+		}
+		while (len > 1 && arg[len - 1] == '/')
+			len--;
+		snprintf(roots[i], sizeof roots[i], "%.*s", (int)len, arg);
+		cmp.roots[i] = roots[i];
+	}
+
+	if (opt_jobs <= 0)
+		opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt_jobs > MAX_THREADS)
+		opt_jobs = MAX_THREADS;
+	if (opt_jobs < 1)
+		opt_jobs = 1;
+
+	for (int i = 0; i < 2; i++)
+		push_dir(strdup(cmp.roots[i]), i);
+	run_pool(opt_jobs, scan_worker);
+	run_pool(opt_jobs, parse_worker);
+
+	qsort(cmp.samples, cmp.nsamples, sizeof cmp.samples[0], sample_cmp);
+	for (int i = 0; i < cmp.nsamples; i++)
+		if (!cmp.samples[i].ok)
+			printf("Warning: ignoring %s since it is incomplete\n", cmp.samples[i].path);
+
+	lhs = mkruns(0, &nl);
+	rhs = mkruns(1, &nr);
+
+	int sl = 0, sr = 0;
+	char pl[32], pr[32];
+	for (int i = 0; i < nl; i++)
+		sl += lhs[i].rc == 0;
+	for (int i = 0; i < nr; i++)
+		sr += rhs[i].rc == 0;
+	if (nl)
+		pyfloat(pl, sizeof pl, 100.0 * sl / nl);
+	else
+		strcpy(pl, "0");
+	if (nr)
+		pyfloat(pr, sizeof pr, 100.0 * sr / nr);
+	else
+		strcpy(pr, "0");
+
+	printf("\n\n# SUMMARY\n");
+	printf("- LHS tests = %i\n", nl);
+	printf("- RHS tests = %i\n", nr);
+	printf("- LHS success = %i  (%s%%)\n", sl, pl);
+	printf("- RHS success = %i  (%s%%)\n", sr, pr);
+
+	ms = mkmatching(lhs, nl, rhs, nr, &nms);
+
+	begin_section("TOP 20 RUNTIME INCREASE");
+	print_match(ms, nms, m_timediff, true, TOP);
+	end_section();
+
+	begin_section("TOP 20 RUNTIME INCREASE (RELATIVE)");
+	print_match(ms, nms, m_timepercdiff, true, TOP);
+	end_section();
+
+	begin_section("TOP 20 RUNTIME DECREASE");
+	print_match(ms, nms, m_timediff, false, TOP);
+	end_section();
+
+	begin_section("TOP 20 RUNTIME DECREASE (RELATIVE)");
+	print_match(ms, nms, m_timepercdiff, false, TOP);
+	end_section();
+
+	begin_section("TOP 20 LHS FILES, BY RUNTIME");
+	print_runs(lhs, nl, r_time, TOP);
+	end_section();
+
+	begin_section("TOP 20 RHS FILES, BY RUNTIME");
+	print_runs(rhs, nr, r_time, TOP);
+	end_section();
+
+	begin_section("TOP 20 MEMORY INCREASE");
+	print_match_mem(ms, nms, m_memdiff, true, TOP);
+	end_section();
+
+	begin_section("TOP 20 MEMORY INCREASE (RELATIVE)");
+	print_match_mem(ms, nms, m_mempercdiff, true, TOP);
+	end_section();
+
+	begin_section("TOP 20 MEMORY DECREASE");
+	print_match_mem(ms, nms, m_memdiff, false, TOP);
+	end_section();
+
+	begin_section("TOP 20 MEMORY DECREASE (RELATIVE)");
+	print_match_mem(ms, nms, m_mempercdiff, false, TOP);
+	end_section();
+
+	begin_section("TOP 20 LHS FILES, BY PEAK MEMORY USAGE");
+	print_runs(lhs, nl, r_mem, TOP);
+	end_section();
+
+	begin_section("TOP 20 RHS FILES, BY PEAK MEMORY USAGE");
+	print_runs(rhs, nr, r_mem, TOP);
+	end_section();
+
+	{
+		char hdr[64], thr[32];
+		pyfloat(thr, sizeof thr, noisy);
+		snprintf(hdr, sizeof hdr, "NOISY RUNS (INTERFERENCE > %s%%)", thr);
+		all = xrealloc(NULL, (nl + nr + 1) * sizeof all[0]);
+		memcpy(all, lhs, nl * sizeof all[0]);
+		memcpy(all + nl, rhs, nr * sizeof all[0]);
+		begin_section(hdr);
+		print_noisy(noisy, all, nl + nr);
+		end_section();
+		free(all);
+	}
+
+	bool repeats = false;
+	for (int i = 0; i < nms; i++)
+		repeats |= ms[i].p_time >= 0;
+	if (repeats) {
+		begin_section("SIGNIFICANT CHANGES (WELCH'S T-TEST, p < 0.05)");
+		print_significant(ms, nms);
+		end_section();
+	}
+
+	begin_section("FULL COMPARISON");
+	print_match(ms, nms, NULL, false, -1);
+	end_section();
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef __COMPARE_H
+#define __COMPARE_H 1
+
+/* `ramon compare <old> <new>', argv[0] is "compare" */
+int ramon_compare(int argc, char **argv);
+
+/* Two-sided p-value of Welch's t-test, given means, variances and sizes */
+double welch_p(double m1, double v1, int n1, double m2, double v2, int n2);
+
+#endif
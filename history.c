@@ -0,0 +1,736 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "compare.h"
+#include "history.h"
+#include "opts.h"
+
+/*
+ * Run history for `ramon --record <dir>' and `ramon history'. The
+ * directory has two files:
+ *
+ *   runs    fixed-size struct hist_rec records, only ever appended to.
+ *   index   the (cmdhash, start_us, recno) of the first nrecs records,
+ *           sorted.
+ *
+ * Writers hold an flock on runs while they append, so records are never
+ * interleaved or torn. Every HIST_TAIL_MAX records, the writer merges
+ * the new ones into a fresh index and renames it over the old one.
+ * Readers take no locks: they binary-search the index, and scan the
+ * records after nrecs, skipping any that do not check out since a
+ * writer may be in the middle of one.
+ *
+ * Change points are found by binary segmentation: split at the point
+ * where Welch's t between both sides is largest, keep the split if it
+ * is significant after a Bonferroni correction for the number of
+ * candidates, and recurse into both halves.
+ */
+
+#define HIST_MAGIC      0x4e555252 /* "RRUN" */
+#define HIST_IDX_MAGIC  0x58444952 /* "RIDX" */
+#define HIST_TAIL_MAX   4096
+#define HIST_MINSEG     5
+#define HIST_ALPHA      0.01
+#define HIST_MINCHANGE  0.02
+
+/* fails to compile if the record is not HIST_REC_LEN */
+typedef char hist_rec_len_check[sizeof (struct hist_rec) == HIST_REC_LEN ? 1 : -1];
+
+struct hist_idx_hdr
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nrecs;        /* records of runs covered */
+	uint64_t nent;
+};
+
+struct hist_idx
+{
+	uint64_t cmdhash;
+	int64_t  start_us;
+	uint32_t recno;
+	uint32_t _pad;
+};
+
+static uint64_t fnv64(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t hist_cmdhash(int argc, char **argv)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (int i = 0; i < argc; i++)
+		h = fnv64(h, argv[i], strlen(argv[i]) + 1);
+	return h;
+}
+
+static uint32_t rec_sum(const struct hist_rec *r)
+{
+	struct hist_rec c = *r;
+
+	c.sum = 0;
+	return fnv64(14695981039346656037ULL, &c, sizeof c) >> 32;
+}
+
+static bool rec_ok(const struct hist_rec *r)
+{
+	return r->magic == HIST_MAGIC && r->sum == rec_sum(r);
+}
+
+/* Reads the first line of dir/name into buf */
+static int read_line_at(const char *dir, const char *name, char *buf, size_t sz)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int rc = -1;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	if (fgets(buf, sz, f)) {
+		buf[strcspn(buf, "\n")] = 0;
+		rc = 0;
+	}
+	fclose(f);
+	return rc;
+}
+
+static int resolve_ref(const char *gitdir, const char *ref, char *buf, size_t sz)
+{
+	char line[512];
+	char path[PATH_MAX];
+	size_t reflen = strlen(ref);
+	FILE *f;
+
+	if (read_line_at(gitdir, ref, buf, sz) == 0)
+		return 0;
+
+	snprintf(path, sizeof path, "%s/packed-refs", gitdir);
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof line, f)) {
+		char *sp = strchr(line, ' ');
+		if (!sp || strncmp(sp + 1, ref, reflen) || sp[1 + reflen] != '\n')
+			continue;
+		*sp = 0;
+		snprintf(buf, sz, "%s", line);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	return -1;
+}
+
+/* The commit checked out in the repository containing cwd, if any */
+static void git_rev(const char *cwd, char *buf, size_t sz)
+{
+	char dir[PATH_MAX], gitdir[PATH_MAX], common[PATH_MAX], head[512];
+	struct stat st;
+
+	buf[0] = 0;
+	snprintf(dir, sizeof dir, "%s", cwd);
+	for (;;) {
+		if (snprintf(gitdir, sizeof gitdir, "%s/.git", dir) >= (int)sizeof gitdir)
+			return;
+		if (stat(gitdir, &st) == 0)
+			break;
+		char *sl = strrchr(dir, '/');
+		if (!sl || sl == dir)
+			return;
+		*sl = 0;
+	}
+
+	/* worktrees and submodules have a file pointing to the real one */
+	if (S_ISREG(st.st_mode)) {
+		if (read_line_at(dir, ".git", head, sizeof head) < 0 || strncmp(head, "gitdir: ", 8))
+			return;
+		if (snprintf(gitdir, sizeof gitdir, "%s%s%s", head[8] == '/' ? "" : dir,
+			     head[8] == '/' ? "" : "/", head + 8) >= (int)sizeof gitdir)
+			return;
+	}
+
+	if (read_line_at(gitdir, "HEAD", head, sizeof head) < 0)
+		return;
+	if (strncmp(head, "ref: ", 5)) {
+		snprintf(buf, sz, "%s", head);
+		return;
+	}
+	if (resolve_ref(gitdir, head + 5, buf, sz) == 0)
+		return;
+	if (read_line_at(gitdir, "commondir", common, sizeof common) == 0) {
+		char path[PATH_MAX];
+		if (snprintf(path, sizeof path, "%s%s%s", common[0] == '/' ? "" : gitdir,
+			     common[0] == '/' ? "" : "/", common) < (int)sizeof path &&
+		    resolve_ref(path, head + 5, buf, sz) == 0)
+			return;
+	}
+	buf[0] = 0;
+}
+
+void hist_init(struct hist_rec *r, int argc, char **argv)
+{
+	char cwd[PATH_MAX];
+	size_t off = 0;
+
+	memset(r, 0, sizeof *r);
+	r->magic = HIST_MAGIC;
+	r->cmdhash = hist_cmdhash(argc, argv);
+	r->mempeak = r->pidpeak = -1;
+	r->interference = -1;
+	r->argc = argc;
+	for (int i = 0; i < argc && off < sizeof r->argv; i++)
+		off += snprintf(r->argv + off, sizeof r->argv - off, "%s", argv[i]) + 1;
+	if (getcwd(cwd, sizeof cwd)) {
+		/* the end of it, if it does not fit */
+		size_t len = strlen(cwd);
+		size_t skip = len >= sizeof r->cwd ? len - (sizeof r->cwd - 1) : 0;
+		memcpy(r->cwd, cwd + skip, len - skip + 1);
+		git_rev(cwd, r->rev, sizeof r->rev);
+	}
+}
+
+static int idx_cmp(const void *a, const void *b)
+{
+	const struct hist_idx *x = a, *y = b;
+
+	if (x->cmdhash != y->cmdhash)
+		return x->cmdhash < y->cmdhash ? -1 : 1;
+	if (x->start_us != y->start_us)
+		return x->start_us < y->start_us ? -1 : 1;
+	return x->recno < y->recno ? -1 : x->recno > y->recno;
+}
+
+/* Maps dir/index. Returns the entries, or NULL (and *hdr zeroed) if there is none. */
+static const struct hist_idx *map_index(const char *dir, struct hist_idx_hdr *hdr, size_t *maplen)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(hdr, 0, sizeof *hdr);
+	snprintf(path, sizeof path, "%s/index", dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof *hdr) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	memcpy(hdr, p, sizeof *hdr);
+	if (hdr->magic != HIST_IDX_MAGIC || hdr->version != 1 ||
+	    (size_t)st.st_size != sizeof *hdr + hdr->nent * sizeof (struct hist_idx)) {
+		munmap(p, st.st_size);
+		memset(hdr, 0, sizeof *hdr);
+		return NULL;
+	}
+	*maplen = st.st_size;
+	return (const struct hist_idx *)((char *)p + sizeof *hdr);
+}
+
+static void unmap_index(const struct hist_idx *ix, size_t maplen)
+{
+	if (ix)
+		munmap((char *)ix - sizeof (struct hist_idx_hdr), maplen);
+}
+
+/* Called with the log locked, nrecs records in it */
+static int rebuild_index(const char *dir, int fd, uint64_t nrecs)
+{
+	struct hist_idx_hdr hdr, nhdr;
+	const struct hist_idx *old;
+	struct hist_idx *tail, *all;
+	struct hist_rec buf[64];
+	size_t maplen = 0;
+	uint64_t ntail = 0, i, j, k;
+	char tmp[PATH_MAX], path[PATH_MAX];
+	int rc = -1, tfd;
+
+	old = map_index(dir, &hdr, &maplen);
+	if (hdr.nrecs > nrecs) {
+		unmap_index(old, maplen);
+		old = NULL;
+		memset(&hdr, 0, sizeof hdr);
+	}
+
+	tail = malloc((nrecs - hdr.nrecs + 1) * sizeof *tail);
+	all = malloc((hdr.nent + nrecs - hdr.nrecs + 1) * sizeof *all);
+	if (!tail || !all)
+		goto out;
+
+	for (i = hdr.nrecs; i < nrecs; ) {
+		ssize_t n = pread(fd, buf, sizeof buf, i * HIST_REC_LEN);
+		if (n < HIST_REC_LEN)
+			goto out;
+		for (k = 0; k < (uint64_t)n / HIST_REC_LEN; k++, i++) {
+			if (!rec_ok(&buf[k]))
+				continue;
+			tail[ntail].cmdhash = buf[k].cmdhash;
+			tail[ntail].start_us = buf[k].start_us;
+			tail[ntail].recno = i;
+			tail[ntail]._pad = 0;
+			ntail++;
+		}
+	}
+	qsort(tail, ntail, sizeof *tail, idx_cmp);
+
+	for (i = j = k = 0; i < hdr.nent || j < ntail; k++) {
+		if (j == ntail || (i < hdr.nent && idx_cmp(&old[i], &tail[j]) <= 0))
+			all[k] = old[i++];
+		else
+			all[k] = tail[j++];
+	}
+
+	nhdr.magic = HIST_IDX_MAGIC;
+	nhdr.version = 1;
+	nhdr.nrecs = nrecs;
+	nhdr.nent = k;
+
+	snprintf(path, sizeof path, "%s/index", dir);
+	snprintf(tmp, sizeof tmp, "%s/index.%i", dir, getpid());
+	tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tfd < 0)
+		goto out;
+	if (write(tfd, &nhdr, sizeof nhdr) != sizeof nhdr ||
+	    write(tfd, all, k * sizeof *all) != (ssize_t)(k * sizeof *all) ||
+	    close(tfd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto out;
+	}
+	rc = 0;
+
+out:
+	unmap_index(old, maplen);
+	free(tail);
+	free(all);
+	return rc;
+}
+
+int hist_append(const char *dir, struct hist_rec *r)
+{
+	char path[PATH_MAX];
+	struct hist_idx_hdr hdr;
+	const struct hist_idx *ix;
+	struct stat st;
+	size_t maplen = 0;
+	int fd, rc = -1, err;
+
+	r->sum = 0;
+	r->sum = rec_sum(r);
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		return -1;
+	snprintf(path, sizeof path, "%s/runs", dir);
+	fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+		goto out;
+
+	/* Drop whatever a writer that crashed mid-record left */
+	if (st.st_size % HIST_REC_LEN) {
+		st.st_size -= st.st_size % HIST_REC_LEN;
+		if (ftruncate(fd, st.st_size) < 0)
+			goto out;
+	}
+	if (write(fd, r, sizeof *r) != sizeof *r) {
+		err = errno ? errno : ENOSPC;
+		if (ftruncate(fd, st.st_size) < 0) {}
+		errno = err;
+		goto out;
+	}
+	rc = 0;
+
+	ix = map_index(dir, &hdr, &maplen);
+	unmap_index(ix, maplen);
+	if (st.st_size / HIST_REC_LEN + 1 - hdr.nrecs >= HIST_TAIL_MAX)
+		rebuild_index(dir, fd, st.st_size / HIST_REC_LEN + 1);
+
+out:
+	err = errno;
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+/* Querying */
+
+struct hrun
+{
+	const struct hist_rec *r;
+	uint64_t recno;
+};
+
+static int hrun_cmp(const void *a, const void *b)
+{
+	const struct hrun *x = a, *y = b;
+
+	if (x->r->start_us != y->r->start_us)
+		return x->r->start_us < y->r->start_us ? -1 : 1;
+	return x->recno < y->recno ? -1 : x->recno > y->recno;
+}
+
+static bool same_cmd(const struct hist_rec *r, int argc, char **argv)
+{
+	size_t off = 0;
+
+	if (r->argc != argc)
+		return false;
+	for (int i = 0; i < argc && off < sizeof r->argv; i++) {
+		size_t len = strnlen(r->argv + off, sizeof r->argv - off);
+		if (strncmp(r->argv + off, argv[i], len))
+			return false;
+		off += len + 1;
+	}
+	return true;
+}
+
+static double key_wall(const struct hist_rec *r) { return r->wall_us / 1e6; }
+static double key_cpu(const struct hist_rec *r)  { return r->usage_us / 1e6; }
+static double key_mem(const struct hist_rec *r)  { return r->mempeak; }
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double median(const double *xs, int n)
+{
+	double w[n];
+
+	memcpy(w, xs, n * sizeof w[0]);
+	qsort(w, n, sizeof w[0], dbl_cmp);
+	return n % 2 ? w[n / 2] : (w[n / 2 - 1] + w[n / 2]) / 2;
+}
+
+struct change
+{
+	int at;
+	double before, after;
+	double p;
+};
+
+/* Mean and variance of xs[lo, hi), from prefix sums of x and x^2 */
+static void seg_stats(const double *s1, const double *s2, int lo, int hi, double *m, double *v)
+{
+	int n = hi - lo;
+	double a = s1[hi] - s1[lo], b = s2[hi] - s2[lo];
+
+	*m = a / n;
+	*v = n > 1 ? (b - a * a / n) / (n - 1) : 0;
+	if (*v < 0)
+		*v = 0;
+}
+
+static void find_changes(const double *s1, const double *s2, double shift, int lo, int hi,
+			 struct change *cs, int *ncs)
+{
+	double best = -1, m1, v1, m2, v2, p;
+	int at = -1;
+
+	if (hi - lo < 2 * HIST_MINSEG)
+		return;
+
+	for (int k = lo + HIST_MINSEG; k <= hi - HIST_MINSEG; k++) {
+		double se, t;
+
+		seg_stats(s1, s2, lo, k, &m1, &v1);
+		seg_stats(s1, s2, k, hi, &m2, &v2);
+		se = v1 / (k - lo) + v2 / (hi - k);
+		t = se > 0 ? fabs(m1 - m2) / sqrt(se) : (m1 != m2 ? INFINITY : 0);
+		if (t > best) {
+			best = t;
+			at = k;
+		}
+	}
+	if (at < 0)
+		return;
+
+	seg_stats(s1, s2, lo, at, &m1, &v1);
+	seg_stats(s1, s2, at, hi, &m2, &v2);
+	p = welch_p(m1, v1, at - lo, m2, v2, hi - at);
+	if (p * (hi - lo - 2 * HIST_MINSEG + 1) >= HIST_ALPHA)
+		return;
+	if (fabs(m2 - m1) < HIST_MINCHANGE * fabs(m1 + shift))
+		return;
+
+	find_changes(s1, s2, shift, lo, at, cs, ncs);
+	cs[*ncs].at = at;
+	cs[*ncs].before = m1 + shift;
+	cs[*ncs].after = m2 + shift;
+	cs[*ncs].p = p;
+	(*ncs)++;
+	find_changes(s1, s2, shift, at, hi, cs, ncs);
+}
+
+static void fmt_date(char *buf, size_t sz, int64_t us)
+{
+	time_t t = us / 1000000;
+	struct tm tm;
+
+	if (!localtime_r(&t, &tm) || !strftime(buf, sz, "%Y-%m-%d %H:%M:%S", &tm))
+		snprintf(buf, sz, "%li", (long)t);
+}
+
+static void fmt_mem(char *buf, size_t sz, double x, bool nohuman)
+{
+	static const char *sufs[] = { "", "Ki", "Mi", "Gi", "Ti", "Pi" };
+	int pow = 0;
+
+	if (x < 0) {
+		snprintf(buf, sz, "-");
+		return;
+	}
+	while (!nohuman && x > 99999 && pow < 5) {
+		x /= 1024;
+		pow++;
+	}
+	snprintf(buf, sz, "%.0f%sB", x, sufs[pow]);
+}
+
+static void fmt_key(char *buf, size_t sz, const char *key, double x, bool nohuman)
+{
+	if (!strcmp(key, "mem"))
+		fmt_mem(buf, sz, x, nohuman);
+	else
+		snprintf(buf, sz, "%.3fs", x);
+}
+
+static void hist_help(const char *progname)
+{
+	fprintf(stderr, "Usage: %s history [options] <cmd> [args...]\n", progname);
+	fprintf(stderr, "Show the runs of <cmd> recorded with --record, oldest first.\n");
+}
+
+int ramon_history(int argc, char **argv)
+{
+	const char *opt_db = getenv("RAMON_RECORD");
+	const char *opt_key = "wall";
+	long opt_last = 30, opt_window = 5;
+	bool opt_nohuman = false;
+	struct opt hist_opts[] = {
+		OPT_STR("db", 0, "Read the runs recorded in <dir> (default: $RAMON_RECORD)", &opt_db),
+		OPT_STR("key", 0, "Track wall, cpu or mem (default: wall)", &opt_key),
+		OPT_INT("last", 'n', "Show the last <int> runs, 0 for all (default 30)", &opt_last),
+		OPT_INT("window", 'w', "Take the rolling median over <int> runs (default 5)", &opt_window),
+		OPT_BOOL("unit", '1', "Output values in single units, no KMG prefixes", &opt_nohuman),
+		OPT_END,
+	};
+	double (*key)(const struct hist_rec *);
+	struct hist_idx_hdr hdr;
+	const struct hist_idx *ix;
+	const struct hist_rec *log = MAP_FAILED;
+	struct hrun *runs = NULL;
+	struct change *cs = NULL;
+	double *xs = NULL, *s1 = NULL, *s2 = NULL, *med = NULL;
+	int *xrun = NULL;
+	size_t maplen = 0, loglen = 0;
+	uint64_t h, nlog = 0, lo, hi;
+	int optind, cargc, nruns = 0, nok = 0, nxs = 0, ncs = 0, first, rc = 1;
+	char **cargv, path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	optind = parse_opts(argc, argv, false, hist_opts);
+	if (optind < 0 || optind == argc || !opt_db) {
+		hist_help("ramon");
+		print_opts(stderr, hist_opts);
+		return 1;
+	}
+	if (!strcmp(opt_key, "wall"))
+		key = key_wall;
+	else if (!strcmp(opt_key, "cpu"))
+		key = key_cpu;
+	else if (!strcmp(opt_key, "mem"))
+		key = key_mem;
+	else {
+		fprintf(stderr, "ramon history: unknown key '%s'\n", opt_key);
+		return 1;
+	}
+	if (opt_window < 1)
+		opt_window = 1;
+
+	cargc = argc - optind;
+	cargv = argv + optind;
+	h = hist_cmdhash(cargc, cargv);
+
+	snprintf(path, sizeof path, "%s/runs", opt_db);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "ramon history: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size >= HIST_REC_LEN) {
+		nlog = st.st_size / HIST_REC_LEN;
+		loglen = nlog * HIST_REC_LEN;
+		log = mmap(NULL, loglen, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (nlog && log == MAP_FAILED) {
+		fprintf(stderr, "ramon history: mmap %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	/* Indexed runs of the command: a range of the index */
+	ix = map_index(opt_db, &hdr, &maplen);
+	if (hdr.nrecs > nlog)
+		hdr.nrecs = hdr.nent = 0;
+	lo = 0;
+	hi = hdr.nent;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (ix[mid].cmdhash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (hi = lo; hi < hdr.nent && ix[hi].cmdhash == h; hi++)
+		;
+
+	runs = malloc((hi - lo + nlog - hdr.nrecs + 1) * sizeof *runs);
+	if (!runs)
+		goto out;
+	for (uint64_t i = lo; i < hi; i++) {
+		const struct hist_rec *r = &log[ix[i].recno];
+		if (ix[i].recno < nlog && same_cmd(r, cargc, cargv))
+			runs[nruns++] = (struct hrun){ r, ix[i].recno };
+	}
+	/* and the ones appended since */
+	for (uint64_t i = hdr.nrecs; i < nlog; i++) {
+		const struct hist_rec *r = &log[i];
+		if (r->cmdhash == h && rec_ok(r) && same_cmd(r, cargc, cargv))
+			runs[nruns++] = (struct hrun){ r, i };
+	}
+	qsort(runs, nruns, sizeof *runs, hrun_cmp);
+
+	if (!nruns) {
+		fprintf(stderr, "ramon history: no runs of this command in %s\n", opt_db);
+		goto out;
+	}
+
+	/* The series: successful runs with a value for the key */
+	xs = malloc(nruns * sizeof *xs);
+	xrun = malloc(nruns * sizeof *xrun);
+	med = malloc(nruns * sizeof *med);
+	s1 = malloc((nruns + 1) * sizeof *s1);
+	s2 = malloc((nruns + 1) * sizeof *s2);
+	cs = malloc(nruns * sizeof *cs);
+	if (!xs || !xrun || !med || !s1 || !s2 || !cs)
+		goto out;
+	for (int i = 0; i < nruns; i++) {
+		med[i] = NAN;
+		if (runs[i].r->exitcode)
+			continue;
+		nok++;
+		if (key(runs[i].r) < 0)
+			continue;
+		xs[nxs] = key(runs[i].r);
+		xrun[nxs] = i;
+		nxs++;
+	}
+	for (int i = 0; i < nxs; i++) {
+		int from = i + 1 >= opt_window ? i + 1 - opt_window : 0;
+		med[xrun[i]] = median(xs + from, i + 1 - from);
+	}
+
+	/* shifted by the first value, for precision in the sums of squares */
+	s1[0] = s2[0] = 0;
+	for (int i = 0; i < nxs; i++) {
+		double d = xs[i] - xs[0];
+		s1[i + 1] = s1[i] + d;
+		s2[i + 1] = s2[i] + d * d;
+	}
+	if (nxs)
+		find_changes(s1, s2, xs[0], 0, nxs, cs, &ncs);
+
+	{
+		char d0[32], d1[32];
+		fmt_date(d0, sizeof d0, runs[0].r->start_us);
+		fmt_date(d1, sizeof d1, runs[nruns - 1].r->start_us);
+		printf("command  ");
+		for (int i = 0; i < cargc; i++)
+			printf("%s%s", i ? " " : "", cargv[i]);
+		printf("\nruns     %i (%i ok), %s to %s\n\n", nruns, nok, d0, d1);
+	}
+
+	printf("  %-19s  %-12s  %4s  %10s  %10s  %10s  %10s\n",
+	       "date", "rev", "exit", "wall", "cpu", "mempeak", "median");
+	first = opt_last > 0 && nruns > opt_last ? nruns - opt_last : 0;
+	for (int i = first, c = 0; i < nruns; i++) {
+		const struct hist_rec *r = runs[i].r;
+		char date[32], mem[32], m[32];
+		bool changed = false;
+
+		while (c < ncs && xrun[cs[c].at] < i)
+			c++;
+		if (c < ncs && xrun[cs[c].at] == i)
+			changed = true;
+
+		fmt_date(date, sizeof date, r->start_us);
+		fmt_mem(mem, sizeof mem, r->mempeak, opt_nohuman);
+		if (isnan(med[i]))
+			snprintf(m, sizeof m, "-");
+		else
+			fmt_key(m, sizeof m, opt_key, med[i], opt_nohuman);
+		printf("%c %-19s  %-12.12s  %4i  %9.3fs  %9.3fs  %10s  %10s\n",
+		       changed ? '*' : ' ', date, r->rev[0] ? r->rev : "-", r->exitcode,
+		       r->wall_us / 1e6, r->usage_us / 1e6, mem, m);
+	}
+
+	if (ncs) {
+		printf("\nchange points (%s)\n", opt_key);
+		for (int c = 0; c < ncs; c++) {
+			const struct hist_rec *r = runs[xrun[cs[c].at]].r;
+			char date[32], b[32], a[32];
+			fmt_date(date, sizeof date, r->start_us);
+			fmt_key(b, sizeof b, opt_key, cs[c].before, opt_nohuman);
+			fmt_key(a, sizeof a, opt_key, cs[c].after, opt_nohuman);
+			printf("* %-19s  %-12.12s  %10s -> %-10s  %+6.1f%%  p=%.2g\n",
+			       date, r->rev[0] ? r->rev : "-", b, a,
+			       100 * (cs[c].after - cs[c].before) / cs[c].before, cs[c].p);
+		}
+	}
+	rc = 0;
+
+out:
+	if (log != MAP_FAILED)
+		munmap((void *)log, loglen);
+	unmap_index(ix, maplen);
+	free(runs);
+	free(xs);
+	free(xrun);
+	free(med);
+	free(s1);
+	free(s2);
+	free(cs);
+	return rc;
+}
@@ -0,0 +1,43 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H 1
+
+#include <stdint.h>
+
+#define HIST_REC_LEN 512
+
+/*
+ * One run in the log of `ramon --record <dir>'. Records have a fixed
+ * size, so that the n-th run is at n * HIST_REC_LEN.
+ */
+struct hist_rec
+{
+	uint32_t magic;
+	uint32_t sum;          /* of the whole record, with sum = 0 */
+	uint64_t cmdhash;      /* of argv, see hist_cmdhash() */
+	int64_t  start_us;     /* realtime */
+	int64_t  wall_us;
+	int64_t  usage_us;
+	int64_t  user_us;
+	int64_t  system_us;
+	int64_t  mempeak;      /* -1 if not available */
+	int64_t  pidpeak;      /* -1 if not available */
+	double   interference; /* -1 if not measured */
+	int32_t  exitcode;
+	int32_t  argc;
+	char     rev[48];      /* git HEAD of cwd, if any */
+	char     cwd[160];
+	char     argv[216];    /* NUL-separated, maybe truncated */
+};
+
+uint64_t hist_cmdhash(int argc, char **argv);
+
+/* Fills in the command, cwd and git revision, and zeroes the rest */
+void hist_init(struct hist_rec *r, int argc, char **argv);
+
+/* Appends r to the log in dir. Returns 0, or -1 with errno set. */
+int hist_append(const char *dir, struct hist_rec *r);
+
+/* `ramon history <cmd>', argv[0] is "history" */
+int ramon_history(int argc, char **argv);
+
+#endif
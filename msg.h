@@ -0,0 +1,53 @@
+#ifndef __MSG_H
+#define __MSG_H 1
+
+#include <stdint.h>
+
+/*
+ * Messages sent over $RAMONSOCK to an enclosing ramon. Each one is a
+ * fixed header followed by len bytes of payload, so a reader can split
+ * a stream of coalesced or partial writes back into messages. The
+ * timestamp is taken by the sender, with CLOCK_MONOTONIC, so it does
+ * not depend on how fast the receiver gets to it.
+ *
+ * Every header starts with the magic, which also tells apart old
+ * senders that wrote a bare string per mark.
+ */
+
+#define RAMON_MSG_MAGIC 0x314e4d52 /* "RMN1" */
+
+enum ramon_msg_type {
+	RAMON_MSG_MARK = 1,     /* payload: mark label, not NUL-terminated */
+	RAMON_MSG_SUMMARY = 2,  /* payload: struct ramon_msg_summary */
+};
+
+struct ramon_msg_hdr {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t len;           /* payload length */
+	int32_t  pid;           /* sender */
+	uint32_t _pad;
+	uint64_t ts_ns;         /* CLOCK_MONOTONIC */
+};
+
+#define RAMON_MSG_MAXLEN UINT16_MAX
+
+/*
+ * Final results of a nested invocation, sent when it finishes. The
+ * cgroup path identifies it, and its position in the tree of
+ * invocations. The header's timestamp is the end time.
+ */
+struct ramon_msg_summary {
+	int64_t  usage_usec;
+	int64_t  user_usec;
+	int64_t  system_usec;
+	int64_t  mempeak;
+	int64_t  pidpeak;
+	int64_t  wall_usec;
+	int32_t  exitcode;
+	uint16_t pathlen;
+	uint16_t cmdlen;
+	/* followed by pathlen bytes of cgroup path and cmdlen of command */
+};
+
+#endif
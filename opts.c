@@ -35,6 +35,8 @@ static int handle1(struct opt *o, bool negated, const char *optarg)
 static int parse_long(int nopts, struct opt opts[], const char *optname, const char *maybearg)
 {
 	bool negated = false;
+	const char *eq;
+	size_t namelen;
 	int i;
 
 	if (strlen(optname) > 3 && strncmp(optname, "no-", 3) == 0) {
@@ -42,18 +44,32 @@ static int parse_long(int nopts, struct opt opts[], const char *optname, const c
 		negated = true;
 	}
 
-	for (i = 0; i < nopts; i++) {
-		/* TODO: handle --opt=arg */
-		if (opts[i].longname && !strcmp(optname, opts[i].longname)) {
-			int rc = handle1(&opts[i], negated, opts[i].has_arg == HAS_ARG_YES ? maybearg : NULL);
-			if (rc < 0)
-				return rc;
+	/* --opt=arg form, the argument is in the same word */
+	eq = strchr(optname, '=');
+	namelen = eq ? (size_t)(eq - optname) : strlen(optname);
 
-			if (opts[i].has_arg == HAS_ARG_YES)
-				return 1;
-			else
-				return 0;
+	for (i = 0; i < nopts; i++) {
+		if (!opts[i].longname)
+			continue;
+		if (strlen(opts[i].longname) != namelen || strncmp(optname, opts[i].longname, namelen))
+			continue;
+
+		if (eq) {
+			if (opts[i].has_arg == HAS_ARG_NO) {
+				fprintf(stderr, "option '--%s' takes no argument\n", opts[i].longname);
+				return -1;
+			}
+			return handle1(&opts[i], negated, eq + 1);
 		}
+
+		int rc = handle1(&opts[i], negated, opts[i].has_arg == HAS_ARG_YES ? maybearg : NULL);
+		if (rc < 0)
+			return rc;
+
+		if (opts[i].has_arg == HAS_ARG_YES)
+			return 1;
+		else
+			return 0;
 	}
 
 	fprintf(stderr, "unknown option: '--%s'\n", optname);
@@ -13,13 +13,18 @@ def parse_mem(s):
     r = search("{:d}{:l}", s).fixed
     mem = r[0]
     memU = r[1]
+    # ramon's humanize() is 1024-based, as are the trailer's exact bytes
     match memU:
         case "KiB":
-            mem *= 1000;
+            mem *= 1024;
         case "MiB":
-            mem *= 1000000;
+            mem *= 1024 ** 2;
         case "GiB":
-            mem *= 1000000000;
+            mem *= 1024 ** 3;
+        case "TiB":
+            mem *= 1024 ** 4;
+        case "PiB":
+            mem *= 1024 ** 5;
     return mem
 
 def humanize(n):
@@ -39,22 +44,49 @@ def humanize(n):
         suf = suf + 1
     return str(n) + sufs[suf]
 
+TRAILER_LEN = 256
+TRAILER_MAGIC = "#ramon-trailer 1 "
+
+def load_trailer(fn):
+    # The last TRAILER_LEN bytes written by ramon, if it finished
+    with open(fn, 'rb') as f:
+        f.seek(0, 2)
+        size = f.tell()
+        if size < TRAILER_LEN:
+            return None
+        f.seek(size - TRAILER_LEN)
+        t = f.read(TRAILER_LEN).decode(errors='replace')
+    if not t.startswith(TRAILER_MAGIC):
+        return None
+    return dict(kv.split('=', 1) for kv in t.split()[2:])
+
 def do_load_ramon_file(dir, fn):
     ret = {}
     ret["fn"] = fn.removesuffix(".ramon")
     ret["basefn"] = fn.removesuffix(".ramon").removeprefix(dir + '/')
-    with open(fn) as f:
-        for line in f:
-            comps = line.split()
-            if comps[0] == "group.total":
-                t = parse_time(comps[1])
-                ret["time"] = t
-            elif comps[0] == "group.mempeak":
-                m = parse_mem(comps[1])
-                ret["mem"] = m
-            elif comps[0] == "exitcode":
-                m = int(comps[1])
-                ret["rc"] = m
+    tr = load_trailer(fn)
+    if tr:
+        ret["time"] = int(tr["total_us"]) / 1e6
+        ret["rc"] = int(tr["exitcode"])
+        if int(tr["mempeak"]) > 0:
+            ret["mem"] = int(tr["mempeak"])
+        if float(tr["interference"]) >= 0:
+            ret["interference"] = float(tr["interference"])
+    else:
+        with open(fn) as f:
+            for line in f:
+                comps = line.split()
+                if comps[0] == "group.total":
+                    t = parse_time(comps[1])
+                    ret["time"] = t
+                elif comps[0] == "group.mempeak":
+                    m = parse_mem(comps[1])
+                    ret["mem"] = m
+                elif comps[0] == "exitcode":
+                    m = int(comps[1])
+                    ret["rc"] = m
+                elif comps[0] == "interference":
+                    ret["interference"] = float(comps[1].removesuffix("%"))
 
     if not "rc" in ret or not "time" in ret or not "mem" in ret:
         print(f"Warning: ignoring {fn} since it is incomplete")
@@ -159,6 +191,17 @@ def sort_and_print_match(pi, n, ms, reverse=True):
         tperc = round(100 * (tdiff / time_l), 1)
         print(f"|{fn:90}  |{time_l:8.3f}s  |{time_r:8.3f}s  |{tdiff:8.3f}s  |{tperc:4}%|")
 
+def print_noisy(thr, ds):
+    print(f"|{'FILE':90} |{'TIME':8} |{'INTERFERENCE':12}|")
+    print(f"|------------|----------:|---------:|")
+    ds = list(filter(lambda d : d.get("interference", 0) > thr, ds))
+    ds.sort(key=lambda d : d["interference"], reverse=True)
+    for d in ds:
+        fn = d["fn"]
+        time = d["time"]
+        intf = d["interference"]
+        print(f"|{fn:90} |{time :8.3f}s |{intf:11.2f}%|")
+
 def sort_and_print(pi, n, ds):
     print(f"|{'FILE':90} |{'TIME':8} |{'MEM':11}|")
     print(f"|------------|----------:|---------:|")
@@ -189,7 +232,7 @@ def begin_section(hdr):
 def end_section():
     print("</details>")
 
-def go (r1, r2):
+def go (r1, r2, noisy):
     f_lhs = find(r1)
     f_rhs = find(r2)
 
@@ -264,6 +307,10 @@ def go (r1, r2):
     sort_and_print(pi_mem, 20, rhs)
     end_section()
 
+    begin_section(f"NOISY RUNS (INTERFERENCE > {noisy}%)")
+    print_noisy(noisy, all)
+    end_section()
+
     begin_section("FULL COMPARISON")
     sort_and_print_match(lambda x : x['fn'], -1, matches, reverse=False)
     end_section()
@@ -295,6 +342,8 @@ def main():
     parser = argparse.ArgumentParser()
     parser.add_argument('lhs', help='directory/URL for the old run')
     parser.add_argument('rhs', help='directory/URL for the new run')
+    parser.add_argument('--noisy', type=float, default=5.0,
+                        help='flag runs where other workloads used more than this %% of the host CPU (default 5)')
     args = parser.parse_args()
 
     print(f'Comparing {args.lhs} and {args.rhs}')
@@ -305,6 +354,6 @@ def main():
     lhs = lhs.rstrip('/')
     rhs = rhs.rstrip('/')
 
-    go(lhs, rhs)
+    go(lhs, rhs, args.noisy)
 
 main()
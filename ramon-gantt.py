@@ -2,9 +2,46 @@
 
 from parse import *
 
+def load_procs(fn):
+    # Process spans from ramon --proctree, as (pid, ppid, comm, start, end)
+    procs = []
+    with open(fn) as f:
+        for line in f:
+            if not line.startswith("proc "):
+                continue
+            r = search("pid={:d} ppid={:d} comm={:S} start={:g}s end={:g}s", line).fixed
+            procs.append(r)
+    return procs
+
+def print_tree(procs):
+    # One line per process, listing its spans (one per exec) in order
+    spans = {}
+    children = {}
+    for p in procs:
+        if not p[0] in spans:
+            children.setdefault(p[1], []).append(p[0])
+        spans.setdefault(p[0], []).append(p)
+
+    def go(pid, depth):
+        ss = sorted(spans[pid], key=(lambda p : p[3]))
+        names = " -> ".join(map(lambda p : p[2], ss))
+        start = ss[0][3]
+        end = ss[-1][4]
+        print(f"{'  ' * depth}[{pid}] {names}  {start:.3f}s-{end:.3f}s ({end - start:.3f}s)")
+        for c in sorted(children.get(pid, []), key=(lambda c : spans[c][0][3])):
+            go(c, depth + 1)
+
+    for ppid in children:
+        if not ppid in spans:
+            for c in children[ppid]:
+                go(c, 0)
+
 def load_file(fn):
     intervals = {}
 
+    for (pid, ppid, comm, start, end) in load_procs(fn):
+        intervals[f"{comm}:{pid}@{start}"] = { 'start': start, 'end': end }
+
     with open(fn) as f:
         for line in f:
             if not (search("mark" , line)):
@@ -41,7 +78,7 @@ def color(intervals):
         end=i[1]['end']
         color=0
         for color in range(0,999):
-            print (f"trying {color}")
+            #  print(f"trying {color}")
             if not (color in running) or running[color][1] <= start:
                 running[color] = (i[0], end)
                 break
@@ -106,10 +143,15 @@ def main():
     parser = argparse.ArgumentParser()
     parser.add_argument("file", help="ramon output with marks")
     parser.add_argument("--open", action="store_true", help="open the generated image")
+    parser.add_argument("--tree", action="store_true", help="print the process tree recorded with ramon --proctree")
     args = parser.parse_args()
 
     file = args.file
 
+    if args.tree:
+        print_tree(load_procs(file))
+        return
+
     intervals = load_file(file)
 
     maxcol, sch = color(intervals)
@@ -0,0 +1,199 @@
+#ifndef __RAMON_MARK_H
+#define __RAMON_MARK_H 1
+
+/*
+ * Header-only API to send marks to an enclosing ramon without any
+ * syscalls. ramon creates a ring buffer in a file, $RAMONRING/ring,
+ * next to a fifo, $RAMONRING/wake. This header opens and maps them on
+ * first use and appends records to the ring using only atomic
+ * operations; ramon drains it at every poll, or earlier if it gets half
+ * full and we write to the fifo.
+ *
+ *   #include "ramon-mark.h"
+ *
+ *   ramon_mark_begin("parse");
+ *   ...
+ *   ramon_mark_end("parse");
+ *
+ * Begin and end marks show up as "parse.0" and "parse.1", just like
+ * with `ramon --mark'. Labels longer than RAMON_RING_LABEL_LEN are
+ * truncated. When not running under ramon, or if the ring is full,
+ * marks are silently dropped (the latter are counted by ramon).
+ *
+ * The pid in the records is the one at the time of the first mark. A
+ * child forked after that should call ramon_mark_init() again.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RAMON_RING_VAR       "RAMONRING"
+#define RAMON_RING_MAGIC     0x474e5252 /* "RRNG" */
+#define RAMON_RING_LABEL_LEN 40
+
+enum ramon_ring_type {
+	RAMON_RING_MARK  = 0,
+	RAMON_RING_BEGIN = 1,
+	RAMON_RING_END   = 2,
+};
+
+/* One cache line per record */
+struct ramon_ring_rec {
+	uint64_t seq;          /* see below */
+	uint64_t ts_ns;        /* CLOCK_MONOTONIC */
+	int32_t  pid;
+	uint16_t type;
+	uint16_t len;
+	char     label[RAMON_RING_LABEL_LEN];
+};
+
+/*
+ * A bounded multi-producer ring, a la Vyukov. Slot i starts with
+ * seq = i. A producer claims position pos by moving head from pos to
+ * pos + 1, fills the slot and publishes it by setting seq = pos + 1.
+ * The consumer (ramon) reads it when it sees seq == pos + 1, and hands
+ * it back by setting seq = pos + nslots.
+ */
+struct ramon_ring {
+	uint32_t magic;
+	uint32_t nslots;       /* power of two */
+	uint32_t _pad0[2];
+	uint64_t dropped;
+	char     _pad1[64 - 24];
+	uint64_t head;         /* next position to claim, producers */
+	char     _pad2[64 - 8];
+	uint64_t tail;         /* next position to read, ramon */
+	char     _pad3[64 - 8];
+	struct ramon_ring_rec slots[];
+};
+
+static struct ramon_ring *ramon_ring__p __attribute__((unused));
+static int32_t ramon_ring__pid __attribute__((unused));
+static int ramon_ring__wake __attribute__((unused)) = -1;
+
+static inline struct ramon_ring *ramon_mark_init(void)
+{
+	struct ramon_ring *r = NULL;
+	const char *e = getenv(RAMON_RING_VAR);
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, wfd;
+
+	ramon_ring__pid = getpid();
+	if (!e)
+		return NULL;
+
+	snprintf(path, sizeof path, "%s/ring", e);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof *r) {
+		close(fd);
+		return NULL;
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	r = (struct ramon_ring *)p;
+	if (r->magic != RAMON_RING_MAGIC) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	/* ramon keeps the fifo open for reading, so this does not block */
+	snprintf(path, sizeof path, "%s/wake", e);
+	wfd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+
+	/* Another thread may have beaten us to it */
+	struct ramon_ring *expected = NULL;
+	if (!__atomic_compare_exchange_n(&ramon_ring__p, &expected, r, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		munmap(p, st.st_size);
+		if (wfd >= 0)
+			close(wfd);
+		r = expected;
+	} else {
+		__atomic_store_n(&ramon_ring__wake, wfd, __ATOMIC_RELEASE);
+	}
+
+	return r;
+}
+
+static inline void ramon_ring_put(enum ramon_ring_type type, const char *label)
+{
+	struct ramon_ring *r = __atomic_load_n(&ramon_ring__p, __ATOMIC_ACQUIRE);
+	struct ramon_ring_rec *rec;
+	uint64_t pos, seq;
+	struct timespec ts;
+	size_t len;
+
+	if (!r && !(r = ramon_mark_init()))
+		return;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		rec = &r->slots[pos & (r->nslots - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			/* pos was reloaded, retry */
+		} else if ((int64_t)(seq - pos) < 0) {
+			/* full */
+			__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	len = strlen(label);
+	if (len > RAMON_RING_LABEL_LEN)
+		len = RAMON_RING_LABEL_LEN;
+
+	rec->ts_ns = 1000000000ull * ts.tv_sec + ts.tv_nsec;
+	rec->pid = ramon_ring__pid;
+	rec->type = type;
+	rec->len = len;
+	memcpy(rec->label, label, len);
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Wake ramon up if we just filled half of the ring */
+	if (pos + 1 - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) == r->nslots / 2) {
+		int wfd = __atomic_load_n(&ramon_ring__wake, __ATOMIC_ACQUIRE);
+		if (wfd >= 0) {
+			ssize_t rc = write(wfd, "w", 1);
+			(void)rc; /* if this fails, ramon drains it on the next poll anyway */
+		}
+	}
+}
+
+static inline void ramon_mark(const char *label)
+{
+	ramon_ring_put(RAMON_RING_MARK, label);
+}
+
+static inline void ramon_mark_begin(const char *label)
+{
+	ramon_ring_put(RAMON_RING_BEGIN, label);
+}
+
+static inline void ramon_mark_end(const char *label)
+{
+	ramon_ring_put(RAMON_RING_END, label);
+}
+
+#endif
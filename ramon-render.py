@@ -43,6 +43,46 @@ def load_file(fn):
 
     return rloads, loads, mems, marks
 
+def load_percpu(fn):
+    # Rows of "percpu wall=... busy=<one digit per cpu>", see ramon --percpu
+    cpus = ""
+    walls = []
+    rows = []
+    with open(fn) as f:
+        for line in f:
+            if line.startswith("percpu.cpus"):
+                cpus = line.split()[1]
+                continue
+            if not line.startswith("percpu "):
+                continue
+            walls.append(search("wall={:g}", line).fixed[0])
+            busy = search("busy={:w}", line).fixed[0]
+            rows.append([int(c) * 10 + 5 for c in busy])
+    return cpus, walls, rows
+
+def plot_percpu(fn, cpus, walls, rows):
+    import matplotlib.pyplot as plt
+    import numpy as np
+
+    # cpu x time, so time runs left to right as in the main plot
+    m = np.array(rows).transpose()
+    ncpu = m.shape[0]
+
+    plt.figure(figsize=(12, max(2, ncpu / 8)), dpi=400)
+    plt.imshow(m, aspect='auto', interpolation='nearest', cmap='inferno',
+               vmin=0, vmax=100, origin='lower',
+               extent=(0, max(walls), -0.5, ncpu - 0.5))
+    plt.colorbar(label="Busy %")
+    plt.xlabel("Wall clock time")
+    plt.ylabel(f"CPU (of {cpus})")
+    plt.title("Per-CPU utilization")
+    plt.figtext(0.006, 0.02, "Generated by ramon", size=4)
+
+    imagefn = fn + ".percpu.png"
+    plt.savefig(imagefn)
+    print("Saved image in {}".format(imagefn))
+    return imagefn
+
 def plot(fn, rloads, loads, mems, marks):
     import matplotlib.pyplot as plt
     import numpy as np
@@ -106,6 +146,10 @@ def render_one(file):
 
     img = plot(file, rloads, loads, mems, marks)
 
+    cpus, walls, rows = load_percpu(file)
+    if rows:
+        plot_percpu(file, cpus, walls, rows)
+
     return img
 
 def main():
@@ -0,0 +1,95 @@
+#ifndef __RAMON_STATS_H
+#define __RAMON_STATS_H 1
+
+/*
+ * Layout of the page published by `ramon --stats-page=<file>'. ramon
+ * rewrites it at every poll; any number of readers can map the file
+ * and take snapshots without syscalls:
+ *
+ *   #include "ramon-stats.h"
+ *
+ *   int fd = open(path, O_RDONLY);
+ *   const struct ramon_stats_page *p =
+ *           mmap(NULL, sizeof *p, PROT_READ, MAP_SHARED, fd, 0);
+ *   struct ramon_stats st;
+ *   ramon_stats_read(p, &st);
+ *
+ * The page is guarded by a sequence lock: the writer makes seq odd
+ * while it updates the stats and even again when it is done, so a
+ * reader that saw the same even seq before and after copying them has
+ * a consistent snapshot. The writer never waits for readers.
+ *
+ * When the run ends the page stays, with state RAMON_STATS_DONE and the
+ * exit code filled in. If ramon dies before that, state is left at
+ * RAMON_STATS_RUNNING; check that pid is still alive.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define RAMON_STATS_MAGIC   0x54534d52 /* "RMST" */
+#define RAMON_STATS_VERSION 1
+
+enum ramon_stats_state {
+	RAMON_STATS_STARTING = 0,      /* no poll yet */
+	RAMON_STATS_RUNNING  = 1,
+	RAMON_STATS_DONE     = 2,
+};
+
+struct ramon_stats {
+	int64_t  wall_us;      /* time of the last poll, since the start */
+	int64_t  usage_usec;
+	int64_t  user_usec;
+	int64_t  system_usec;
+	int64_t  mempeak;      /* -1 if not available */
+	int64_t  pidpeak;      /* -1 if not available */
+	int64_t  memcurr;      /* -1 if not available */
+	double   load;         /* since the previous poll */
+	double   rootload;
+	int32_t  state;
+	int32_t  exitcode;     /* valid once done */
+};
+
+struct ramon_stats_page {
+	uint32_t magic;
+	uint32_t version;
+	int32_t  pid;          /* of ramon */
+	int32_t  child_pid;
+	char     cmd[256];
+	char     _pad0[64 - (16 + 256) % 64];
+	uint64_t seq;          /* odd while being written */
+	struct ramon_stats stats;
+};
+
+/* Returns 0, or -1 if the page is not a ramon stats page */
+static inline int ramon_stats_read(const struct ramon_stats_page *p,
+				   struct ramon_stats *wo)
+{
+	uint64_t s1, s2;
+
+	if (p->magic != RAMON_STATS_MAGIC || p->version != RAMON_STATS_VERSION)
+		return -1;
+
+	do {
+		while ((s1 = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(wo, (const void *)&p->stats, sizeof *wo);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&p->seq, __ATOMIC_RELAXED);
+	} while (s1 != s2);
+
+	return 0;
+}
+
+static inline void ramon_stats_write(struct ramon_stats_page *p,
+				     const struct ramon_stats *st)
+{
+	uint64_t s = p->seq;
+
+	__atomic_store_n(&p->seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&p->stats, st, sizeof *st);
+	__atomic_store_n(&p->seq, s + 2, __ATOMIC_RELEASE);
+}
+
+#endif
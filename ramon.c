@@ -1,21 +1,36 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/genetlink.h>
 #include <linux/limits.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
+#include <linux/taskstats.h>
+#include <netinet/in.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -23,7 +38,14 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "compare.h"
+#include "history.h"
+#include "render.h"
+#include "samples.h"
+#include "msg.h"
 #include "opts.h"
+#include "ramon-mark.h"
+#include "ramon-stats.h"
 
 #define TIMEOUT_SIGNAL SIGUSR2
 #define TIMEOUT_SIGNAL_VAL (0x24021992)
@@ -58,6 +80,32 @@ long          opt_timeout     = 0;
 long          opt_maxstack    = 0;
 bool          opt_noclobber   = false;
 bool          opt_nohuman     = false;
+const char  * opt_cpus        = NULL;
+const char  * opt_mems        = NULL;
+bool          opt_interference = true;
+bool          opt_percpu      = false;
+bool          opt_schedstat   = false;
+bool          opt_taskstats   = false;
+bool          opt_proctree    = false;
+bool          opt_ring        = true;
+bool          opt_phases      = false;
+const char  * opt_trace       = NULL;
+bool          opt_critpath    = false;
+const char  * opt_serve       = NULL;
+const char  * opt_stats_page  = NULL;
+const char  * opt_peek        = NULL;
+bool          opt_tui         = false;
+const char  * opt_record      = NULL;
+const char  * opt_samples     = NULL;
+const char  * opt_baseline    = NULL;
+const char  * opt_budget      = NULL;
+long          opt_samples_max = 0;
+long          opt_samples_keep = 600;
+long          opt_jobserver   = 0;
+const char  * opt_on_limit    = "kill";
+bool          opt_freeze      = false;
+bool          opt_wss         = false;
+bool          opt_peak_procs  = false;
 
 struct opt ramon_opts[] = {
 	OPT_STR("output", 'o', "Output to <file> instead", &opt_outfile),
@@ -73,9 +121,34 @@ struct opt ramon_opts[] = {
 	OPT_INT("limit-cpu", 0, "Limit the group's CPU usage to <int> CPU-seconds", &opt_maxcpu),
 	OPT_INT("limit-time", 0, "Limit the total runtime to <int> wall clock seconds", &opt_timeout),
 	OPT_INT("limit-stack", 0, "Limit *each subprocess* stack to <int> bytes, this is done via ulimit", &opt_maxstack),
+	OPT_STR("cpus-list", 0, "Pin the group to the CPUs in <list> (e.g. 0-15,32), via cpuset.cpus", &opt_cpus),
+	OPT_STR("mems", 0, "Bind the group to the NUMA nodes in <list>, via cpuset.mems", &opt_mems),
 	OPT_ACTION("help", 'h', "Display help output and exit", NULL, &help_cb),
+	OPT_BOOL("interference", 0, "Measure CPU and memory used outside of the group during the run", &opt_interference),
+	OPT_BOOL("percpu", 0, "Record the group's per-CPU busy time at every poll", &opt_percpu),
+	OPT_BOOL("schedstat", 0, "Account the time the group's tasks spent waiting for a CPU, and their context switches", &opt_schedstat),
+	OPT_BOOL("taskstats", 0, "Get an exit record for every task in the group and summarize them per command (needs CAP_NET_ADMIN)", &opt_taskstats),
+	OPT_BOOL("proctree", 0, "Record every fork/exec/exit in the group and output the process spans (needs CAP_NET_ADMIN)", &opt_proctree),
+	OPT_BOOL("ring", 0, "Expose a shared-memory ring for marks via $" RAMON_RING_VAR ", see ramon-mark.h", &opt_ring),
+	OPT_BOOL("phases", 0, "Account CPU, I/O and peak memory for each phase between marks", &opt_phases),
+	OPT_STR("trace", 0, "Stream a Chrome/Perfetto trace of polls, marks and processes to <file>", &opt_trace),
+	OPT_BOOL("critpath", 0, "Find the chain of X.0/X.1 intervals that bounds the wall time", &opt_critpath),
+	OPT_STR("serve", 0, "Serve OpenMetrics of the latest poll on <unix-path|127.0.0.1:port>", &opt_serve),
+	OPT_STR("stats-page", 0, "Publish the latest poll in a shared-memory page at <file>, see ramon-stats.h", &opt_stats_page),
+	OPT_STR("peek", 0, "Print the stats page at <file> of a running ramon, and do nothing else", &opt_peek),
+	OPT_BOOL("tui", 0, "Show a live panel at the bottom of the terminal, and the command's output above it", &opt_tui),
+	OPT_STR("record", 0, "Append a summary of the run to the history in <dir>, see `ramon history'", &opt_record),
+	OPT_STR("samples", 0, "Store the polls compactly in <file> instead of the output, see `ramon samples'", &opt_samples),
+	OPT_INT("samples-max", 0, "Keep the --samples file under <int> bytes by rolling up old polls", &opt_samples_max),
+	OPT_INT("samples-keep", 0, "Never roll up the polls of the last <int> seconds (default 600)", &opt_samples_keep),
+	OPT_STR("baseline", 0, "Compare polls and the summary with those of the earlier run saved in <file>", &opt_baseline),
+	OPT_STR("budget", 0, "Exit with 99 if the run is slower than --baseline by more than e.g. time=+5%,cpu=+5%,mem=+10%", &opt_budget),
+	OPT_INT("jobserver", 0, "Be a make jobserver with <int> jobs, fewer when memory is short", &opt_jobserver),
+	OPT_STR("on-limit", 0, "What to do when a limit is reached: kill (default) or freeze, see README", &opt_on_limit),
+	OPT_BOOL("wss", 0, "Estimate the working set by making the kernel reclaim memory until it refaults", &opt_wss),
+	OPT_BOOL("peak-procs", 0, "Show the memory of each process at the group's memory peak", &opt_peak_procs),
 	OPT_BOOL("unit", '1', "Output values in single units, no KMG prefixes", &opt_nohuman),
-	OPT_BOOL("render", 0, "Render a graph with the usag information obtained. Requires --tee or --output.", &opt_render),
+	OPT_BOOL("render", 0, "Render a graph of the polls and marks into <output>.svg. Requires --tee or --output.", &opt_render),
 	OPT_INC(NULL, 'd', "Increase debug level", &opt_debug),
 	OPT_INC(NULL, 'v', "Increase verbosity", &opt_verbosity),
 	OPT_INC(NULL, 'q', "Decrease verbosity", &opt_quiet),
@@ -94,6 +167,13 @@ struct cgroup_res_info
 
 long clk_tck;
 long nproc;
+/* the command we run, for summaries sent upwards */
+char cmd_str[256];
+int cmd_argc;
+char **cmd_argv;
+/* effective CPU set of the group, in cpu-list format */
+char cpus_effective[256];
+cpu_set_t cpus_set;
 
 struct procstat_info
 {
@@ -106,6 +186,8 @@ struct procstat_info
 int cgroup_fd;
 /* parent cgroup directory */
 char cgroupfs_root[PATH_MAX];
+/* root of the cgroup2 mount (the root cgroup) */
+char cgroup_mnt[PATH_MAX];
 /* our cgroup */
 char cgroup_path[PATH_MAX];
 
@@ -119,6 +201,8 @@ char sock_down_path[PATH_MAX];
 
 int gopipe[2];
 
+int sfd, epfd;
+
 void quit(const char *fmt, ...)
 {
 	va_list va;
@@ -183,21 +267,83 @@ FILE *fopenat(int dirfd, const char *pathname, const char *mode)
 {
 	int flags = (strchr(mode, 'r') ? O_RDONLY : 0)
 		  | (strchr(mode, 'w') ? O_WRONLY : 0);
-	int fd = openat(dirfd, pathname, flags);
+	int fd = openat(dirfd, pathname, flags | O_CLOEXEC);
 	if (fd < 0)
 		return NULL;
 	return fdopen(fd, mode);
 }
 
-void notify_up(const char *msg, int len)
+uint64_t mono_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000ull * ts.tv_sec + ts.tv_nsec;
+}
+
+/*
+ * Messages to the enclosing ramon are queued here and written out in
+ * one go by flush_up(), so relaying a burst of marks costs one write.
+ */
+char up_buf[2 * (sizeof (struct ramon_msg_hdr) + RAMON_MSG_MAXLEN)];
+size_t up_len;
+
+void flush_up()
+{
+	size_t off = 0;
+
+	while (off < up_len) {
+		ssize_t rc = write(sock_up, up_buf + off, up_len - off);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			warn("Writing to upstream socket failed (%zu of %zu written)", off, up_len);
+			break;
+		}
+		off += rc;
+	}
+	up_len = 0;
+}
+
+/* Queue whole messages */
+void queue_up(const void *data, size_t len)
 {
-	int rc;
 	if (sock_up < 0)
 		quit("sock_up unset");
 
-	rc = write(sock_up, msg, len);
-	if (rc < len)
-		warn("Writing to upstream socket failed (%i vs %i)", rc, len);
+	if (up_len + len > sizeof up_buf)
+		flush_up();
+	assert(len <= sizeof up_buf);
+	memcpy(up_buf + up_len, data, len);
+	up_len += len;
+}
+
+/* Like notify_up(), but on behalf of some other process */
+void notify_up_as(enum ramon_msg_type type, const char *msg, size_t len,
+		  int pid, uint64_t ts_ns)
+{
+	struct ramon_msg_hdr h = {
+		.magic = RAMON_MSG_MAGIC,
+		.type  = type,
+		.len   = len,
+		.pid   = pid,
+		.ts_ns = ts_ns,
+	};
+
+	if (len > RAMON_MSG_MAXLEN) {
+		warn("Message too long, truncating");
+		h.len = len = RAMON_MSG_MAXLEN;
+	}
+
+	/* make sure header and payload go out together */
+	if (up_len + sizeof h + len > sizeof up_buf)
+		flush_up();
+	queue_up(&h, sizeof h);
+	queue_up(msg, len);
+}
+
+void notify_up(enum ramon_msg_type type, const char *msg, size_t len)
+{
+	notify_up_as(type, msg, len, getpid(), mono_ns());
 }
 
 void help(const char *progname)
@@ -209,11 +355,35 @@ void help(const char *progname)
 	print_opts(stderr, ramon_opts);
 }
 
+/*
+ * Where things are in the output file, for the trailer. We count the
+ * bytes ourselves rather than ask the stream every line.
+ */
+struct out_range
+{
+	long n;
+	long first, last;  /* offsets of the first and last line */
+};
+
+long out_off;
+struct out_range out_polls = { 0, -1, -1 };
+struct out_range out_marks = { 0, -1, -1 };
+long out_summary = -1;
+
+void out_range_add(struct out_range *r)
+{
+	if (r->first < 0)
+		r->first = out_off;
+	r->last = out_off;
+	r->n++;
+}
+
 void __outf(bool col, const char *key, const char *fmt, ...)
 {
 	va_list va;
 
-	assert (opt_stderr || opt_fout);
+	/* with --tui, lines only go to the file, if any */
+	assert (opt_stderr || opt_fout || opt_tui);
 
 	if (opt_stderr) {
 		/* When printing to stderr we prepend a marker */
@@ -228,11 +398,21 @@ void __outf(bool col, const char *key, const char *fmt, ...)
 		fputs("\n", stderr);
 	}
 	if (opt_fout) {
-		fprintf(opt_fout, "%-15s ",key);
+		int n;
+
+		if (!strcmp(key, "poll"))
+			out_range_add(&out_polls);
+		else if (!strcmp(key, "mark"))
+			out_range_add(&out_marks);
+
+		n = fprintf(opt_fout, "%-15s ",key);
+		out_off += n > 0 ? n : 0;
 		va_start(va, fmt);
-		vfprintf(opt_fout, fmt, va);
+		n = vfprintf(opt_fout, fmt, va);
 		va_end(va);
+		out_off += n > 0 ? n : 0;
 		fputs("\n", opt_fout);
+		out_off++;
 	}
 }
 
@@ -248,14 +428,35 @@ void __outf(bool col, const char *key, const char *fmt, ...)
 			__outf(col, __VA_ARGS__);	\
 	} while(0)
 
+/* --on-limit=freeze, see freeze_group() */
+enum { FZ_NONE, FZ_MEM, FZ_LIMIT };
+void freeze_group(int reason, const char *why);
+
 void timeout_cpu()
 {
+	static bool frozen_once;
+
+	if (opt_freeze) {
+		/* once thawed, let it run */
+		if (!frozen_once)
+			freeze_group(FZ_LIMIT, "CPU limit reached");
+		frozen_once = true;
+		return;
+	}
 	outf_col(0, 1, "msg", "CPU limit reached");
+	if (opt_samples)
+		samples_pin();
 	kill(child_pid, SIGTERM);
 }
 void timeout_wall()
 {
+	if (opt_freeze) {
+		freeze_group(FZ_LIMIT, "Wall clock time limit reached");
+		return;
+	}
 	outf_col(0, 1, "msg", "Wall clock time limit reached");
+	if (opt_samples)
+		samples_pin();
 	kill(child_pid, SIGTERM);
 }
 
@@ -291,7 +492,7 @@ void skipline(FILE *f)
 }
 
 /* Find root of cgroup2 mount */
-void find_cgroup_fs()
+void find_cgroup_fs(char *wo)
 {
 	char type[128];
 	char path[PATH_MAX];
@@ -308,7 +509,7 @@ void find_cgroup_fs()
 			skipline(f);
 			continue;
 		}
-		strcpy(cgroupfs_root, path);
+		strcpy(wo, path);
 		fclose(f);
 		return;
 	}
@@ -625,6 +826,66 @@ int open_and_read_val(int dirfd, const char *pathname, const char *fmt, void *wo
 	return rc;
 }
 
+/*
+ * Parse a cpu-list as the kernel prints it (e.g. "0-3,8,10-11", see
+ * `man 7 cpuset') into a cpu_set_t. Returns 0 on success.
+ */
+int parse_cpulist(const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while (*s && *s != '\n') {
+		char *end;
+		long lo, hi;
+
+		lo = strtol(s, &end, 10);
+		if (end == s || lo < 0)
+			return -1;
+		hi = lo;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				return -1;
+			s = end;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+		for (long c = lo; c <= hi; c++)
+			CPU_SET(c, set);
+		if (*s == ',')
+			s++;
+	}
+
+	return 0;
+}
+
+/* The opposite of the above, buf is always NUL-terminated */
+void fmt_cpulist(char *buf, size_t len, const cpu_set_t *set)
+{
+	size_t off = 0;
+	int c = 0;
+
+	buf[0] = 0;
+	while (c < CPU_SETSIZE && off < len) {
+		int lo;
+
+		if (!CPU_ISSET(c, set)) {
+			c++;
+			continue;
+		}
+		lo = c;
+		while (c + 1 < CPU_SETSIZE && CPU_ISSET(c + 1, set))
+			c++;
+		if (lo == c)
+			off += snprintf(buf + off, len - off, "%s%i", off ? "," : "", lo);
+		else
+			off += snprintf(buf + off, len - off, "%s%i-%i", off ? "," : "", lo, c);
+		c++;
+	}
+}
+
 /* returns statically allocated string in glibc */
 char *str_of_current_time()
 {
@@ -675,6 +936,161 @@ long cur_wall_us()
 	return (1000000 * ts.tv_sec + ts.tv_nsec / 1000) - zero_wall_us;
 }
 
+/*
+ * --on-limit=freeze: when the group hits a limit, freeze it through
+ * cgroup.freeze instead of killing it, so a long job can be resumed.
+ * Time and CPU limits stay frozen until a SIGUSR1. We also freeze when
+ * the group gets close to its memory.max (re-read at every poll, so it
+ * can be raised while frozen) or the host is short of memory, and thaw
+ * on our own once all of that is clear again. What we report is what
+ * cgroup.events says, not what we asked for.
+ */
+#define FZ_MEM_HIGH     0.90   /* of memory.max */
+#define FZ_MEM_OK       0.80
+#define FZ_AVAIL_LOW    0.05   /* host MemAvailable, of MemTotal */
+#define FZ_AVAIL_OK     0.15
+#define FZ_PSI_HIGH     20.0   /* host memory, some avg10 */
+#define FZ_PSI_OK       5.0
+
+int fz_events_fd = -1;
+int fz_reason = FZ_NONE;       /* why we asked for a freeze */
+bool fz_mem_armed = true;      /* false after a manual thaw, until memory is fine */
+bool fz_frozen;
+long fz_since, fz_total_us;
+int fz_count;
+
+void setup_freeze()
+{
+	struct epoll_event ev = { .events = EPOLLPRI };
+
+	fz_events_fd = openat(cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+	if (fz_events_fd < 0)
+		quit("open cgroup.events (freezing needs Linux 5.2+)");
+	ev.data.fd = fz_events_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fz_events_fd, &ev) < 0)
+		quit("epoll_ctl add %i", fz_events_fd);
+}
+
+static void freeze_write(int v)
+{
+	FILE *f = fopenat(cgroup_fd, "cgroup.freeze", "w");
+
+	if (!f || fprintf(f, "%i", v) < 0 || fclose(f) != 0)
+		warn("could not write %i to cgroup.freeze", v);
+}
+
+void freeze_group(int reason, const char *why)
+{
+	/* a limit is not lifted by memory coming back */
+	if (fz_reason != FZ_NONE) {
+		if (reason == FZ_LIMIT)
+			fz_reason = FZ_LIMIT;
+		return;
+	}
+	outf_col(0, 1, "msg", "%s, freezing the group", why);
+	if (opt_samples)
+		samples_pin();
+	freeze_write(1);
+	fz_reason = reason;
+}
+
+void thaw_group(const char *why)
+{
+	if (fz_reason == FZ_NONE)
+		return;
+	outf(0, "msg", "%s, thawing the group", why);
+	freeze_write(0);
+	fz_reason = FZ_NONE;
+}
+
+/* cgroup.events changed */
+void handle_freeze_events()
+{
+	char buf[256], *p;
+	bool frozen;
+	long now;
+	int rc;
+
+	rc = pread(fz_events_fd, buf, sizeof buf - 1, 0);
+	if (rc <= 0)
+		return;
+	buf[rc] = 0;
+	p = strstr(buf, "frozen ");
+	if (!p)
+		return;
+	frozen = p[7] == '1';
+	if (frozen == fz_frozen)
+		return;
+
+	now = cur_wall_us();
+	fz_frozen = frozen;
+	if (frozen) {
+		fz_since = now;
+		fz_count++;
+		outf(0, "freeze", "state=frozen wall=%.3fs", now / 1e6);
+	} else {
+		fz_total_us += now - fz_since;
+		outf(0, "freeze", "state=thawed wall=%.3fs after=%.3fs", now / 1e6, (now - fz_since) / 1e6);
+	}
+	ramon_flush();
+}
+
+void freeze_poll(long memcurr)
+{
+	long max = -1, total = 0, avail = 0;
+	double grp = 0, host = 1, psi = 0;
+	bool high, ok;
+	FILE *f;
+
+	/* "max" does not scan, and means no limit */
+	if (open_and_read_val(cgroup_fd, "memory.max", "%li", &max) == 1 && max > 0 && memcurr > 0)
+		grp = 1.0 * memcurr / max;
+
+	f = fopen("/proc/meminfo", "re");
+	if (f) {
+		struct kvfmt keys[] = {
+			{ .key = "MemTotal:",     .fmt = "%li", .wo = &total },
+			{ .key = "MemAvailable:", .fmt = "%li", .wo = &avail },
+		};
+		if (read_kvs(f, 2, keys) == 2 && total > 0)
+			host = 1.0 * avail / total;
+		fclose(f);
+	}
+	f = fopen("/proc/pressure/memory", "re");
+	if (f) {
+		if (fscanf(f, "some avg10=%lf", &psi) != 1)
+			psi = 0;
+		fclose(f);
+	}
+
+	high = grp >= FZ_MEM_HIGH || host < FZ_AVAIL_LOW || psi >= FZ_PSI_HIGH;
+	ok = grp < FZ_MEM_OK && host >= FZ_AVAIL_OK && psi < FZ_PSI_OK;
+
+	if (ok)
+		fz_mem_armed = true;
+	if (high && fz_mem_armed) {
+		char why[128];
+		snprintf(why, sizeof why, "Memory is short (group %.0f%% of max, host %.0f%% available, psi %.2f)",
+			 100 * grp, 100 * host, psi);
+		freeze_group(FZ_MEM, why);
+	} else if (ok && fz_reason == FZ_MEM) {
+		thaw_group("Memory is available again");
+	}
+}
+
+/* SIGUSR1 */
+void manual_thaw()
+{
+	if (fz_reason == FZ_NONE) {
+		dbg(1, "Got SIGUSR1, but the group is not frozen");
+		return;
+	}
+	/* do not freeze again for the same shortage */
+	if (fz_reason == FZ_MEM)
+		fz_mem_armed = false;
+	thaw_group("Got SIGUSR1");
+}
+
 bool nowarn_memorypeak = false;
 
 void read_cgroup(struct cgroup_res_info *wo)
@@ -719,6 +1135,130 @@ void print_cgroup_res_info(struct cgroup_res_info *res)
 		outf(0, "group.pidpeak", "%lu", res->pidpeak);
 }
 
+/*
+ * Host-wide counters, to figure out how much other workloads interfered
+ * with the run. These files are kept open and rewound, like the child's
+ * /proc/pid/stat, to keep the per-poll cost at a couple of reads.
+ */
+struct host_res_info
+{
+	long busy_usec;
+	long memused;
+};
+
+FILE *host_cpu_f;
+bool host_cpu_cgroup; /* reading root cpu.stat, otherwise /proc/stat */
+FILE *host_mem_f;
+bool host_mem_cgroup; /* reading root memory.stat, otherwise /proc/meminfo */
+
+/* Host readings at time zero, and the external memory peak */
+struct host_res_info host_zero;
+long ext_mempeak;
+
+void setup_host_sampling()
+{
+	int fd = open(cgroup_mnt, O_DIRECTORY | O_CLOEXEC);
+
+	/*
+	 * The root cgroup's cpu.stat and memory.stat cover the whole
+	 * host and are in the same units as our own group's, so prefer
+	 * them. Older kernels lack them at the root, fall back to /proc.
+	 */
+	if (fd >= 0) {
+		host_cpu_f = fopenat(fd, "cpu.stat", "r");
+		host_mem_f = fopenat(fd, "memory.stat", "r");
+		close(fd);
+	}
+
+	host_cpu_cgroup = host_cpu_f != NULL;
+	if (!host_cpu_f)
+		host_cpu_f = fopen("/proc/stat", "re");
+
+	host_mem_cgroup = host_mem_f != NULL;
+	if (!host_mem_f)
+		host_mem_f = fopen("/proc/meminfo", "re");
+
+	if (!host_cpu_f || !host_mem_f)
+		warn("Could not open host counters, interference will not be measured");
+}
+
+int read_host(struct host_res_info *wo)
+{
+	if (!host_cpu_f || !host_mem_f)
+		return -1;
+
+	rewind(host_cpu_f);
+	fflush(host_cpu_f);
+	if (host_cpu_cgroup) {
+		struct kvfmt keys[] = {
+			{ .key = "usage_usec", .fmt = "%li", .wo = &wo->busy_usec },
+		};
+		if (read_kvs(host_cpu_f, 1, keys) != 1)
+			return -1;
+	} else {
+		unsigned long user, nice, sys, idle, iowait, irq, softirq, steal;
+		if (fscanf(host_cpu_f, "cpu %lu %lu %lu %lu %lu %lu %lu %lu",
+			   &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal) != 8)
+			return -1;
+		wo->busy_usec = 1000000.0 * (user + nice + sys + irq + softirq + steal) / clk_tck;
+	}
+
+	rewind(host_mem_f);
+	fflush(host_mem_f);
+	if (host_mem_cgroup) {
+		long anon = 0, file = 0;
+		struct kvfmt keys[] = {
+			{ .key = "anon", .fmt = "%li", .wo = &anon },
+			{ .key = "file", .fmt = "%li", .wo = &file },
+		};
+		if (read_kvs(host_mem_f, 2, keys) != 2)
+			return -1;
+		wo->memused = anon + file;
+	} else {
+		long total = 0, avail = 0;
+		struct kvfmt keys[] = {
+			{ .key = "MemTotal:",     .fmt = "%li", .wo = &total },
+			{ .key = "MemAvailable:", .fmt = "%li", .wo = &avail },
+		};
+		if (read_kvs(host_mem_f, 2, keys) != 2)
+			return -1;
+		wo->memused = (total - avail) * 1024;
+	}
+
+	return 0;
+}
+
+/* Memory used outside the group, given the host and group readings */
+long ext_mem(struct host_res_info *host, struct cgroup_res_info *res)
+{
+	long m = host->memused - (res->memcurr > 0 ? res->memcurr : 0);
+	return m > 0 ? m : 0;
+}
+
+/* Returns the interference percentage, or -1 */
+double print_interference(struct cgroup_res_info *res)
+{
+	struct host_res_info host;
+	const char *suf;
+	double pct;
+	long mem;
+
+	if (read_host(&host) < 0)
+		return -1;
+
+	long host_busy = host.busy_usec - host_zero.busy_usec;
+	long ext_busy = host_busy - res->usage_usec;
+	if (ext_busy < 0)
+		ext_busy = 0;
+
+	outf(1, "ext.total", "%.3fs", ext_busy / 1e6);
+	mem = humanize(ext_mempeak, &suf);
+	outf(1, "ext.mempeak", "%lu%sB", mem, suf);
+	pct = host_busy > 0 ? 100.0 * ext_busy / host_busy : 0.0;
+	outf(0, "interference", "%.2f%%", pct);
+	return pct;
+}
+
 int read_proc_stat(int pid, struct procstat_info *wo)
 {
 	int rc;
@@ -780,100 +1320,2697 @@ int read_proc_stat(int pid, struct procstat_info *wo)
 	return 0;
 }
 
-/* int poll_ctr = 0; */
+/*
+ * Per-CPU busy time of the group. We prefer a per-CPU task-clock perf
+ * counter attached to our cgroup, which counts exactly the time our
+ * tasks ran on each CPU. If perf is not allowed, we fall back to the
+ * per-CPU lines of /proc/stat restricted to the group's cpuset, which
+ * is host-wide but still shows idle and crowded cores.
+ *
+ * Each poll is printed as one character per CPU (in the order of the
+ * `percpu.cpus' list), '0' to '9' for 0-9% to 90-100% busy.
+ */
+int percpu_n;
+int *percpu_cpu;       /* CPU number for each column */
+int *percpu_fd;        /* perf fds, NULL if using /proc/stat */
+unsigned long *percpu_last;  /* last reading, in usecs */
+unsigned long *percpu_zero;  /* reading at time zero */
+FILE *percpu_stat_f;
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+			    int group_fd, unsigned long flags)
+{
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
 
-void poll()
+int percpu_open_perf()
 {
-	static unsigned long last_poll_usage = 0;
-	static unsigned long last_poll_us = 0;
-	static unsigned long last_poll_utime = 0;
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_TASK_CLOCK;
+
+	percpu_fd = calloc(percpu_n, sizeof percpu_fd[0]);
+	for (int i = 0; i < percpu_n; i++) {
+		/* with PERF_FLAG_PID_CGROUP, the pid is a cgroup dir fd */
+		percpu_fd[i] = perf_event_open(&attr, cgroup_fd, percpu_cpu[i], -1,
+					       PERF_FLAG_PID_CGROUP | PERF_FLAG_FD_CLOEXEC);
+		if (percpu_fd[i] < 0) {
+			dbg(1, "perf_event_open on cpu %i failed (%s)", percpu_cpu[i], strerror(errno));
+			while (i-- > 0)
+				close(percpu_fd[i]);
+			free(percpu_fd);
+			percpu_fd = NULL;
+			return -1;
+		}
+	}
 
-	unsigned long delta_us, wall_us;
-	struct cgroup_res_info res;
+	return 0;
+}
 
-	/* get absolute time */
-	wall_us = cur_wall_us();
+/* Fills wo[] with the busy time of each tracked CPU, in usecs */
+int percpu_read(unsigned long *wo)
+{
+	if (percpu_fd) {
+		for (int i = 0; i < percpu_n; i++) {
+			uint64_t ns;
+			if (read(percpu_fd[i], &ns, sizeof ns) != sizeof ns)
+				return -1;
+			wo[i] = ns / 1000;
+		}
+		return 0;
+	}
 
-	/* poll_ctr++; */
-	/* outf(0, "poll", "drift=%i us", wall_us - poll_ctr * opt_pollms * 1000); */
+	char line[256];
+	int i = 0;
 
-	/* relative to last measure */
-	delta_us = wall_us - last_poll_us;
+	rewind(percpu_stat_f);
+	fflush(percpu_stat_f);
+	while (i < percpu_n && fgets(line, sizeof line, percpu_stat_f)) {
+		unsigned long user, nice, sys, idle, iowait, irq, softirq, steal;
+		int cpu;
 
-	/*
-	 * If we are somehow woken up less than 1 microsecond
-	 * after the last time, just skip this measurement.
-	 */
-	if (delta_us == 0)
-		return;
+		if (strncmp(line, "cpu", 3) || line[3] < '0' || line[3] > '9')
+			continue;
+		if (sscanf(line, "cpu%i %lu %lu %lu %lu %lu %lu %lu %lu", &cpu,
+			   &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal) != 9)
+			return -1;
+		/* columns are sorted, as are the lines */
+		if (cpu != percpu_cpu[i])
+			continue;
+		wo[i++] = 1000000.0 * (user + nice + sys + irq + softirq + steal) / clk_tck;
+	}
 
-	read_cgroup(&res);
+	return i == percpu_n ? 0 : -1;
+}
 
-	unsigned long utime;
-	struct procstat_info stat;
-	int rc = read_proc_stat(child_pid, &stat);
-	if (rc < 0) {
-		warn("Reading procstat during poll failed");
-		utime = 0;
-	} else {
-		utime = stat.utime;
+void setup_percpu()
+{
+	percpu_n = 0;
+	percpu_cpu = calloc(CPU_COUNT(&cpus_set), sizeof percpu_cpu[0]);
+	for (int c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, &cpus_set))
+			percpu_cpu[percpu_n++] = c;
+
+	percpu_last = calloc(percpu_n, sizeof percpu_last[0]);
+	percpu_zero = calloc(percpu_n, sizeof percpu_zero[0]);
+	if (!percpu_cpu || !percpu_last || !percpu_zero)
+		quit("calloc percpu");
+
+	if (percpu_open_perf() < 0) {
+		warn("Cannot use perf for per-CPU accounting, using host-wide /proc/stat");
+		percpu_stat_f = fopen("/proc/stat", "re");
+		if (!percpu_stat_f) {
+			warn("Could not open /proc/stat, disabling --percpu");
+			opt_percpu = false;
+			return;
+		}
 	}
 
-	long clk_tck = sysconf(_SC_CLK_TCK);
+	if (percpu_read(percpu_zero) < 0) {
+		warn("Could not read per-CPU times, disabling --percpu");
+		opt_percpu = false;
+		return;
+	}
+	memcpy(percpu_last, percpu_zero, percpu_n * sizeof percpu_last[0]);
 
-	const char *memsuf;
-	unsigned long mem = humanize(res.memcurr, &memsuf);
-	char wall_buf[HMS_LEN];
-	char usage_buf[HMS_LEN];
-	char user_buf[HMS_LEN];
-	char system_buf[HMS_LEN];
+	outf(1, "percpu.source", "%s", percpu_fd ? "perf" : "procstat");
+	outf(1, "percpu.cpus", "%s", cpus_effective);
+}
 
-#if 0
-	t_hms(wall_buf,   wall_us);
-	t_hms(usage_buf,  res.usage_usec);
-	t_hms(user_buf,   res.user_usec);
-	t_hms(system_buf, res.system_usec);
-#else
-	sprintf(wall_buf,   "%.3fs", wall_us / 1e6);
-	sprintf(usage_buf , "%.3fs", res.usage_usec / 1e6);
-	sprintf(user_buf,   "%.3fs", res.user_usec / 1e6);
-	sprintf(system_buf, "%.3fs", res.system_usec / 1e6);
-#endif
+static char percpu_digit(unsigned long busy_us, unsigned long delta_us)
+{
+	int d = 10 * busy_us / delta_us;
+	return '0' + (d > 9 ? 9 : d);
+}
 
-	outf(0, "poll", "wall=%s usage=%s user=%s sys=%s mem=%li%sB roottime=%.3fs load=%.2f rootload=%.2f",
-			wall_buf,
-			usage_buf, user_buf, system_buf,
-			mem, memsuf,
-			1.0 * utime / clk_tck,
-			1.0 * (res.usage_usec - last_poll_usage) / delta_us,
-			1000000.0 * (utime - last_poll_utime) / clk_tck / delta_us
-			);
-	ramon_flush();
+void poll_percpu(long wall_us, const char *wall_buf, unsigned long delta_us)
+{
+	unsigned long now[percpu_n];
+	char row[percpu_n + 1];
 
-	if (opt_maxcpu && res.usage_usec > opt_maxcpu * 1000000)
-		timeout_cpu();
+	if (percpu_read(now) < 0) {
+		WARN_ONCE("Could not read per-CPU times");
+		return;
+	}
 
-	last_poll_usage = res.usage_usec;
-	last_poll_us = wall_us;
-	last_poll_utime = utime;
+	for (int i = 0; i < percpu_n; i++) {
+		row[i] = percpu_digit(now[i] - percpu_last[i], delta_us);
+		percpu_last[i] = now[i];
+	}
+	row[percpu_n] = 0;
+
+	outf(0, "percpu", "wall=%s busy=%s", wall_buf, row);
+	if (opt_render)
+		render_percpu(wall_us, row);
 }
 
-void print_exit_status(int status)
+/* Average over the whole run, plus a count of cores that were mostly idle */
+void print_percpu(unsigned long wall_us)
 {
-	outf(0, "status", wifstring(status));
+	unsigned long now[percpu_n];
+	char row[percpu_n + 1];
+	int idle = 0;
 
-	if (WIFEXITED(status)) {
-		int exitcode = WEXITSTATUS(status);
-		outf_col(0, exitcode, "exitcode", "%i", exitcode);
-	} else if (WIFSIGNALED(status)) {
-		int sig = WTERMSIG(status);
-		outf_col(0, 1, "signal", "%i (SIG%s %s)", sig, signame(sig), strsignal(sig));
-		outf_col(0, 0, "core dumped", "%s", WCOREDUMP(status) ? "true" : "false");
-		outf_col(0, 0, "exitcode", "%i", 128 + sig);
+	if (percpu_read(now) < 0)
+		return;
+
+	for (int i = 0; i < percpu_n; i++) {
+		unsigned long busy = now[i] - percpu_zero[i];
+		row[i] = percpu_digit(busy, wall_us);
+		if (busy < wall_us / 20)
+			idle++;
 	}
+	row[percpu_n] = 0;
+
+	outf(1, "percpu.avg", "%s", row);
+	outf(1, "percpu.idle", "%i of %i cpus under 5%%", idle, percpu_n);
 }
 
-int setup_signalfd()
+/*
+ * Walk every cgroup under ours (the rootgroup, and the groups of nested
+ * invocations) and call cb for each task id in them. Returns the number
+ * of tasks visited.
+ */
+int for_each_group_member_at(int dirfd, const char *list, void (*cb)(int tid, void *par), void *par)
+{
+	int n = 0;
+	int tid;
+	FILE *f;
+
+	f = fopenat(dirfd, list, "r");
+	if (f) {
+		while (fscanf(f, "%i", &tid) == 1) {
+			cb(tid, par);
+			n++;
+		}
+		fclose(f);
+	}
+
+	int fd = dup(dirfd);
+	DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!d) {
+		if (fd >= 0)
+			close(fd);
+		return n;
+	}
+	/* the dup shares the offset, left at the end by the last walk */
+	rewinddir(d);
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (de->d_type != DT_DIR || de->d_name[0] == '.')
+			continue;
+		int sub = openat(dirfd, de->d_name, O_DIRECTORY | O_CLOEXEC);
+		if (sub < 0)
+			continue; /* raced with rmdir, fine */
+		n += for_each_group_member_at(sub, list, cb, par);
+		close(sub);
+	}
+	closedir(d);
+
+	return n;
+}
+
+int for_each_group_task(void (*cb)(int tid, void *par), void *par)
+{
+	return for_each_group_member_at(cgroup_fd, "cgroup.threads", cb, par);
+}
+
+/* Same, for each process */
+int for_each_group_proc(void (*cb)(int pid, void *par), void *par)
+{
+	return for_each_group_member_at(cgroup_fd, "cgroup.procs", cb, par);
+}
+
+/*
+ * Scheduler statistics of the group, summed over its tasks. The kernel
+ * only keeps these per task, so we keep a table of the tasks we saw in
+ * the last poll, sorted by tid. When a task disappears (or its tid is
+ * reused, which we notice as counters going backwards) its last values
+ * are banked into sched_dead.
+ */
+struct sched_info
+{
+	unsigned long wait_ns;   /* time spent runnable, waiting for a CPU */
+	unsigned long nvcsw;     /* voluntary context switches */
+	unsigned long nivcsw;    /* involuntary context switches */
+};
+
+struct sched_task
+{
+	int tid;
+	struct sched_info si;
+};
+
+struct sched_tab
+{
+	struct sched_task *v;
+	int n, cap;
+};
+
+struct sched_tab sched_prev;
+struct sched_info sched_dead;
+
+static void sched_info_add(struct sched_info *acc, const struct sched_info *x)
+{
+	acc->wait_ns += x->wait_ns;
+	acc->nvcsw   += x->nvcsw;
+	acc->nivcsw  += x->nivcsw;
+}
+
+int read_task_sched(int tid, struct sched_info *wo)
+{
+	char fn[64];
+	FILE *f;
+	int rc;
+
+	/* the second field is the time spent on the runqueue, in ns */
+	sprintf(fn, "/proc/%i/schedstat", tid);
+	f = fopen(fn, "re");
+	if (!f)
+		return -1;
+	rc = fscanf(f, "%*u %lu", &wo->wait_ns);
+	fclose(f);
+	if (rc != 1)
+		return -1;
+
+	sprintf(fn, "/proc/%i/status", tid);
+	f = fopen(fn, "re");
+	if (!f)
+		return -1;
+	struct kvfmt keys[] = {
+		{ .key = "voluntary_ctxt_switches:",    .fmt = "%lu", .wo = &wo->nvcsw  },
+		{ .key = "nonvoluntary_ctxt_switches:", .fmt = "%lu", .wo = &wo->nivcsw },
+	};
+	rc = read_kvs(f, 2, keys);
+	fclose(f);
+
+	return rc == 2 ? 0 : -1;
+}
+
+static void sched_collect_cb(int tid, void *par)
+{
+	struct sched_tab *t = par;
+	struct sched_info si;
+
+	/* it may have died already, then we keep what we had */
+	if (read_task_sched(tid, &si) < 0)
+		return;
+
+	if (t->n == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 256;
+		t->v = realloc(t->v, t->cap * sizeof t->v[0]);
+		if (!t->v)
+			quit("realloc sched table");
+	}
+	t->v[t->n].tid = tid;
+	t->v[t->n].si = si;
+	t->n++;
+}
+
+static int sched_task_cmp(const void *a, const void *b)
+{
+	const struct sched_task *x = a, *y = b;
+	return (x->tid > y->tid) - (x->tid < y->tid);
+}
+
+/* Sample all tasks, and return the group totals in wo */
+void read_group_sched(struct sched_info *wo)
+{
+	struct sched_tab cur = { 0 };
+	int i, j;
+
+	for_each_group_task(sched_collect_cb, &cur);
+	qsort(cur.v, cur.n, sizeof cur.v[0], sched_task_cmp);
+
+	/* merge against the previous table, banking tasks that went away */
+	for (i = 0, j = 0; i < sched_prev.n; i++) {
+		struct sched_task *old = &sched_prev.v[i];
+
+		while (j < cur.n && cur.v[j].tid < old->tid)
+			j++;
+
+		if (j < cur.n && cur.v[j].tid == old->tid
+		    && cur.v[j].si.wait_ns >= old->si.wait_ns
+		    && cur.v[j].si.nvcsw >= old->si.nvcsw
+		    && cur.v[j].si.nivcsw >= old->si.nivcsw)
+			continue;
+
+		sched_info_add(&sched_dead, &old->si);
+	}
+
+	free(sched_prev.v);
+	sched_prev = cur;
+
+	*wo = sched_dead;
+	for (i = 0; i < cur.n; i++)
+		sched_info_add(wo, &cur.v[i].si);
+}
+
+void print_group_sched()
+{
+	struct sched_info si;
+
+	read_group_sched(&si);
+	outf(0, "group.cpuwait", "%.3fs", si.wait_ns / 1e9);
+	outf(1, "group.nvcsw", "%lu", si.nvcsw);
+	outf(1, "group.nivcsw", "%lu", si.nivcsw);
+}
+
+/*
+ * X.0 begins interval X, X.1 ends it, anything else is a plain mark.
+ * Begin marks may carry dependencies after a colon, see --critpath.
+ */
+enum mark_kind { MARK_PLAIN, MARK_BEGIN, MARK_END };
+
+enum mark_kind mark_kind(const char *label, int len)
+{
+	if (len > 2 && label[len - 2] == '.' && label[len - 1] == '0')
+		return MARK_BEGIN;
+	if (len > 2 && label[len - 2] == '.' && label[len - 1] == '1')
+		return MARK_END;
+	return MARK_PLAIN;
+}
+
+/* Length of the interval name in a begin mark, without dependencies */
+int mark_name_len(const char *label, int len)
+{
+	const char *colon = memchr(label, ':', len - 2);
+	return colon ? colon - label : len - 2;
+}
+
+/*
+ * Chrome Trace Event output, which Perfetto and chrome://tracing can
+ * load. Events are written as they happen and flushed at every poll,
+ * and both tools accept an array without its closing bracket, so the
+ * trace of a run that got killed is still usable.
+ *
+ * Polls are counter tracks of process 1, marks are instants in process
+ * 2, and X.0/X.1 intervals are slices there too, one thread per lane so
+ * that overlapping intervals do not stack up. Process spans from
+ * --proctree go in process 3, one thread per pid.
+ */
+FILE *trace_f;
+
+struct trace_ival
+{
+	char *label;
+	long start_us;
+	int lane;
+};
+
+struct trace_ival *trace_open;
+int trace_nopen, trace_capopen;
+bool *trace_lanes;         /* busy */
+int trace_nlanes;
+
+void trace_str(const char *s, int len)
+{
+	fputc('"', trace_f);
+	for (int i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(trace_f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(trace_f, "\\u%04x", c);
+		else
+			fputc(c, trace_f);
+	}
+	fputc('"', trace_f);
+}
+
+void trace_meta(int pid, int tid, const char *what, const char *name)
+{
+	fprintf(trace_f, "{\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"name\":\"%s\",\"args\":{\"name\":",
+		pid, tid, what);
+	trace_str(name, strlen(name));
+	fputs("}},\n", trace_f);
+}
+
+void setup_trace()
+{
+	trace_f = fopen(opt_trace, "we");
+	if (!trace_f)
+		quit("could not open trace file %s", opt_trace);
+
+	fputs("[\n", trace_f);
+	trace_meta(1, 0, "process_name", "ramon");
+	trace_meta(2, 0, "process_name", "marks");
+	if (opt_proctree)
+		trace_meta(3, 0, "process_name", "processes");
+}
+
+void trace_counters(long ts_us, double load, long mem, double rootload)
+{
+	fprintf(trace_f, "{\"ph\":\"C\",\"pid\":1,\"ts\":%li,\"name\":\"load\",\"args\":{\"load\":%.3f}},\n",
+		ts_us, load);
+	if (mem >= 0)
+		fprintf(trace_f, "{\"ph\":\"C\",\"pid\":1,\"ts\":%li,\"name\":\"mem\",\"args\":{\"mem\":%li}},\n",
+			ts_us, mem);
+	fprintf(trace_f, "{\"ph\":\"C\",\"pid\":1,\"ts\":%li,\"name\":\"rootload\",\"args\":{\"rootload\":%.3f}},\n",
+		ts_us, rootload);
+	fflush(trace_f);
+}
+
+void trace_slice(struct trace_ival *iv, long end_us)
+{
+	fprintf(trace_f, "{\"ph\":\"X\",\"pid\":2,\"tid\":%i,\"ts\":%li,\"dur\":%li,\"name\":",
+		iv->lane + 1, iv->start_us, end_us - iv->start_us);
+	trace_str(iv->label, strlen(iv->label));
+	fputs("},\n", trace_f);
+	trace_lanes[iv->lane] = false;
+	free(iv->label);
+}
+
+void trace_mark(const char *label, int len, int pid, long ts_us)
+{
+	fprintf(trace_f, "{\"ph\":\"i\",\"s\":\"p\",\"pid\":2,\"tid\":0,\"ts\":%li,\"name\":", ts_us);
+	trace_str(label, len);
+	fprintf(trace_f, ",\"args\":{\"pid\":%i}},\n", pid);
+
+	if (mark_kind(label, len) == MARK_BEGIN) {
+		int lane;
+
+		for (lane = 0; lane < trace_nlanes; lane++)
+			if (!trace_lanes[lane])
+				break;
+		if (lane == trace_nlanes) {
+			trace_lanes = realloc(trace_lanes, ++trace_nlanes * sizeof trace_lanes[0]);
+			if (!trace_lanes)
+				quit("realloc trace lanes");
+		}
+		trace_lanes[lane] = true;
+
+		if (trace_nopen == trace_capopen) {
+			trace_capopen = trace_capopen ? 2 * trace_capopen : 64;
+			trace_open = realloc(trace_open, trace_capopen * sizeof trace_open[0]);
+			if (!trace_open)
+				quit("realloc trace intervals");
+		}
+		trace_open[trace_nopen++] = (struct trace_ival) {
+			.label = strndup(label, mark_name_len(label, len)),
+			.start_us = ts_us,
+			.lane = lane,
+		};
+	} else if (mark_kind(label, len) == MARK_END) {
+		for (int i = trace_nopen - 1; i >= 0; i--) {
+			if ((int)strlen(trace_open[i].label) == len - 2
+			    && !strncmp(trace_open[i].label, label, len - 2)) {
+				trace_slice(&trace_open[i], ts_us);
+				trace_open[i] = trace_open[--trace_nopen];
+				break;
+			}
+		}
+	}
+}
+
+void trace_span(int pid, int ppid, const char *comm, long start_us, long end_us)
+{
+	fprintf(trace_f, "{\"ph\":\"X\",\"pid\":3,\"tid\":%i,\"ts\":%li,\"dur\":%li,\"name\":",
+		pid, start_us, end_us - start_us);
+	trace_str(comm, strlen(comm));
+	fprintf(trace_f, ",\"args\":{\"ppid\":%i}},\n", ppid);
+}
+
+void close_trace(long end_us)
+{
+	/* Intervals that never ended last until the end */
+	for (int i = 0; i < trace_nopen; i++)
+		trace_slice(&trace_open[i], end_us);
+	trace_nopen = 0;
+
+	char name[sizeof cmd_str + 8];
+	snprintf(name, sizeof name, "ramon: %s", cmd_str);
+	trace_meta(1, 0, "process_name", name);
+	/* the last event has no trailing comma */
+	fprintf(trace_f, "{\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"ts\":%li,\"name\":\"end\"}\n]\n",
+		end_us);
+	if (fclose(trace_f))
+		warn("writing trace file %s", opt_trace);
+	trace_f = NULL;
+}
+
+/*
+ * Per-phase accounting. Every mark snapshots the group's counters. A
+ * phase is either an interval, from X.0 to X.1, or the span from a
+ * plain mark to the next plain mark (or the end of the run).
+ *
+ * The peak memory of a phase comes from its own memory.peak fd: since
+ * Linux 6.12, writing to it resets the peak as seen through that fd.
+ * On older kernels we settle for the max memory.current seen by polls
+ * and snapshots during the phase.
+ */
+struct io_info
+{
+	long rbytes;
+	long wbytes;
+};
+
+struct phase
+{
+	char *label;
+	bool open;
+	long start_us, end_us;
+	struct cgroup_res_info start, end;
+	struct io_info io_start, io_end;
+	int start_gen, end_gen;    /* snapshots the counters came from */
+	long peak;
+	int peak_fd;
+};
+
+struct phase *phases;
+int nphases, capphases;
+int phase_plain = -1;      /* index of the open plain-mark phase */
+int phase_nfds;
+bool phase_peak_reset = true; /* until proven otherwise */
+
+#define PHASE_MAX_FDS 256
+
+void read_cgroup_io(struct io_info *wo)
+{
+	char line[1024];
+	FILE *f;
+
+	wo->rbytes = wo->wbytes = 0;
+	f = fopenat(cgroup_fd, "io.stat", "r");
+	if (!f)
+		return;
+
+	/* one line per device: "MAJ:MIN rbytes=N wbytes=N rios=N ..." */
+	while (fgets(line, sizeof line, f)) {
+		char *p;
+		if ((p = strstr(line, "rbytes=")))
+			wo->rbytes += atol(p + 7);
+		if ((p = strstr(line, "wbytes=")))
+			wo->wbytes += atol(p + 7);
+	}
+	fclose(f);
+}
+
+/*
+ * Snapshots are shared by marks that come in the same burst, such as
+ * a drain of the ring; returns which snapshot it was.
+ */
+int phase_snapshot(struct cgroup_res_info *res, struct io_info *io)
+{
+	static struct cgroup_res_info last_res;
+	static struct io_info last_io;
+	static long last_us = -1;
+	static int gen;
+	long now = cur_wall_us();
+
+	if (last_us < 0 || now - last_us > 1000) {
+		read_cgroup(&last_res);
+		read_cgroup_io(&last_io);
+		last_us = now;
+		gen++;
+	}
+	*res = last_res;
+	*io = last_io;
+	return gen;
+}
+
+/* Take the peak so far from the phase's fd, and close it */
+void phase_close_peak(struct phase *ph)
+{
+	char buf[32];
+	ssize_t rc = pread(ph->peak_fd, buf, sizeof buf - 1, 0);
+
+	if (rc > 0) {
+		buf[rc] = 0;
+		if (atol(buf) > ph->peak)
+			ph->peak = atol(buf);
+	}
+	close(ph->peak_fd);
+	ph->peak_fd = -1;
+	phase_nfds--;
+}
+
+int phase_open_peak()
+{
+	static int oldest = 0;
+	int fd;
+
+	if (!phase_peak_reset)
+		return -1;
+
+	/*
+	 * Out of fds, most likely held by X.0 marks that will never see
+	 * their X.1: the oldest open phase goes on with polled peaks.
+	 */
+	if (phase_nfds >= PHASE_MAX_FDS) {
+		while (oldest < nphases && phases[oldest].peak_fd < 0)
+			oldest++;
+		if (oldest == nphases)
+			return -1;
+		phase_close_peak(&phases[oldest]);
+	}
+
+	fd = openat(cgroup_fd, "memory.peak", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		phase_peak_reset = false;
+		return -1;
+	}
+	if (write(fd, "reset\n", 6) != 6) {
+		dbg(1, "memory.peak cannot be reset, using polled memory for phase peaks");
+		phase_peak_reset = false;
+		close(fd);
+		return -1;
+	}
+
+	phase_nfds++;
+	return fd;
+}
+
+void phase_begin(const char *label, int len, long now)
+{
+	if (nphases == capphases) {
+		capphases = capphases ? 2 * capphases : 64;
+		phases = realloc(phases, capphases * sizeof phases[0]);
+		if (!phases)
+			quit("realloc phases");
+	}
+
+	struct phase *ph = &phases[nphases++];
+	memset(ph, 0, sizeof *ph);
+	ph->label = strndup(label, len);
+	ph->open = true;
+	ph->start_us = now;
+	ph->start_gen = phase_snapshot(&ph->start, &ph->io_start);
+	ph->peak = ph->start.memcurr;
+	ph->peak_fd = -1;
+	ph->peak_fd = phase_open_peak();
+}
+
+void phase_end(struct phase *ph, long now)
+{
+	ph->end_gen = phase_snapshot(&ph->end, &ph->io_end);
+	ph->end_us = now;
+	ph->open = false;
+	if (ph->end.memcurr > ph->peak)
+		ph->peak = ph->end.memcurr;
+
+	if (ph->peak_fd >= 0)
+		phase_close_peak(ph);
+}
+
+/*
+ * Times come from the mark itself, counters from when we get to see
+ * it, which for ring marks may be up to a poll period later.
+ */
+void phase_mark(const char *label, int len, long now)
+{
+	enum mark_kind kind = mark_kind(label, len);
+
+	if (kind == MARK_BEGIN) {
+		phase_begin(label, mark_name_len(label, len), now);
+	} else if (kind == MARK_END) {
+		/* match the latest open interval with this label */
+		for (int i = nphases - 1; i >= 0; i--) {
+			if (phases[i].open && i != phase_plain
+			    && (int)strlen(phases[i].label) == len - 2
+			    && !strncmp(phases[i].label, label, len - 2)) {
+				phase_end(&phases[i], now);
+				return;
+			}
+		}
+		errno = 0;
+		WARN_ONCE("Mark %.*s ends an interval that was never started", len, label);
+	} else {
+		if (phase_plain >= 0)
+			phase_end(&phases[phase_plain], now);
+		phase_begin(label, len, now);
+		phase_plain = nphases - 1;
+	}
+}
+
+/* Keep the fallback peaks up to date, for phases without a peak fd */
+void phase_poll(long memcurr)
+{
+	for (int i = 0; i < nphases; i++)
+		if (phases[i].open && phases[i].peak_fd < 0 && memcurr > phases[i].peak)
+			phases[i].peak = memcurr;
+}
+
+void print_phases()
+{
+	long now = cur_wall_us();
+	int shown = 0;
+
+	for (int i = 0; i < nphases; i++)
+		if (phases[i].open)
+			phase_end(&phases[i], now);
+
+	for (int i = 0; i < nphases; i++) {
+		struct phase *ph = &phases[i];
+		const char *psuf, *rsuf, *wsuf;
+		unsigned long peak, rd, wr;
+
+		if (shown++ == 50 && opt_verbosity < 2) {
+			outf(1, "phase", "... %i more, use -v to see all", nphases - 50);
+			break;
+		}
+
+		/*
+		 * Both ends in one snapshot, typically a phase that began and
+		 * ended between two drains of the ring: we never saw its
+		 * counters move, so do not make up zeros.
+		 */
+		if (ph->start_gen == ph->end_gen) {
+			outf(1, "phase", "str=%s start=%.3fs wall=%.3fs cpu=- user=- sys=- read=- write=- mempeak=-",
+			     ph->label, ph->start_us / 1e6, (ph->end_us - ph->start_us) / 1e6);
+			continue;
+		}
+
+		peak = humanize(ph->peak > 0 ? ph->peak : 0, &psuf);
+		rd = humanize(ph->io_end.rbytes - ph->io_start.rbytes, &rsuf);
+		wr = humanize(ph->io_end.wbytes - ph->io_start.wbytes, &wsuf);
+		outf(1, "phase", "str=%s start=%.3fs wall=%.3fs cpu=%.3fs user=%.3fs sys=%.3fs read=%lu%sB write=%lu%sB mempeak=%lu%sB",
+		     ph->label, ph->start_us / 1e6, (ph->end_us - ph->start_us) / 1e6,
+		     (ph->end.usage_usec - ph->start.usage_usec) / 1e6,
+		     (ph->end.user_usec - ph->start.user_usec) / 1e6,
+		     (ph->end.system_usec - ph->start.system_usec) / 1e6,
+		     rd, rsuf, wr, wsuf, peak, psuf);
+	}
+}
+
+/*
+ * Critical path over X.0/X.1 intervals. A begin mark can name the
+ * intervals it depends on as "X:dep1,dep2.0"; the end mark is still
+ * just "X.1". At the end of the run we walk back from the interval
+ * that ended last: its predecessor is the dependency that ended last,
+ * or, if it names none, the interval that ended last before it started,
+ * which is what was holding it back when parallelism dropped. Every
+ * interval on that chain bounds the wall time, so shortening any of
+ * them shortens the run, until some other chain becomes critical.
+ */
+struct cp_ival
+{
+	char *name;
+	char *deps;        /* comma-separated, or NULL */
+	long start_us, end_us;
+	int lane;
+	bool oncp;
+};
+
+struct cp_ival *cp_ivals;
+int cp_n, cp_cap;
+int *cp_open;              /* indices of intervals not ended yet */
+int cp_nopen, cp_capopen;
+
+void cp_mark(const char *label, int len, long now)
+{
+	enum mark_kind kind = mark_kind(label, len);
+
+	if (kind == MARK_BEGIN) {
+		if (cp_n == cp_cap) {
+			cp_cap = cp_cap ? 2 * cp_cap : 256;
+			cp_ivals = realloc(cp_ivals, cp_cap * sizeof cp_ivals[0]);
+			if (!cp_ivals)
+				quit("realloc intervals");
+		}
+		if (cp_nopen == cp_capopen) {
+			cp_capopen = cp_capopen ? 2 * cp_capopen : 64;
+			cp_open = realloc(cp_open, cp_capopen * sizeof cp_open[0]);
+			if (!cp_open)
+				quit("realloc intervals");
+		}
+
+		struct cp_ival *iv = &cp_ivals[cp_n];
+		char *colon;
+		memset(iv, 0, sizeof *iv);
+		iv->name = strndup(label, len - 2);
+		if ((colon = strchr(iv->name, ':'))) {
+			*colon = 0;
+			iv->deps = colon + 1;
+		}
+		iv->start_us = now;
+		iv->end_us = -1;
+		cp_open[cp_nopen++] = cp_n++;
+	} else if (kind == MARK_END) {
+		for (int i = cp_nopen - 1; i >= 0; i--) {
+			struct cp_ival *iv = &cp_ivals[cp_open[i]];
+			if ((int)strlen(iv->name) == len - 2 && !strncmp(iv->name, label, len - 2)) {
+				iv->end_us = now;
+				cp_open[i] = cp_open[--cp_nopen];
+				break;
+			}
+		}
+	}
+}
+
+/* Min-heap of busy lanes, keyed by the time they become free */
+struct cp_lane
+{
+	long end_us;
+	int lane;
+};
+
+void cp_heap_down(struct cp_lane *h, int n, int i)
+{
+	for (;;) {
+		int m = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < n && h[l].end_us < h[m].end_us)
+			m = l;
+		if (r < n && h[r].end_us < h[m].end_us)
+			m = r;
+		if (m == i)
+			return;
+		struct cp_lane t = h[i]; h[i] = h[m]; h[m] = t;
+		i = m;
+	}
+}
+
+void cp_heap_up(struct cp_lane *h, int i)
+{
+	while (i > 0 && h[(i - 1) / 2].end_us > h[i].end_us) {
+		struct cp_lane t = h[i]; h[i] = h[(i - 1) / 2]; h[(i - 1) / 2] = t;
+		i = (i - 1) / 2;
+	}
+}
+
+static int cp_start_cmp(const void *a, const void *b)
+{
+	const struct cp_ival *x = a, *y = b;
+	return (x->start_us > y->start_us) - (x->start_us < y->start_us);
+}
+
+static int cp_end_cmp(const void *a, const void *b)
+{
+	const struct cp_ival *x = cp_ivals + *(const int *)a;
+	const struct cp_ival *y = cp_ivals + *(const int *)b;
+	return (x->end_us > y->end_us) - (x->end_us < y->end_us);
+}
+
+static int cp_name_cmp(const void *a, const void *b)
+{
+	return strcmp(cp_ivals[*(const int *)a].name, cp_ivals[*(const int *)b].name);
+}
+
+static int cp_dur_cmp(const void *a, const void *b)
+{
+	const struct cp_ival *x = cp_ivals + *(const int *)a;
+	const struct cp_ival *y = cp_ivals + *(const int *)b;
+	long dx = x->end_us - x->start_us, dy = y->end_us - y->start_us;
+	return (dx < dy) - (dx > dy);
+}
+
+/* The latest-ending interval named name, or -1 */
+int cp_find(int *byname, const char *name, int namelen)
+{
+	int lo = 0, hi = cp_n, best = -1;
+
+	/* first entry >= name */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const char *n = cp_ivals[byname[mid]].name;
+		int c = strncmp(n, name, namelen);
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < cp_n; lo++) {
+		const struct cp_ival *iv = &cp_ivals[byname[lo]];
+		if (strncmp(iv->name, name, namelen) || iv->name[namelen])
+			break;
+		if (best < 0 || iv->end_us > cp_ivals[best].end_us)
+			best = byname[lo];
+	}
+	return best;
+}
+
+void print_critpath(long wall_us)
+{
+	long busy = 0, first = LONG_MAX, last = 0;
+	long serial = 0, idle = 0;
+	int nlanes = 0;
+
+	for (int i = 0; i < cp_nopen; i++)
+		cp_ivals[cp_open[i]].end_us = wall_us;
+	cp_nopen = 0;
+
+	if (cp_n == 0)
+		return;
+
+	/* Lanes: reuse the one that frees up first, if it is free by now */
+	qsort(cp_ivals, cp_n, sizeof cp_ivals[0], cp_start_cmp);
+	struct cp_lane *heap = malloc(cp_n * sizeof heap[0]);
+	long *lane_busy = calloc(cp_n, sizeof lane_busy[0]);
+	int *byend = malloc(cp_n * sizeof byend[0]);
+	int *byname = malloc(cp_n * sizeof byname[0]);
+	int *chain = malloc(cp_n * sizeof chain[0]);
+	if (!heap || !lane_busy || !byend || !byname || !chain)
+		quit("malloc");
+
+	int nheap = 0;
+	for (int i = 0; i < cp_n; i++) {
+		struct cp_ival *iv = &cp_ivals[i];
+		if (nheap > 0 && heap[0].end_us <= iv->start_us) {
+			iv->lane = heap[0].lane;
+			heap[0].end_us = iv->end_us;
+			cp_heap_down(heap, nheap, 0);
+		} else {
+			iv->lane = nlanes++;
+			heap[nheap] = (struct cp_lane) { iv->end_us, iv->lane };
+			cp_heap_up(heap, nheap++);
+		}
+		lane_busy[iv->lane] += iv->end_us - iv->start_us;
+		busy += iv->end_us - iv->start_us;
+		if (iv->start_us < first)
+			first = iv->start_us;
+		if (iv->end_us > last)
+			last = iv->end_us;
+	}
+
+	/*
+	 * Serial and idle time: sweep the starts (in order already) and
+	 * the ends, counting how many intervals are running.
+	 */
+	for (int i = 0; i < cp_n; i++)
+		byend[i] = i;
+	qsort(byend, cp_n, sizeof byend[0], cp_end_cmp);
+	{
+		int si = 0, ei = 0, running = 0;
+		long t = first;
+		while (ei < cp_n) {
+			long next;
+			bool isstart = si < cp_n && cp_ivals[si].start_us < cp_ivals[byend[ei]].end_us;
+			next = isstart ? cp_ivals[si].start_us : cp_ivals[byend[ei]].end_us;
+			if (running == 1)
+				serial += next - t;
+			else if (running == 0)
+				idle += next - t;
+			t = next;
+			if (isstart) {
+				running++;
+				si++;
+			} else {
+				running--;
+				ei++;
+			}
+		}
+	}
+
+	for (int i = 0; i < cp_n; i++)
+		byname[i] = i;
+	qsort(byname, cp_n, sizeof byname[0], cp_name_cmp);
+
+	/* Walk back from the interval that ended last */
+	int nchain = 0;
+	int c = byend[cp_n - 1];
+	while (c >= 0 && !cp_ivals[c].oncp) {
+		struct cp_ival *iv = &cp_ivals[c];
+		int pred = -1;
+
+		iv->oncp = true;
+		chain[nchain++] = c;
+
+		for (const char *d = iv->deps; d && *d; ) {
+			int dlen = strcspn(d, ",");
+			int j = cp_find(byname, d, dlen);
+			if (j >= 0 && (pred < 0 || cp_ivals[j].end_us > cp_ivals[pred].end_us))
+				pred = j;
+			d += dlen + (d[dlen] == ',');
+		}
+
+		if (pred < 0 && !iv->deps) {
+			/* the last one to end before we started */
+			int lo = 0, hi = cp_n;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (cp_ivals[byend[mid]].end_us <= iv->start_us)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo > 0)
+				pred = byend[lo - 1];
+		}
+		c = pred;
+	}
+
+	long covered = 0;
+	for (int i = 0; i < nchain; i++)
+		covered += cp_ivals[chain[i]].end_us - cp_ivals[chain[i]].start_us;
+
+	outf(1, "critpath", "intervals=%i lanes=%i util=%.1f%% serial=%.3fs idle=%.3fs chain=%i covered=%.3fs (%.1f%%)",
+	     cp_n, nlanes, 100.0 * busy / nlanes / (last - first > 0 ? last - first : 1),
+	     serial / 1e6, idle / 1e6, nchain, covered / 1e6, 100.0 * covered / wall_us);
+
+	if (opt_verbosity >= 2)
+		for (int l = 0; l < nlanes; l++)
+			outf(2, "critpath", "lane=%i util=%.1f%%", l,
+			     100.0 * lane_busy[l] / (last - first > 0 ? last - first : 1));
+
+	/* The biggest ones are the best to shorten */
+	qsort(chain, nchain, sizeof chain[0], cp_dur_cmp);
+	int nshow = opt_verbosity >= 2 ? nchain : 20;
+	for (int i = 0; i < nchain && i < nshow; i++) {
+		struct cp_ival *iv = &cp_ivals[chain[i]];
+		outf(1, "crit", "str=%s start=%.3fs dur=%.3fs (%.1f%%) lane=%i",
+		     iv->name, iv->start_us / 1e6, (iv->end_us - iv->start_us) / 1e6,
+		     100.0 * (iv->end_us - iv->start_us) / wall_us, iv->lane);
+	}
+
+	free(heap);
+	free(lane_busy);
+	free(byend);
+	free(byname);
+	free(chain);
+}
+
+void epfd_add(int fd)
+{
+	struct epoll_event ev;
+	int rc;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (rc < 0)
+		quit("epoll_ctl add %i", fd);
+}
+
+/*
+ * OpenMetrics endpoint. The whole HTTP response is rendered once per
+ * poll, so a scrape costs an accept, a read and a write from the main
+ * loop, and never touches the cgroup. Writes are non-blocking: a
+ * client that does not take the whole response at once gets cut off
+ * rather than stall sampling.
+ */
+int serve_sock = -1;
+char serve_path[PATH_MAX];         /* unix socket to remove at the end */
+char serve_buf[4096];
+int serve_len;
+
+#define SERVE_MAXFD 1024
+bool serve_conns[SERVE_MAXFD];
+
+struct serve_sample
+{
+	struct cgroup_res_info res;
+	long wall_us;
+	double load, rootload;
+	double waitload, cpuwait;  /* < 0 if not measured */
+	double ext_load;           /* < 0 if not measured */
+};
+
+#define SERVE_METRIC(type, name, help, fmt, ...)			\
+	do {								\
+		n += snprintf(body + n, sizeof body - n,		\
+			      "# TYPE ramon_" name " " type "\n"	\
+			      "# HELP ramon_" name " " help "\n"	\
+			      "ramon_" name "%s " fmt "\n",		\
+			      !strcmp(type, "counter") ? "_total" : "",	\
+			      __VA_ARGS__);				\
+		if (n >= (int)sizeof body)				\
+			n = sizeof body - 1;				\
+	} while (0)
+
+void serve_render(const struct serve_sample *sm)
+{
+	char body[sizeof serve_buf - 256];
+	int n = 0;
+
+	if (sm) {
+		SERVE_METRIC("gauge", "wall_seconds", "Time since the start of the run.",
+			     "%.6f", sm->wall_us / 1e6);
+		SERVE_METRIC("counter", "cpu_usage_seconds", "CPU time used by the group.",
+			     "%.6f", sm->res.usage_usec / 1e6);
+		SERVE_METRIC("counter", "cpu_user_seconds", "User CPU time used by the group.",
+			     "%.6f", sm->res.user_usec / 1e6);
+		SERVE_METRIC("counter", "cpu_system_seconds", "System CPU time used by the group.",
+			     "%.6f", sm->res.system_usec / 1e6);
+		if (sm->res.memcurr >= 0)
+			SERVE_METRIC("gauge", "memory_current_bytes", "Memory used by the group.",
+				     "%li", sm->res.memcurr);
+		if (sm->res.mempeak >= 0)
+			SERVE_METRIC("gauge", "memory_peak_bytes", "Peak memory used by the group.",
+				     "%li", sm->res.mempeak);
+		if (sm->res.pidpeak >= 0)
+			SERVE_METRIC("gauge", "pids_peak", "Peak number of tasks in the group.",
+				     "%li", sm->res.pidpeak);
+		SERVE_METRIC("gauge", "load", "CPUs used by the group since the last poll.",
+			     "%.3f", sm->load);
+		SERVE_METRIC("gauge", "rootload", "CPUs used by the root process since the last poll.",
+			     "%.3f", sm->rootload);
+		if (sm->cpuwait >= 0) {
+			SERVE_METRIC("counter", "cpuwait_seconds", "Time the group's tasks waited for a CPU.",
+				     "%.6f", sm->cpuwait);
+			SERVE_METRIC("gauge", "waitload", "Tasks waiting for a CPU since the last poll.",
+				     "%.3f", sm->waitload);
+		}
+		if (sm->ext_load >= 0)
+			SERVE_METRIC("gauge", "ext_load", "CPUs used outside of the group since the last poll.",
+				     "%.3f", sm->ext_load);
+	}
+	n += snprintf(body + n, sizeof body - n, "# EOF\n");
+
+	serve_len = snprintf(serve_buf, sizeof serve_buf,
+			     "HTTP/1.1 200 OK\r\n"
+			     "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			     "Content-Length: %i\r\n"
+			     "Connection: close\r\n"
+			     "\r\n"
+			     "%s", n, body);
+}
+
+void setup_serve()
+{
+	char host[64];
+	int port;
+
+	if (sscanf(opt_serve, "%63[0-9.]:%i", host, &port) == 2) {
+		struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+		int one = 1;
+
+		if (inet_pton(AF_INET, host, &sin.sin_addr) != 1)
+			quit("bad address for --serve: %s", opt_serve);
+		serve_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (serve_sock < 0)
+			quit("socket");
+		setsockopt(serve_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if (bind(serve_sock, (struct sockaddr *)&sin, sizeof sin) < 0)
+			quit("could not bind to %s", opt_serve);
+	} else {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+		struct stat st;
+
+		if (strlen(opt_serve) >= sizeof sun.sun_path)
+			quit("socket path too long: %s", opt_serve);
+		strcpy(sun.sun_path, opt_serve);
+		/* a stale socket from an earlier run, but nothing else */
+		if (stat(opt_serve, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(opt_serve);
+		serve_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (serve_sock < 0)
+			quit("socket");
+		if (bind(serve_sock, (struct sockaddr *)&sun, sizeof sun) < 0)
+			quit("could not bind to %s", opt_serve);
+		strcpy(serve_path, opt_serve);
+	}
+
+	if (listen(serve_sock, 16) < 0)
+		quit("listen");
+
+	serve_render(NULL);
+	epfd_add(serve_sock);
+	dbg(2, "serving metrics on %s", opt_serve);
+}
+
+void serve_accept()
+{
+	int fd;
+
+	while ((fd = accept4(serve_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (fd >= SERVE_MAXFD) {
+			close(fd);
+			continue;
+		}
+		serve_conns[fd] = true;
+		epfd_add(fd);
+	}
+}
+
+bool is_serve_conn(int fd)
+{
+	return fd >= 0 && fd < SERVE_MAXFD && serve_conns[fd];
+}
+
+/* We answer anything with the metrics, once the client has spoken */
+void serve_conn(int fd)
+{
+	char req[1024];
+	ssize_t rc;
+
+	rc = read(fd, req, sizeof req);
+	if (rc < 0 && errno == EAGAIN)
+		return;
+	if (rc > 0) {
+		rc = send(fd, serve_buf, serve_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc != serve_len)
+			dbg(2, "metrics client took %zi of %i bytes", rc, serve_len);
+		shutdown(fd, SHUT_WR);
+	}
+	serve_conns[fd] = false;
+	close(fd);
+}
+
+void stop_serve()
+{
+	close(serve_sock);
+	serve_sock = -1;
+	if (serve_path[0])
+		unlink(serve_path);
+}
+
+/*
+ * The last line of the output file is a trailer of fixed size, so
+ * tools can get the results with one small read at the end of the
+ * file, and tell a file that is still being written (no trailer yet)
+ * just as cheaply:
+ *
+ *   #ramon-trailer 1 total_us=N mempeak=N exitcode=N wall_us=N
+ *     interference=X samples=N@A,B events=N@A,B summary=A
+ *
+ * all in one line, padded with spaces to RAMON_TRAILER_LEN bytes,
+ * newline included. samples and events are the poll and mark lines:
+ * how many, and the offsets of the first and last one (-1 if none).
+ * summary is the offset of the summary. mempeak and interference are
+ * -1 if not measured.
+ */
+#define RAMON_TRAILER_LEN 256
+
+void write_trailer(const struct cgroup_res_info *res, long wall_us, int exitcode, double intf)
+{
+	char buf[RAMON_TRAILER_LEN + 1];
+	int n;
+
+	n = snprintf(buf, sizeof buf,
+		     "#ramon-trailer 1 total_us=%li mempeak=%li exitcode=%i wall_us=%li interference=%.2f "
+		     "samples=%li@%li,%li events=%li@%li,%li summary=%li",
+		     res->usage_usec, res->mempeak > 0 ? res->mempeak : -1, exitcode, wall_us, intf,
+		     out_polls.n, out_polls.first, out_polls.last,
+		     out_marks.n, out_marks.first, out_marks.last, out_summary);
+	if (n >= RAMON_TRAILER_LEN) {
+		warn("trailer too long, not writing it");
+		return;
+	}
+	memset(buf + n, ' ', RAMON_TRAILER_LEN - 1 - n);
+	buf[RAMON_TRAILER_LEN - 1] = '\n';
+	fwrite(buf, 1, RAMON_TRAILER_LEN, opt_fout);
+	out_off += RAMON_TRAILER_LEN;
+}
+
+void record_run(const struct cgroup_res_info *res, long wall_us, int exitcode, double intf)
+{
+	struct hist_rec r;
+	struct timespec ts;
+
+	hist_init(&r, cmd_argc, cmd_argv);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.start_us = ts.tv_sec * 1000000L + ts.tv_nsec / 1000 - wall_us;
+	r.wall_us = wall_us;
+	r.usage_us = res->usage_usec;
+	r.user_us = res->user_usec;
+	r.system_us = res->system_usec;
+	r.mempeak = res->mempeak > 0 ? res->mempeak : -1;
+	r.pidpeak = res->pidpeak > 0 ? res->pidpeak : -1;
+	r.interference = intf;
+	r.exitcode = exitcode;
+
+	if (hist_append(opt_record, &r) < 0)
+		warn("could not record the run in '%s'", opt_record);
+}
+
+/* Shared-memory stats page, see ramon-stats.h */
+struct ramon_stats_page *stats_page;
+
+void setup_stats_page()
+{
+	int fd;
+
+	fd = open(opt_stats_page, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		quit("could not create stats page %s", opt_stats_page);
+	if (ftruncate(fd, sizeof *stats_page) < 0)
+		quit("ftruncate %s", opt_stats_page);
+
+	stats_page = mmap(NULL, sizeof *stats_page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (stats_page == MAP_FAILED)
+		quit("mmap %s", opt_stats_page);
+	close(fd);
+
+	stats_page->version = RAMON_STATS_VERSION;
+	stats_page->pid = getpid();
+	stats_page->child_pid = child_pid;
+	snprintf(stats_page->cmd, sizeof stats_page->cmd, "%s", cmd_str);
+	stats_page->stats.state = RAMON_STATS_STARTING;
+	stats_page->stats.mempeak = stats_page->stats.pidpeak = stats_page->stats.memcurr = -1;
+	/* readers check the magic first, so it goes last */
+	__atomic_store_n(&stats_page->magic, RAMON_STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+void update_stats_page(const struct cgroup_res_info *res, long wall_us,
+		       double load, double rootload, int state, int exitcode)
+{
+	struct ramon_stats st = {
+		.wall_us = wall_us,
+		.usage_usec = res->usage_usec,
+		.user_usec = res->user_usec,
+		.system_usec = res->system_usec,
+		.mempeak = res->mempeak,
+		.pidpeak = res->pidpeak,
+		.memcurr = res->memcurr,
+		.load = load,
+		.rootload = rootload,
+		.state = state,
+		.exitcode = exitcode,
+	};
+
+	ramon_stats_write(stats_page, &st);
+}
+
+int peek(const char *fn)
+{
+	static const char *states[] = { "starting", "running", "done" };
+	const struct ramon_stats_page *p;
+	struct ramon_stats st;
+	const char *state;
+	struct stat sb;
+	int fd;
+
+	fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		quit("open %s", fn);
+	errno = EINVAL;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof *p)
+		quit("%s is not a ramon stats page", fn);
+	p = mmap(NULL, sizeof *p, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		quit("mmap %s", fn);
+	close(fd);
+
+	if (ramon_stats_read(p, &st) < 0) {
+		errno = EINVAL;
+		quit("%s is not a ramon stats page", fn);
+	}
+
+	state = st.state >= 0 && st.state <= RAMON_STATS_DONE ? states[st.state] : "?";
+	if (st.state != RAMON_STATS_DONE && kill(p->pid, 0) < 0 && errno == ESRCH)
+		state = "dead";
+
+	outf(0, "peek", "pid=%i childpid=%i state=%s cmd=%.*s",
+	     p->pid, p->child_pid, state, (int)sizeof p->cmd, p->cmd);
+	outf(0, "peek", "wall=%.3fs usage=%.3fs user=%.3fs sys=%.3fs mem=%li mempeak=%li pidpeak=%li load=%.2f rootload=%.2f",
+	     st.wall_us / 1e6, st.usage_usec / 1e6, st.user_usec / 1e6, st.system_usec / 1e6,
+	     (long)st.memcurr, (long)st.mempeak, (long)st.pidpeak, st.load, st.rootload);
+	if (st.state == RAMON_STATS_DONE)
+		outf(0, "peek", "exitcode=%i", st.exitcode);
+
+	return 0;
+}
+
+/*
+ * --tui: a panel at the bottom of the terminal, redrawn at every poll.
+ * The command's output goes through a pipe to us and we write it in a
+ * scroll region above the panel, so we are the only writer and the
+ * cursor is always where the command left it, except while drawing.
+ *
+ * Frames are rendered into a cell grid and compared with the previous
+ * one, and only the runs of cells that changed are written out.
+ */
+#define TUI_ROWS  13
+#define TUI_MAXW  512
+#define TUI_TOP   5
+#define TUI_MARKS 3
+
+int tui_pipe[2] = { -1, -1 };
+int tui_rows, tui_cols;
+bool tui_fits;             /* the panel fits the terminal */
+bool tui_stderr;           /* opt_stderr to restore at the end */
+uint32_t tui_front[TUI_ROWS][TUI_MAXW];
+uint32_t tui_back[TUI_ROWS][TUI_MAXW];
+
+double tui_load[TUI_MAXW], tui_mem[TUI_MAXW]; /* history rings */
+int tui_nhist;
+
+struct tui_mark
+{
+	char label[48];
+	long ts_us;
+};
+
+struct tui_mark tui_marks[TUI_MARKS];
+int tui_nmarks;
+
+struct tui_proc
+{
+	int pid;
+	unsigned long ticks;
+	long rss;
+	double cpu;
+	char comm[16];
+};
+
+struct tui_proc *tui_procs, *tui_prev;
+int tui_nprocs, tui_capprocs, tui_nprev, tui_capprev;
+
+char tui_out[1 << 16];
+int tui_outlen;
+
+/*
+ * Frames and the command's output go out through our own non-blocking
+ * open of the terminal, so a stalled terminal cannot stall the event
+ * loop. What it does not take waits in tui_pend, and output that does
+ * not fit there is dropped.
+ */
+int tui_fd = -1;
+char tui_pend[1 << 16];
+int tui_npend;
+long tui_dropped;
+
+void tui_emit(const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	n = vsnprintf(tui_out + tui_outlen, sizeof tui_out - tui_outlen, fmt, va);
+	va_end(va);
+	if (n > 0)
+		tui_outlen += n;
+	if (tui_outlen >= (int)sizeof tui_out)
+		tui_outlen = sizeof tui_out - 1;
+}
+
+/* Write what the terminal takes of the pending output, without waiting */
+void tui_write_pend()
+{
+	int off = 0;
+
+	while (off < tui_npend) {
+		ssize_t rc = write(tui_fd, tui_pend + off, tui_npend - off);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		off += rc;
+	}
+	memmove(tui_pend, tui_pend + off, tui_npend - off);
+	tui_npend -= off;
+}
+
+void tui_flush()
+{
+	/* frames queue behind the command's output, and skip while it waits */
+	if (tui_fd >= 0) {
+		if (tui_outlen <= (int)sizeof tui_pend - tui_npend) {
+			memcpy(tui_pend + tui_npend, tui_out, tui_outlen);
+			tui_npend += tui_outlen;
+			tui_write_pend();
+		} else {
+			memset(tui_front, 0, sizeof tui_front);
+		}
+		tui_outlen = 0;
+		return;
+	}
+
+	for (int off = 0; off < tui_outlen; ) {
+		ssize_t rc = write(STDERR_FILENO, tui_out + off, tui_outlen - off);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		off += rc;
+	}
+	tui_outlen = 0;
+}
+
+void tui_emit_cell(uint32_t c)
+{
+	if (c < 0x80)
+		tui_emit("%c", (char)c);
+	else if (c < 0x800)
+		tui_emit("%c%c", 0xc0 | c >> 6, 0x80 | (c & 0x3f));
+	else
+		tui_emit("%c%c%c", 0xe0 | c >> 12, 0x80 | (c >> 6 & 0x3f), 0x80 | (c & 0x3f));
+}
+
+/*
+ * Follow the terminal's size. Returns false if the panel does not fit,
+ * in which case the whole screen is the command's until it grows again.
+ */
+bool tui_layout()
+{
+	struct winsize ws;
+	int cols;
+
+	if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) < 0)
+		return false;
+	cols = ws.ws_col < TUI_MAXW ? ws.ws_col : TUI_MAXW;
+	if (ws.ws_row == tui_rows && cols == tui_cols)
+		return tui_fits;
+
+	tui_rows = ws.ws_row;
+	tui_cols = cols;
+	if (tui_rows < TUI_ROWS + 3) {
+		if (tui_fits)
+			tui_emit("\x1b[r");
+		tui_fits = false;
+		return false;
+	}
+	tui_fits = true;
+
+	/* scroll region on top, and the command's cursor at its bottom */
+	tui_emit("\x1b[1;%ir\x1b[%i;1H\x1b[J\x1b[%i;1H",
+		 tui_rows - TUI_ROWS, tui_rows - TUI_ROWS + 1, tui_rows - TUI_ROWS);
+	memset(tui_front, 0, sizeof tui_front); /* redraw everything */
+	return true;
+}
+
+void setup_tui()
+{
+	const char *tty = ttyname(STDERR_FILENO);
+
+	if (pipe2(tui_pipe, O_CLOEXEC) < 0)
+		quit("pipe");
+
+	/* not O_NONBLOCK on stderr itself, which the shell shares */
+	if (tty)
+		tui_fd = open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (tui_fd < 0) {
+		dbg(1, "cannot reopen the terminal, a stalled terminal will block ramon");
+		tui_fd = STDERR_FILENO;
+	}
+
+	/* make room for the panel without losing what was on screen */
+	for (int i = 0; i < TUI_ROWS; i++)
+		tui_emit("\n");
+	if (!tui_layout()) {
+		errno = EINVAL;
+		quit("cannot fit --tui in the terminal, %i rows needed", TUI_ROWS + 3);
+	}
+	tui_flush();
+
+	/* poll lines would only fight with the panel */
+	tui_stderr = opt_stderr;
+	opt_stderr = false;
+}
+
+int tui_child_output()
+{
+	char drop[4096];
+	int room;
+	ssize_t n;
+
+	tui_write_pend();
+	room = sizeof tui_pend - tui_npend;
+	if (room)
+		n = read(tui_pipe[0], tui_pend + tui_npend, room);
+	else
+		n = read(tui_pipe[0], drop, sizeof drop);
+
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return -1;
+	if (n <= 0) {
+		close(tui_pipe[0]);
+		tui_pipe[0] = -1;
+		return 0;
+	}
+	if (room)
+		tui_npend += n;
+	else
+		tui_dropped += n;
+	tui_write_pend();
+	return n;
+}
+
+void tui_mark(const char *label, int len, long ts_us)
+{
+	struct tui_mark *m = &tui_marks[tui_nmarks++ % TUI_MARKS];
+
+	snprintf(m->label, sizeof m->label, "%.*s", len, label);
+	m->ts_us = ts_us;
+}
+
+void tui_put(int row, int col, const char *fmt, ...)
+{
+	char buf[TUI_MAXW + 1];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, sizeof buf, fmt, va);
+	va_end(va);
+	for (int i = 0; buf[i] && col < tui_cols; i++, col++)
+		tui_back[row][col] = (unsigned char)buf[i] < 0x20 ? '?' : (unsigned char)buf[i];
+}
+
+/* The last w values of hist, scaled to max, as block characters */
+void tui_spark(int row, int col, int w, const double *hist, double max)
+{
+	int n = tui_nhist < w ? tui_nhist : w;
+
+	for (int i = 0; i < n && col + w - n + i < tui_cols; i++) {
+		double v = hist[(tui_nhist - n + i) % TUI_MAXW];
+		int level = max > 0 ? (int)(v / max * 7 + 0.5) : 0;
+		if (level < 0)
+			level = 0;
+		if (level > 7)
+			level = 7;
+		tui_back[row][col + w - n + i] = 0x2581 + level;
+	}
+}
+
+static void tui_proc_cb(int pid, void *par __attribute__((unused)))
+{
+	char path[64], buf[512];
+	unsigned long ut, st;
+	long rss;
+	ssize_t n;
+	int fd;
+
+	sprintf(path, "/proc/%i/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return; /* gone already */
+	n = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = 0;
+
+	/* the command may contain anything, parentheses included */
+	char *l = strchr(buf, '('), *r = strrchr(buf, ')');
+	if (!l || !r || r < l)
+		return;
+	if (sscanf(r + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+		   "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &ut, &st, &rss) != 3)
+		return;
+
+	if (tui_nprocs == tui_capprocs) {
+		tui_capprocs = tui_capprocs ? 2 * tui_capprocs : 64;
+		tui_procs = realloc(tui_procs, tui_capprocs * sizeof tui_procs[0]);
+		if (!tui_procs)
+			quit("realloc");
+	}
+
+	struct tui_proc *p = &tui_procs[tui_nprocs++];
+	p->pid = pid;
+	p->ticks = ut + st;
+	p->rss = rss * sysconf(_SC_PAGESIZE);
+	p->cpu = 0;
+	snprintf(p->comm, sizeof p->comm, "%.*s", (int)(r - l - 1), l + 1);
+}
+
+static int tui_pid_cmp(const void *a, const void *b)
+{
+	return ((const struct tui_proc *)a)->pid - ((const struct tui_proc *)b)->pid;
+}
+
+static int tui_top_cmp(const void *a, const void *b)
+{
+	const struct tui_proc *x = *(const struct tui_proc **)a, *y = *(const struct tui_proc **)b;
+
+	if (x->cpu != y->cpu)
+		return x->cpu < y->cpu ? 1 : -1;
+	return (x->rss < y->rss) - (x->rss > y->rss);
+}
+
+/* Sample the group's processes, with their CPU use since the last time */
+void tui_sample_procs(unsigned long delta_us)
+{
+	struct tui_proc *t;
+	int tc;
+
+	tui_nprocs = 0;
+	for_each_group_proc(tui_proc_cb, NULL);
+	qsort(tui_procs, tui_nprocs, sizeof tui_procs[0], tui_pid_cmp);
+
+	for (int i = 0; i < tui_nprocs; i++) {
+		struct tui_proc *p = &tui_procs[i];
+		struct tui_proc *q = bsearch(p, tui_prev, tui_nprev, sizeof *p, tui_pid_cmp);
+		/* new ones are charged their whole life */
+		unsigned long dt = p->ticks - (q && q->ticks <= p->ticks ? q->ticks : 0);
+		p->cpu = 100.0 * dt / clk_tck * 1e6 / delta_us;
+	}
+
+	/* this sample is the baseline of the next */
+	t = tui_prev; tui_prev = tui_procs; tui_procs = t;
+	tc = tui_capprev; tui_capprev = tui_capprocs; tui_capprocs = tc;
+	tui_nprev = tui_nprocs;
+}
+
+void tui_draw(const struct serve_sample *sm, unsigned long delta_us)
+{
+	const char *suf, *psuf;
+	unsigned long mem, peak;
+	double maxload = nproc, maxmem = 0;
+	char limits[256] = "";
+	int row, w;
+
+	tui_load[tui_nhist % TUI_MAXW] = sm->load;
+	tui_mem[tui_nhist % TUI_MAXW] = sm->res.memcurr > 0 ? sm->res.memcurr : 0;
+	tui_nhist++;
+
+	/* the terminal is behind on the command's output, do not add to it */
+	if (tui_npend) {
+		tui_write_pend();
+		if (tui_npend)
+			return;
+	}
+	if (!tui_layout())
+		return;
+	for (int i = 0; i < TUI_MAXW && i < tui_nhist; i++) {
+		if (tui_load[i] > maxload)
+			maxload = tui_load[i];
+		if (tui_mem[i] > maxmem)
+			maxmem = tui_mem[i];
+	}
+	if (opt_maxmem)
+		maxmem = opt_maxmem;
+
+	for (int r = 0; r < TUI_ROWS; r++)
+		for (int c = 0; c < tui_cols; c++)
+			tui_back[r][c] = ' ';
+
+	mem = humanize(sm->res.memcurr > 0 ? sm->res.memcurr : 0, &suf);
+	peak = humanize(sm->res.mempeak > 0 ? sm->res.mempeak : 0, &psuf);
+	w = tui_cols > 30 ? tui_cols - 30 : 0;
+
+	tui_put(0, 0, "ramon %.3fs  %s", sm->wall_us / 1e6, cmd_str);
+	tui_put(1, 0, "load");
+	tui_spark(1, 6, w, tui_load, maxload);
+	tui_put(1, w + 7, "%6.2f of %.0f", sm->load, maxload);
+	tui_put(2, 0, "mem");
+	tui_spark(2, 6, w, tui_mem, maxmem);
+	tui_put(2, w + 7, "%4lu%sB peak %lu%sB", mem, suf, peak, psuf);
+
+	if (opt_maxmem)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " mem=%liB", opt_maxmem);
+	if (opt_maxcpu)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " cpu=%lis", opt_maxcpu);
+	if (opt_timeout)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " time=%lis", opt_timeout);
+	if (opt_maxstack)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " stack=%liB", opt_maxstack);
+	if (opt_cpus)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " cpus=%s", opt_cpus);
+	if (opt_mems)
+		snprintf(limits + strlen(limits), sizeof limits - strlen(limits), " mems=%s", opt_mems);
+	tui_put(3, 0, "limits:%s", limits[0] ? limits : " none");
+
+	tui_sample_procs(delta_us);
+	struct tui_proc *top[TUI_TOP];
+	int ntop = 0;
+	{
+		struct tui_proc **all = malloc(tui_nprev * sizeof all[0]);
+		if (!all)
+			quit("malloc");
+		for (int i = 0; i < tui_nprev; i++)
+			all[i] = &tui_prev[i];
+		qsort(all, tui_nprev, sizeof all[0], tui_top_cmp);
+		for (ntop = 0; ntop < TUI_TOP && ntop < tui_nprev; ntop++)
+			top[ntop] = all[ntop];
+		free(all);
+	}
+	tui_put(4, 0, "%8s %6s %8s  %s (%i processes)", "PID", "CPU%", "RSS", "COMMAND", tui_nprev);
+	for (int i = 0; i < ntop; i++) {
+		unsigned long rss = humanize(top[i]->rss, &suf);
+		tui_put(5 + i, 0, "%8i %6.1f %6lu%sB  %s", top[i]->pid, top[i]->cpu, rss, suf, top[i]->comm);
+	}
+
+	row = 5 + TUI_TOP;
+	for (int i = tui_nmarks > TUI_MARKS ? tui_nmarks - TUI_MARKS : 0; i < tui_nmarks; i++, row++) {
+		struct tui_mark *m = &tui_marks[i % TUI_MARKS];
+		tui_put(row, 0, "mark %10.3fs  %s", m->ts_us / 1e6, m->label);
+	}
+
+	/* Write out what changed, then put the cursor back */
+	tui_emit("\x1b" "7");
+	for (int r = 0; r < TUI_ROWS; r++) {
+		int c = 0;
+		while (c < tui_cols) {
+			if (tui_back[r][c] == tui_front[r][c]) {
+				c++;
+				continue;
+			}
+			tui_emit("\x1b[%i;%iH", tui_rows - TUI_ROWS + 1 + r, c + 1);
+			for (; c < tui_cols && tui_back[r][c] != tui_front[r][c]; c++) {
+				tui_emit_cell(tui_back[r][c]);
+				tui_front[r][c] = tui_back[r][c];
+			}
+		}
+	}
+	tui_emit("\x1b" "8");
+	tui_flush();
+}
+
+/* Give the terminal back, leaving the last frame on screen */
+void stop_tui()
+{
+	/* no hurry now: let the terminal take all that is left */
+	if (tui_fd != STDERR_FILENO)
+		fcntl(tui_fd, F_SETFL, 0);
+	tui_write_pend();
+
+	/* what is left, but leftover processes may keep it open */
+	if (tui_pipe[0] >= 0) {
+		fcntl(tui_pipe[0], F_SETFL, O_NONBLOCK);
+		while (tui_pipe[0] >= 0 && tui_child_output() > 0)
+			;
+	}
+	if (tui_fd != STDERR_FILENO)
+		close(tui_fd);
+	tui_fd = -1;
+
+	tui_emit("\x1b[r\x1b[%i;1H\n", tui_rows);
+	tui_flush();
+	opt_stderr = tui_stderr;
+	if (tui_dropped) {
+		errno = 0;
+		warn("dropped %li bytes of output the terminal could not keep up with", tui_dropped);
+	}
+}
+
+/*
+ * --baseline: the polls and marks of a previous run, to compare with
+ * this one as it goes. Polls are matched by wall time, shifted by how
+ * far ahead or behind we were at the last mark both runs have (the n-th
+ * X here goes with the n-th X there). The baseline polls are indexed by
+ * time in steps of their average interval, so finding the one for a
+ * poll is a lookup and a step or two.
+ */
+#define BUDGET_EXITCODE 99
+
+struct base_poll
+{
+	long wall_us;
+	long usage_us;
+	long mem;
+};
+
+struct base_mark
+{
+	char *label;
+	long *ts;
+	int n, cap;
+	int seen;              /* by us */
+};
+
+struct base_poll *base_polls;
+int base_npolls, base_cappolls;
+int *base_idx;
+long base_step, base_nidx;
+struct base_mark *base_marks;
+unsigned base_mcap, base_nmarks;
+long base_offset_us;
+bool base_aligned;
+long base_wall_us = -1, base_total_us = -1, base_mempeak = -1;
+double budget_time = NAN, budget_cpu = NAN, budget_mem = NAN;
+bool budget_exceeded;
+
+static unsigned base_hash(const char *s, int len)
+{
+	unsigned h = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+struct base_mark *base_find_mark(const char *label, int len, bool add)
+{
+	unsigned i;
+
+	if (add && 2 * (base_nmarks + 1) > base_mcap) {
+		struct base_mark *old = base_marks;
+		unsigned oldcap = base_mcap;
+
+		base_mcap = base_mcap ? 2 * base_mcap : 64;
+		base_marks = calloc(base_mcap, sizeof base_marks[0]);
+		if (!base_marks)
+			quit("calloc");
+		for (unsigned j = 0; j < oldcap; j++) {
+			if (!old[j].label)
+				continue;
+			i = base_hash(old[j].label, strlen(old[j].label)) & (base_mcap - 1);
+			while (base_marks[i].label)
+				i = (i + 1) & (base_mcap - 1);
+			base_marks[i] = old[j];
+		}
+		free(old);
+	}
+	if (!base_mcap)
+		return NULL;
+
+	for (i = base_hash(label, len) & (base_mcap - 1);; i = (i + 1) & (base_mcap - 1)) {
+		struct base_mark *m = &base_marks[i];
+		if (!m->label) {
+			if (!add)
+				return NULL;
+			m->label = strndup(label, len);
+			base_nmarks++;
+			return m;
+		}
+		if (!strncmp(m->label, label, len) && !m->label[len])
+			return m;
+	}
+}
+
+/* "1.500s" */
+static long base_parse_us(const char *s)
+{
+	return strtod(s, NULL) * 1e6;
+}
+
+/* "123MiB", or just bytes with -1 */
+static long base_parse_bytes(const char *s)
+{
+	static const char *sufs[] = { "Ki", "Mi", "Gi", "Ti", "Pi" };
+	char *end;
+	long v = strtol(s, &end, 10);
+
+	for (int i = 0; i < 5; i++)
+		if (!strncmp(end, sufs[i], 2))
+			return v << (10 * (i + 1));
+	return v;
+}
+
+void load_baseline(const char *fn)
+{
+	char line[4096];
+	FILE *f = fopen(fn, "r");
+
+	if (!f)
+		quit("could not open baseline '%s'", fn);
+
+	while (fgets(line, sizeof line, f)) {
+		char *key = line, *rest, *p;
+
+		if (!strncmp(key, "ramon: ", 7))
+			key += 7;
+		if (!strncmp(key, "#ramon-trailer 1 ", 17)) {
+			if ((p = strstr(key, " total_us=")))
+				base_total_us = atol(p + 10);
+			if ((p = strstr(key, " mempeak=")))
+				base_mempeak = atol(p + 9);
+			if ((p = strstr(key, " wall_us=")))
+				base_wall_us = atol(p + 9);
+			continue;
+		}
+		rest = key + strcspn(key, " \n");
+		if (*rest)
+			*rest++ = 0;
+		rest += strspn(rest, " ");
+		rest[strcspn(rest, "\n")] = 0;
+
+		if (!strcmp(key, "poll")) {
+			struct base_poll bp;
+			char *w = strstr(rest, "wall="), *u = strstr(rest, "usage="), *m = strstr(rest, " mem=");
+			if (!w || !u || !m)
+				continue;
+			bp.wall_us = base_parse_us(w + 5);
+			bp.usage_us = base_parse_us(u + 6);
+			bp.mem = base_parse_bytes(m + 5);
+			if (base_npolls && bp.wall_us < base_polls[base_npolls - 1].wall_us)
+				continue;
+			if (base_npolls == base_cappolls) {
+				base_cappolls = base_cappolls ? 2 * base_cappolls : 1024;
+				base_polls = realloc(base_polls, base_cappolls * sizeof base_polls[0]);
+				if (!base_polls)
+					quit("realloc");
+			}
+			base_polls[base_npolls++] = bp;
+		} else if (!strcmp(key, "mark")) {
+			char *w = strstr(rest, " wall=");
+			struct base_mark *m;
+			if (strncmp(rest, "str=", 4) || !w)
+				continue;
+			m = base_find_mark(rest + 4, w - (rest + 4), true);
+			if (m->n == m->cap) {
+				m->cap = m->cap ? 2 * m->cap : 4;
+				m->ts = realloc(m->ts, m->cap * sizeof m->ts[0]);
+				if (!m->ts)
+					quit("realloc");
+			}
+			m->ts[m->n++] = base_parse_us(w + 6);
+		} else if (!strcmp(key, "walltime") && base_wall_us < 0) {
+			base_wall_us = base_parse_us(rest);
+		} else if (!strcmp(key, "group.total") && base_total_us < 0) {
+			base_total_us = base_parse_us(rest);
+		} else if (!strcmp(key, "group.mempeak") && base_mempeak < 0) {
+			base_mempeak = base_parse_bytes(rest);
+		}
+	}
+	fclose(f);
+
+	if (!base_npolls) {
+		dbg(1, "No polls in baseline '%s'", fn);
+		return;
+	}
+
+	base_step = base_npolls > 1 ?
+		(base_polls[base_npolls - 1].wall_us - base_polls[0].wall_us) / (base_npolls - 1) : 1000000;
+	if (base_step < 1000)
+		base_step = 1000;
+	base_nidx = base_polls[base_npolls - 1].wall_us / base_step + 2;
+	base_idx = malloc(base_nidx * sizeof base_idx[0]);
+	if (!base_idx)
+		quit("malloc");
+	for (long k = 0, i = -1; k < base_nidx; k++) {
+		while (i + 1 < base_npolls && base_polls[i + 1].wall_us <= k * base_step)
+			i++;
+		base_idx[k] = i;
+	}
+}
+
+/* The last baseline poll at or before t, or NULL */
+const struct base_poll *base_lookup(long t)
+{
+	long k = t / base_step;
+	int i;
+
+	if (t < 0)
+		return NULL;
+	if (k >= base_nidx)
+		k = base_nidx - 1;
+	i = base_idx[k];
+	while (i + 1 < base_npolls && base_polls[i + 1].wall_us <= t)
+		i++;
+	return i >= 0 ? &base_polls[i] : NULL;
+}
+
+static void base_pct(char *buf, size_t sz, double cur, double base)
+{
+	if (base > 0 && cur >= 0)
+		snprintf(buf, sz, "%+.1f%%", 100.0 * (cur - base) / base);
+	else
+		snprintf(buf, sz, "-");
+}
+
+void baseline_mark(const char *label, int len, long wall_us)
+{
+	struct base_mark *m = base_find_mark(label, len, false);
+
+	if (!m || m->seen >= m->n)
+		return;
+	base_offset_us = m->ts[m->seen++] - wall_us;
+	base_aligned = true;
+}
+
+void baseline_poll(long wall_us, const struct cgroup_res_info *res)
+{
+	long t = wall_us + base_offset_us;
+	const struct base_poll *bp = base_lookup(t);
+	char usage[16], mem[16], lag[32] = "";
+
+	if (!bp)
+		return;
+	base_pct(usage, sizeof usage, res->usage_usec, bp->usage_us);
+	base_pct(mem, sizeof mem, res->memcurr, bp->mem);
+	if (base_aligned)
+		snprintf(lag, sizeof lag, " lag=%+.3fs", -base_offset_us / 1e6);
+	outf(0, "baseline", "at=%.3fs usage=%s mem=%s%s", bp->wall_us / 1e6, usage, mem, lag);
+}
+
+/* "time=+5%,cpu=+5%,mem=+10%" */
+void parse_budget(const char *s)
+{
+	char *dup = strdup(s), *save, *tok;
+
+	errno = EINVAL;
+	for (tok = strtok_r(dup, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(tok, '='), *end;
+		double v;
+
+		if (!eq)
+			quit("invalid budget '%s'", tok);
+		*eq = 0;
+		v = strtod(eq + 1, &end);
+		if (end == eq + 1 || (*end && strcmp(end, "%")))
+			quit("invalid budget '%s=%s'", tok, eq + 1);
+		if (!strcmp(tok, "time"))
+			budget_time = v;
+		else if (!strcmp(tok, "cpu"))
+			budget_cpu = v;
+		else if (!strcmp(tok, "mem"))
+			budget_mem = v;
+		else
+			quit("unknown budget '%s', use time, cpu or mem", tok);
+	}
+	free(dup);
+	errno = 0;
+}
+
+static void baseline_one(const char *key, const char *what, double cur, double base,
+			 double budget, const char *val)
+{
+	char pct[16];
+
+	if (base <= 0 || cur < 0)
+		return;
+	base_pct(pct, sizeof pct, cur, base);
+	outf(0, key, "%s (baseline %s)", pct, val);
+	if (!isnan(budget) && 100.0 * (cur - base) / base > budget) {
+		outf_col(0, 1, "budget", "%s %s over %+g%%", what, pct, budget);
+		budget_exceeded = true;
+	}
+}
+
+void print_baseline(const struct cgroup_res_info *res, long wall_us)
+{
+	char val[32];
+	const char *suf;
+	unsigned long mem = humanize(base_mempeak > 0 ? base_mempeak : 0, &suf);
+
+	snprintf(val, sizeof val, "%.3fs", base_wall_us / 1e6);
+	baseline_one("baseline.wall", "time", wall_us, base_wall_us, budget_time, val);
+	snprintf(val, sizeof val, "%.3fs", base_total_us / 1e6);
+	baseline_one("baseline.total", "cpu", res->usage_usec, base_total_us, budget_cpu, val);
+	snprintf(val, sizeof val, "%lu%sB", mem, suf);
+	baseline_one("baseline.mempeak", "mem", res->mempeak > 0 ? res->mempeak : -1,
+		     base_mempeak, budget_mem, val);
+}
+
+/*
+ * --jobserver: a GNU make jobserver whose size follows memory pressure.
+ * We create a fifo with N-1 tokens in it (make has an implicit one) and
+ * pass it down in $MAKEFLAGS. At every poll, if the group is close to
+ * --limit-mem or stalling on memory (PSI), we halve the number of jobs
+ * allowed, taking tokens out of the fifo as they are returned; when the
+ * pressure is gone we give them back one per poll. Running jobs are
+ * never stopped, so this only keeps new ones from starting.
+ *
+ * The child gets its own blocking descriptors of the fifo as
+ * --jobserver-auth=R,W, which every make since 4.2 understands (the
+ * fifo: form needs 4.4); ours is non-blocking.
+ */
+#define JS_HEADROOM_LOW  0.10   /* of --limit-mem */
+#define JS_HEADROOM_OK   0.25
+#define JS_PSI_HIGH      10.0   /* some avg10, % */
+#define JS_PSI_OK        1.0
+
+int js_fd = -1;
+int js_child_fds[2] = { -1, -1 };
+char js_dir[] = "/tmp/ramon-js-XXXXXX";
+char js_path[sizeof js_dir + 8];
+int js_allowed;                /* jobs, including make's own */
+int js_held;                   /* tokens we took out */
+int js_min_allowed;
+bool js_polling;               /* js_fd in epoll, waiting for tokens */
+long js_throttled_us, js_throttled_since = -1;
+
+void handle_mark(const char *label, int len, int pid, uint64_t ts_ns);
+
+void setup_jobserver()
+{
+	char flags[512], buf[64];
+	const char *old = getenv("MAKEFLAGS");
+	int rc;
+
+	if (!mkdtemp(js_dir))
+		quit("mkdtemp '%s'", js_dir);
+	snprintf(js_path, sizeof js_path, "%s/fifo", js_dir);
+	if (mkfifo(js_path, 0600) < 0)
+		quit("mkfifo '%s'", js_path);
+
+	js_fd = open(js_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (js_fd < 0)
+		quit("open '%s'", js_path);
+	js_child_fds[0] = open(js_path, O_RDONLY | O_NONBLOCK);
+	js_child_fds[1] = open(js_path, O_WRONLY);
+	if (js_child_fds[0] < 0 || js_child_fds[1] < 0)
+		quit("open '%s'", js_path);
+	fcntl(js_child_fds[0], F_SETFL, 0);
+
+	for (int i = 0; i < opt_jobserver - 1; i++) {
+		rc = write(js_fd, "+", 1);
+		if (rc != 1)
+			quit("jobserver write");
+	}
+	js_allowed = js_min_allowed = opt_jobserver;
+
+	/* The last --jobserver-auth wins, so an enclosing make's is overridden */
+	snprintf(flags, sizeof flags, "%s%s-j%li --jobserver-auth=%i,%i",
+		 old ? old : "", old && *old ? " " : "", opt_jobserver,
+		 js_child_fds[0], js_child_fds[1]);
+	setenv("MAKEFLAGS", flags, 1);
+
+	snprintf(buf, sizeof buf, "jobs=%i", js_allowed);
+	handle_mark(buf, strlen(buf), getpid(), (cur_wall_us() + zero_wall_us) * 1000UL);
+}
+
+/* Take tokens out of the fifo until we hold as many as we want */
+void js_collect()
+{
+	int want = opt_jobserver - js_allowed;
+	char buf[64];
+
+	while (js_held < want) {
+		int n = want - js_held < (int)sizeof buf ? want - js_held : (int)sizeof buf;
+		int rc = read(js_fd, buf, n);
+		if (rc <= 0)
+			break;
+		js_held += rc;
+	}
+
+	if (js_held < want && !js_polling) {
+		epfd_add(js_fd);
+		js_polling = true;
+	} else if (js_held >= want && js_polling) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, js_fd, NULL);
+		js_polling = false;
+	}
+}
+
+void js_poll(long wall_us, long memcurr)
+{
+	double headroom = 1, psi = 0;
+	int allowed = js_allowed;
+
+	if (opt_maxmem && memcurr >= 0)
+		headroom = 1.0 * (opt_maxmem - memcurr) / opt_maxmem;
+	if (open_and_read_val(cgroup_fd, "memory.pressure", "some avg10=%lf", &psi) != 1)
+		psi = 0;
+
+	if (headroom < JS_HEADROOM_LOW || psi >= JS_PSI_HIGH)
+		allowed = allowed > 1 ? allowed / 2 : 1;
+	else if (headroom > JS_HEADROOM_OK && psi < JS_PSI_OK && allowed < opt_jobserver)
+		allowed++;
+
+	if (allowed != js_allowed) {
+		char buf[64];
+		snprintf(buf, sizeof buf, "jobs=%i", allowed);
+		handle_mark(buf, strlen(buf), getpid(), (wall_us + zero_wall_us) * 1000UL);
+		dbg(2, "jobserver: %i jobs, headroom %.0f%% psi %.2f", allowed, 100 * headroom, psi);
+		js_allowed = allowed;
+		if (allowed < js_min_allowed)
+			js_min_allowed = allowed;
+	}
+
+	if (js_allowed < opt_jobserver && js_throttled_since < 0)
+		js_throttled_since = wall_us;
+	if (js_allowed == opt_jobserver && js_throttled_since >= 0) {
+		js_throttled_us += wall_us - js_throttled_since;
+		js_throttled_since = -1;
+	}
+
+	/* Give back what we no longer need */
+	while (js_held > opt_jobserver - js_allowed) {
+		if (write(js_fd, "+", 1) != 1) {
+			warn("jobserver write");
+			break;
+		}
+		js_held--;
+	}
+	js_collect();
+}
+
+void stop_jobserver(long wall_us)
+{
+	if (js_throttled_since >= 0)
+		js_throttled_us += wall_us - js_throttled_since;
+	outf(1, "jobserver", "jobs=%i min=%i throttled=%.3fs",
+	     opt_jobserver, js_min_allowed, js_throttled_us / 1e6);
+
+	close(js_fd);
+	unlink(js_path);
+	rmdir(js_dir);
+}
+
+/*
+ * --wss: estimate the working set by squeezing the group. At most once
+ * a second we ask the kernel to reclaim a slice of the group's memory
+ * (memory.reclaim) as long as that does not make it fault pages back in
+ * (workingset_refault_* and pgmajfault in memory.stat). When it does,
+ * we stop for a while, twice as long every time, and take smaller
+ * slices. The group's memory.current, squeezed like this, is then
+ * about what it really needs, cold page cache excluded.
+ */
+#define WSS_INTERVAL_US  1000000
+#define WSS_STEP_MIN     (1L << 20)
+#define WSS_STEP_MAX     0.05     /* of memory.current */
+#define WSS_REFAULT_MAX  0.001    /* pages of memory.current per second */
+#define WSS_BACKOFF_MAX  64       /* intervals */
+
+long wss_est = -1, wss_peak = -1;
+long wss_step = WSS_STEP_MIN;
+long wss_last_us, wss_hold_until;
+int wss_backoff = 1;
+unsigned long wss_last_faults;
+bool wss_broken;
+
+static unsigned long wss_read_faults()
+{
+	unsigned long anon = 0, file = 0, old = 0, major = 0;
+	struct kvfmt keys[] = {
+		{ .key = "workingset_refault_anon", .fmt = "%lu", .wo = &anon },
+		{ .key = "workingset_refault_file", .fmt = "%lu", .wo = &file },
+		{ .key = "workingset_refault",      .fmt = "%lu", .wo = &old }, /* < 5.9 */
+		{ .key = "pgmajfault",              .fmt = "%lu", .wo = &major },
+	};
+	FILE *f = fopenat(cgroup_fd, "memory.stat", "r");
+
+	if (!f)
+		return 0;
+	read_kvs(f, 4, keys);
+	fclose(f);
+	return anon + file + old + major;
+}
+
+/* Returns the current estimate, or -1 */
+long wss_poll(long wall_us, long memcurr)
+{
+	unsigned long faults;
+	double rate, max_rate;
+	FILE *f;
+
+	if (wss_broken || memcurr <= 0 || wall_us - wss_last_us < WSS_INTERVAL_US)
+		return wss_est;
+
+	faults = wss_read_faults();
+	rate = 1e6 * (faults - wss_last_faults) / (wall_us - wss_last_us);
+	max_rate = WSS_REFAULT_MAX * memcurr / sysconf(_SC_PAGESIZE);
+	if (max_rate < 1)
+		max_rate = 1;
+	/* the first reading is against zero */
+	if (!wss_last_us)
+		rate = 0;
+	wss_last_faults = faults;
+	wss_last_us = wall_us;
+
+	/* squeezed as it is, this is what the group needs */
+	wss_est = memcurr;
+	if (wss_est > wss_peak)
+		wss_peak = wss_est;
+
+	if (rate > max_rate) {
+		/* too far: the pages are coming back, leave it alone */
+		wss_hold_until = wall_us + (long)wss_backoff * WSS_INTERVAL_US;
+		if (wss_backoff < WSS_BACKOFF_MAX)
+			wss_backoff *= 2;
+		wss_step = wss_step / 2 > WSS_STEP_MIN ? wss_step / 2 : WSS_STEP_MIN;
+		dbg(2, "wss: %.0f refaults/s, holding for %is", rate, wss_backoff / 2);
+		return wss_est;
+	}
+
+	if (wall_us < wss_hold_until)
+		return wss_est;
+	if (wss_backoff > 1)
+		wss_backoff /= 2;
+
+	f = fopenat(cgroup_fd, "memory.reclaim", "w");
+	if (!f) {
+		warn("Could not open memory.reclaim (Linux 5.19+), not estimating the working set");
+		wss_broken = true;
+		return wss_est;
+	}
+	/* EAGAIN just means it did not get all of it */
+	fprintf(f, "%li", wss_step);
+	fclose(f);
+
+	if (wss_step * 2 <= WSS_STEP_MAX * memcurr)
+		wss_step *= 2;
+	return wss_est;
+}
+
+/*
+ * Who holds the memory at the peak: whenever memory.current goes
+ * PEAK_SNAP_STEP above the last snapshot, read smaps_rollup and the
+ * command line of every process in the group. Only the last snapshot
+ * is kept, and shown under group.mempeak at the end.
+ */
+#define PEAK_SNAP_STEP  0.10
+#define PEAK_SNAP_SHOW  10     /* all of them with -v */
+
+struct peak_proc
+{
+	int pid;
+	long rss, pss, anon, shmem;    /* kB */
+	char cmd[128];
+};
+
+struct peak_proc *peak_procs, *peak_next;
+int peak_nprocs, peak_cap, peak_nnext, peak_capnext;
+long peak_snap_mem, peak_snap_us;
+
+static void peak_proc_cb(int pid, void *par __attribute__((unused)))
+{
+	struct peak_proc p = { .pid = pid };
+	char fn[64];
+	size_t n;
+	FILE *f;
+
+	snprintf(fn, sizeof fn, "/proc/%i/smaps_rollup", pid);
+	f = fopen(fn, "re");
+	if (!f)
+		return; /* gone, or a kernel without it */
+	struct kvfmt keys[] = {
+		{ .key = "Rss:",       .fmt = "%li", .wo = &p.rss },
+		{ .key = "Pss:",       .fmt = "%li", .wo = &p.pss },
+		{ .key = "Anonymous:", .fmt = "%li", .wo = &p.anon },
+		{ .key = "Pss_Shmem:", .fmt = "%li", .wo = &p.shmem },
+	};
+	read_kvs(f, 4, keys);
+	fclose(f);
+
+	snprintf(fn, sizeof fn, "/proc/%i/cmdline", pid);
+	f = fopen(fn, "re");
+	n = f ? fread(p.cmd, 1, sizeof p.cmd - 1, f) : 0;
+	if (f)
+		fclose(f);
+	for (size_t i = 0; i < n; i++)
+		if (!p.cmd[i])
+			p.cmd[i] = ' ';
+	while (n > 0 && p.cmd[n - 1] == ' ')
+		n--;
+	p.cmd[n] = 0;
+
+	if (peak_nnext == peak_capnext) {
+		peak_capnext = peak_capnext ? 2 * peak_capnext : 64;
+		peak_next = realloc(peak_next, peak_capnext * sizeof peak_next[0]);
+		if (!peak_next)
+			quit("realloc");
+	}
+	peak_next[peak_nnext++] = p;
+}
+
+static int peak_pss_cmp(const void *a, const void *b)
+{
+	const struct peak_proc *x = a, *y = b;
+	return (x->pss < y->pss) - (x->pss > y->pss);
+}
+
+void peak_snapshot(long wall_us, long memcurr)
+{
+	struct peak_proc *t;
+	int tc;
+
+	peak_nnext = 0;
+	for_each_group_proc(peak_proc_cb, NULL);
+	if (!peak_nnext)
+		return; /* all gone already, keep the last one */
+	qsort(peak_next, peak_nnext, sizeof peak_next[0], peak_pss_cmp);
+
+	t = peak_procs; peak_procs = peak_next; peak_next = t;
+	tc = peak_cap; peak_cap = peak_capnext; peak_capnext = tc;
+	peak_nprocs = peak_nnext;
+	peak_snap_mem = memcurr;
+	peak_snap_us = wall_us;
+	dbg(2, "peak snapshot at %.3fs, %i processes", wall_us / 1e6, peak_nprocs);
+}
+
+void print_peak_procs()
+{
+	const char *suf;
+	unsigned long h = humanize(peak_snap_mem, &suf);
+	int nshow = opt_verbosity >= 2 ? peak_nprocs : PEAK_SNAP_SHOW;
+
+	outf(0, "peak.at", "%.3fs mem=%lu%sB procs=%i", peak_snap_us / 1e6, h, suf, peak_nprocs);
+	for (int i = 0; i < peak_nprocs && i < nshow; i++) {
+		const struct peak_proc *p = &peak_procs[i];
+		const char *s1, *s2, *s3, *s4;
+		unsigned long pss = humanize(p->pss * 1024, &s1);
+		unsigned long rss = humanize(p->rss * 1024, &s2);
+		unsigned long anon = humanize(p->anon * 1024, &s3);
+		unsigned long shmem = humanize(p->shmem * 1024, &s4);
+
+		outf(0, "peak.proc", "pid=%i pss=%lu%sB rss=%lu%sB anon=%lu%sB shmem=%lu%sB cmd=%s",
+		     p->pid, pss, s1, rss, s2, anon, s3, shmem, s4, p->cmd[0] ? p->cmd : "?");
+	}
+}
+
+/* int poll_ctr = 0; */
+
+void poll()
+{
+	static unsigned long last_poll_usage = 0;
+	static unsigned long last_poll_us = 0;
+	static unsigned long last_poll_utime = 0;
+	static long last_host_busy = 0;
+	static unsigned long last_wait_ns = 0;
+
+	unsigned long delta_us, wall_us;
+	struct cgroup_res_info res;
+
+	/* get absolute time */
+	wall_us = cur_wall_us();
+
+	/* poll_ctr++; */
+	/* outf(0, "poll", "drift=%i us", wall_us - poll_ctr * opt_pollms * 1000); */
+
+	/* relative to last measure */
+	delta_us = wall_us - last_poll_us;
+
+	/*
+	 * If we are somehow woken up less than 1 microsecond
+	 * after the last time, just skip this measurement.
+	 */
+	if (delta_us == 0)
+		return;
+
+	read_cgroup(&res);
+
+	unsigned long utime;
+	struct procstat_info stat;
+	int rc = read_proc_stat(child_pid, &stat);
+	if (rc < 0) {
+		warn("Reading procstat during poll failed");
+		utime = 0;
+	} else {
+		utime = stat.utime;
+	}
+
+	struct serve_sample sm = {
+		.res = res,
+		.wall_us = wall_us,
+		.load = 1.0 * (res.usage_usec - last_poll_usage) / delta_us,
+		.rootload = 1000000.0 * (utime - last_poll_utime) / clk_tck / delta_us,
+		.waitload = -1, .cpuwait = -1, .ext_load = -1,
+	};
+
+	char ext_buf[64] = "";
+	if (opt_interference) {
+		struct host_res_info host;
+		if (read_host(&host) == 0) {
+			const char *suf;
+			long emem = ext_mem(&host, &res);
+			long ebusy = (host.busy_usec - last_host_busy) - (res.usage_usec - last_poll_usage);
+
+			if (emem > ext_mempeak)
+				ext_mempeak = emem;
+			/* first poll is relative to time zero */
+			if (last_host_busy == 0)
+				ebusy -= host_zero.busy_usec;
+			last_host_busy = host.busy_usec;
+			emem = humanize(emem, &suf);
+			sm.ext_load = ebusy > 0 ? 1.0 * ebusy / delta_us : 0.0;
+			snprintf(ext_buf, sizeof ext_buf, " ext_load=%.2f ext_mem=%li%sB",
+				 sm.ext_load, emem, suf);
+		}
+	}
+
+	char sched_buf[128] = "";
+	if (opt_schedstat) {
+		struct sched_info si;
+		read_group_sched(&si);
+		/* waitload: average number of tasks waiting for a CPU */
+		sm.cpuwait = si.wait_ns / 1e9;
+		sm.waitload = (si.wait_ns - last_wait_ns) / 1e3 / delta_us;
+		snprintf(sched_buf, sizeof sched_buf, " cpuwait=%.3fs waitload=%.2f nvcsw=%lu nivcsw=%lu",
+			 sm.cpuwait, sm.waitload, si.nvcsw, si.nivcsw);
+		last_wait_ns = si.wait_ns;
+	}
+
+	char wss_buf[32] = "";
+	if (opt_wss) {
+		long wss = wss_poll(wall_us, res.memcurr);
+		if (wss >= 0) {
+			const char *suf;
+			unsigned long h = humanize(wss, &suf);
+			snprintf(wss_buf, sizeof wss_buf, " wss=%lu%sB", h, suf);
+		}
+	}
+
+	const char *memsuf;
+	unsigned long mem = humanize(res.memcurr, &memsuf);
+	char wall_buf[HMS_LEN];
+	char usage_buf[HMS_LEN];
+	char user_buf[HMS_LEN];
+	char system_buf[HMS_LEN];
+
+#if 0
+	t_hms(wall_buf,   wall_us);
+	t_hms(usage_buf,  res.usage_usec);
+	t_hms(user_buf,   res.user_usec);
+	t_hms(system_buf, res.system_usec);
+#else
+	sprintf(wall_buf,   "%.3fs", wall_us / 1e6);
+	sprintf(usage_buf , "%.3fs", res.usage_usec / 1e6);
+	sprintf(user_buf,   "%.3fs", res.user_usec / 1e6);
+	sprintf(system_buf, "%.3fs", res.system_usec / 1e6);
+#endif
+
+	if (opt_samples) {
+		static bool near_limit = false;
+		struct smp_sample ss = {
+			.wall_us = wall_us,
+			.usage_us = res.usage_usec,
+			.user_us = res.user_usec,
+			.sys_us = res.system_usec,
+			.root_us = 1000000L * utime / clk_tck,
+			.mem = res.memcurr > 0 ? res.memcurr : 0,
+		};
+		samples_add(&ss);
+		/* keep the approach to the memory limit */
+		if (opt_maxmem && !near_limit && res.memcurr >= opt_maxmem / 100 * 95)
+			samples_pin();
+		near_limit = opt_maxmem && res.memcurr >= opt_maxmem / 100 * 95;
+	} else {
+		outf(0, "poll", "wall=%s usage=%s user=%s sys=%s mem=%li%sB roottime=%.3fs load=%.2f rootload=%.2f%s%s%s",
+				wall_buf,
+				usage_buf, user_buf, system_buf,
+				mem, memsuf,
+				1.0 * utime / clk_tck,
+				sm.load, sm.rootload,
+				sched_buf, ext_buf, wss_buf
+				);
+	}
+	if (opt_percpu)
+		poll_percpu(wall_us, wall_buf, delta_us);
+	ramon_flush();
+
+	if (trace_f)
+		trace_counters(wall_us, sm.load, res.memcurr, sm.rootload);
+	if (serve_sock >= 0)
+		serve_render(&sm);
+	if (stats_page)
+		update_stats_page(&res, wall_us, sm.load, sm.rootload, RAMON_STATS_RUNNING, 0);
+	if (opt_tui)
+		tui_draw(&sm, delta_us);
+	if (opt_render)
+		render_poll(wall_us, sm.load, sm.rootload, res.memcurr);
+	if (base_npolls)
+		baseline_poll(wall_us, &res);
+	if (js_fd >= 0)
+		js_poll(wall_us, res.memcurr);
+	if (opt_freeze)
+		freeze_poll(res.memcurr);
+	if (opt_peak_procs && res.memcurr > peak_snap_mem * (1 + PEAK_SNAP_STEP))
+		peak_snapshot(wall_us, res.memcurr);
+
+	if (opt_phases)
+		phase_poll(res.memcurr);
+
+	if (opt_maxcpu && res.usage_usec > opt_maxcpu * 1000000)
+		timeout_cpu();
+
+	last_poll_usage = res.usage_usec;
+	last_poll_us = wall_us;
+	last_poll_utime = utime;
+}
+
+void print_exit_status(int status)
+{
+	outf(0, "status", wifstring(status));
+
+	if (WIFEXITED(status)) {
+		int exitcode = WEXITSTATUS(status);
+		outf_col(0, exitcode, "exitcode", "%i", exitcode);
+	} else if (WIFSIGNALED(status)) {
+		int sig = WTERMSIG(status);
+		outf_col(0, 1, "signal", "%i (SIG%s %s)", sig, signame(sig), strsignal(sig));
+		outf_col(0, 0, "core dumped", "%s", WCOREDUMP(status) ? "true" : "false");
+		outf_col(0, 0, "exitcode", "%i", 128 + sig);
+	}
+}
+
+int setup_signalfd()
 {
 	struct sigaction sa;
 	int sfd, rc;
@@ -886,65 +4023,1110 @@ int setup_signalfd()
 	if (rc < 0)
 		return rc;
 
-	/* Set up a signal fd */
-	sigset_t sigmask;
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	sigaddset(&sigmask, SIGCHLD);
-	sigaddset(&sigmask, SIGALRM); /* Used for timer */
-	sigaddset(&sigmask, TIMEOUT_SIGNAL); /* Used for timer */
+	/* Set up a signal fd */
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGCHLD);
+	sigaddset(&sigmask, SIGALRM); /* Used for timer */
+	sigaddset(&sigmask, TIMEOUT_SIGNAL); /* Used for timer */
+	if (opt_freeze)
+		sigaddset(&sigmask, SIGUSR1); /* Thaw */
+
+	rc = sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	if (rc < 0)
+		return rc;
+
+	sfd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+	return sfd;
+}
+
+void restore_signals()
+{
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGCHLD);
+	sigaddset(&sigmask, SIGALRM);
+	sigaddset(&sigmask, TIMEOUT_SIGNAL);
+	if (opt_freeze)
+		sigaddset(&sigmask, SIGUSR1);
+	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+}
+
+void set_poll_timer()
+{
+	struct timeval t;
+	struct itimerval it;
+	int rc;
+
+	/*
+	 * If pollms=0, then both values are zero,
+	 * and setitimer disables the timer.
+	 */
+	t.tv_sec = opt_pollms / 1000;
+	t.tv_usec = (opt_pollms % 1000) * 1000;
+	it.it_interval = t;
+	it.it_value    = t;
+
+	rc = setitimer(ITIMER_REAL, &it, NULL);
+	if (rc < 0)
+		quit("Could not set itimer; polling will not work without it");
+}
+
+/*
+ * Connections from nested invocations (or --mark) carry a stream of
+ * framed messages, see msg.h. We buffer each one until whole messages
+ * are in. A connection that does not start with the magic comes from
+ * an older ramon, which wrote one bare string per mark.
+ */
+struct msg_conn
+{
+	char *buf;
+	size_t len, cap;
+	bool framed, legacy;
+};
+
+struct msg_conn **msg_conns;
+int msg_nconns;
+
+struct msg_conn *msg_conn_get(int fd)
+{
+	if (fd >= msg_nconns) {
+		int n = fd + 16;
+		msg_conns = realloc(msg_conns, n * sizeof msg_conns[0]);
+		if (!msg_conns)
+			quit("realloc connections");
+		memset(msg_conns + msg_nconns, 0, (n - msg_nconns) * sizeof msg_conns[0]);
+		msg_nconns = n;
+	}
+
+	if (!msg_conns[fd]) {
+		msg_conns[fd] = calloc(1, sizeof (struct msg_conn));
+		if (!msg_conns[fd])
+			quit("calloc connection");
+	}
+
+	return msg_conns[fd];
+}
+
+void msg_conn_close(int fd)
+{
+	if (fd < msg_nconns && msg_conns[fd]) {
+		free(msg_conns[fd]->buf);
+		free(msg_conns[fd]);
+		msg_conns[fd] = NULL;
+	}
+	close(fd);
+}
+
+void handle_mark(const char *label, int len, int pid, uint64_t ts_ns)
+{
+	outf(0, "mark", "str=%.*s wall=%.3fs pid=%i", len, label,
+	     ((long)(ts_ns / 1000) - zero_wall_us) / 1e6, pid);
+	if (opt_phases)
+		phase_mark(label, len, (long)(ts_ns / 1000) - zero_wall_us);
+	if (trace_f)
+		trace_mark(label, len, pid, (long)(ts_ns / 1000) - zero_wall_us);
+	if (opt_critpath)
+		cp_mark(label, len, (long)(ts_ns / 1000) - zero_wall_us);
+	if (opt_tui)
+		tui_mark(label, len, (long)(ts_ns / 1000) - zero_wall_us);
+	if (opt_render)
+		render_mark(label, len, (long)(ts_ns / 1000) - zero_wall_us);
+	if (base_mcap)
+		baseline_mark(label, len, (long)(ts_ns / 1000) - zero_wall_us);
+}
+
+/*
+ * Summaries of nested invocations (from any depth, relayed by the ones
+ * in between), printed as a tree at the end.
+ */
+struct sub_info
+{
+	struct ramon_msg_summary s;
+	long end_us;
+	char *path; /* relative to ours */
+	char *cmd;
+};
+
+struct sub_info *subs;
+int nsubs, capsubs;
+
+void handle_summary(const struct ramon_msg_hdr *h, const char *payload)
+{
+	struct ramon_msg_summary sm;
+	size_t ours = strlen(cgroup_path);
+
+	if (h->len < sizeof sm) {
+		WARN_ONCE("Short summary message");
+		return;
+	}
+	memcpy(&sm, payload, sizeof sm);
+	if (h->len < sizeof sm + sm.pathlen + sm.cmdlen) {
+		WARN_ONCE("Short summary message");
+		return;
+	}
+
+	if (nsubs == capsubs) {
+		capsubs = capsubs ? 2 * capsubs : 16;
+		subs = realloc(subs, capsubs * sizeof subs[0]);
+		if (!subs)
+			quit("realloc subs");
+	}
+
+	const char *path = payload + sizeof sm;
+	const char *cmd = path + sm.pathlen;
+	size_t pathlen = sm.pathlen;
+	if (pathlen >= ours && !strncmp(path, cgroup_path, ours)) {
+		path += ours;
+		pathlen -= ours;
+	}
+
+	struct sub_info *si = &subs[nsubs++];
+	si->s = sm;
+	si->end_us = (long)(h->ts_ns / 1000) - zero_wall_us;
+	si->path = strndup(path, pathlen);
+	si->cmd = strndup(cmd, sm.cmdlen);
+}
+
+void send_summary(struct cgroup_res_info *res, long wall_usec, int exitcode)
+{
+	size_t pathlen = strlen(cgroup_path);
+	size_t cmdlen = strlen(cmd_str);
+	char buf[sizeof (struct ramon_msg_summary) + PATH_MAX + sizeof cmd_str];
+	struct ramon_msg_summary sm = {
+		.usage_usec  = res->usage_usec,
+		.user_usec   = res->user_usec,
+		.system_usec = res->system_usec,
+		.mempeak     = res->mempeak,
+		.pidpeak     = res->pidpeak,
+		.wall_usec   = wall_usec,
+		.exitcode    = exitcode,
+		.pathlen     = pathlen,
+		.cmdlen      = cmdlen,
+	};
+
+	memcpy(buf, &sm, sizeof sm);
+	memcpy(buf + sizeof sm, cgroup_path, pathlen);
+	memcpy(buf + sizeof sm + pathlen, cmd_str, cmdlen);
+	notify_up(RAMON_MSG_SUMMARY, buf, sizeof sm + pathlen + cmdlen);
+	flush_up();
+}
+
+static int sub_cmp(const void *a, const void *b)
+{
+	const struct sub_info *x = a, *y = b;
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Print the nested invocations as a tree. Sorting by cgroup path puts
+ * every invocation right before the ones nested in it.
+ */
+void print_subs(struct cgroup_res_info *res, long wall_usec)
+{
+	qsort(subs, nsubs, sizeof subs[0], sub_cmp);
+
+	for (int i = 0; i < nsubs; i++) {
+		struct sub_info *si = &subs[i];
+		const char *suf;
+		unsigned long mem = humanize(si->s.mempeak > 0 ? si->s.mempeak : 0, &suf);
+		int depth = 0;
+
+		for (const char *c = si->path; *c; c++)
+			depth += *c == '/';
+
+		outf(1, "sub", "%*scpu=%.3fs (%.1f%%) mempeak=%lu%sB wall=%.3fs (%.1f%%) start=%.3fs exitcode=%i cmd=%s",
+		     2 * (depth > 0 ? depth - 1 : 0), "",
+		     si->s.usage_usec / 1e6,
+		     res->usage_usec > 0 ? 100.0 * si->s.usage_usec / res->usage_usec : 0.0,
+		     mem, suf,
+		     si->s.wall_usec / 1e6,
+		     wall_usec > 0 ? 100.0 * si->s.wall_usec / wall_usec : 0.0,
+		     (si->end_us - si->s.wall_usec) / 1e6,
+		     si->s.exitcode, si->cmd);
+	}
+}
+
+void handle_msg(const struct ramon_msg_hdr *h, const char *payload)
+{
+	switch (h->type) {
+	case RAMON_MSG_MARK:
+		handle_mark(payload, h->len, h->pid, h->ts_ns);
+		break;
+	case RAMON_MSG_SUMMARY:
+		handle_summary(h, payload);
+		break;
+	default:
+		WARN_ONCE("Ignoring message of unknown type %i", h->type);
+		return;
+	}
+
+	/* relay upwards if connected, timestamp and all */
+	if (sock_up >= 0) {
+		if (up_len + sizeof *h + h->len > sizeof up_buf)
+			flush_up();
+		queue_up(h, sizeof *h);
+		queue_up(payload, h->len);
+	}
+}
+
+/*
+ * The shared-memory mark ring (see ramon-mark.h). It lives in a private
+ * directory, $RAMONRING, as a file to map and a fifo to wake us up, both
+ * opened by path: inherited fd numbers do not survive programs that
+ * close what they do not know about, and may then be something else.
+ */
+#define RING_NSLOTS 16384
+
+struct ramon_ring *ring;
+int ring_efd = -1;         /* the wake fifo, read end */
+uint64_t ring_dropped;
+char ring_dir[] = "/dev/shm/ramon-ring-XXXXXX";
+char ring_path[sizeof ring_dir + 8], ring_wake_path[sizeof ring_dir + 8];
+
+/* Remove the files; whoever still has the ring mapped keeps it */
+void stop_ring()
+{
+	if (ring_path[0])
+		unlink(ring_path);
+	if (ring_wake_path[0])
+		unlink(ring_wake_path);
+	if (ring_path[0])
+		rmdir(ring_dir);
+}
+
+void setup_ring()
+{
+	size_t sz = sizeof *ring + RING_NSLOTS * sizeof ring->slots[0];
+	int fd = -1;
+
+	if (!mkdtemp(ring_dir)) {
+		strcpy(ring_dir, "/tmp/ramon-ring-XXXXXX");
+		if (!mkdtemp(ring_dir))
+			goto fail;
+	}
+	snprintf(ring_path, sizeof ring_path, "%s/ring", ring_dir);
+	snprintf(ring_wake_path, sizeof ring_wake_path, "%s/wake", ring_dir);
+
+	fd = open(ring_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, sz) < 0)
+		goto fail;
+
+	ring = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		goto fail;
+	close(fd);
+	fd = -1;
+
+	/* read-write, so that it never sees a hangup when writers go */
+	if (mkfifo(ring_wake_path, 0600) < 0)
+		goto fail;
+	ring_efd = open(ring_wake_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (ring_efd < 0)
+		goto fail;
+
+	ring->nslots = RING_NSLOTS;
+	for (int i = 0; i < RING_NSLOTS; i++)
+		ring->slots[i].seq = i;
+	__atomic_store_n(&ring->magic, RAMON_RING_MAGIC, __ATOMIC_RELEASE);
+
+	setenv(RAMON_RING_VAR, ring_dir, 1);
+	return;
+
+fail:
+	warn("Could not set up the mark ring");
+	if (ring && ring != MAP_FAILED)
+		munmap(ring, sz);
+	if (fd >= 0)
+		close(fd);
+	ring = NULL;
+	opt_ring = false;
+	unsetenv(RAMON_RING_VAR);
+	stop_ring();
+}
+
+void drain_ring()
+{
+	static const char *sufs[] = {
+		[RAMON_RING_MARK]  = "",
+		[RAMON_RING_BEGIN] = ".0",
+		[RAMON_RING_END]   = ".1",
+	};
+	uint64_t pos = ring->tail;
+	uint64_t dropped;
+	int n = 0;
+
+	for (;; pos++) {
+		struct ramon_ring_rec *rec = &ring->slots[pos & (RING_NSLOTS - 1)];
+		char label[RAMON_RING_LABEL_LEN + 3];
+		int len;
+
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+
+		len = snprintf(label, sizeof label, "%.*s%s",
+			       rec->len <= RAMON_RING_LABEL_LEN ? rec->len : RAMON_RING_LABEL_LEN,
+			       rec->label, rec->type <= RAMON_RING_END ? sufs[rec->type] : "");
+		handle_mark(label, len, rec->pid, rec->ts_ns);
+		if (sock_up >= 0)
+			notify_up_as(RAMON_MSG_MARK, label, len, rec->pid, rec->ts_ns);
+
+		__atomic_store_n(&rec->seq, pos + RING_NSLOTS, __ATOMIC_RELEASE);
+		n++;
+	}
+	__atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped > ring_dropped) {
+		errno = 0;
+		warn("Mark ring overflowed, %lu marks dropped", dropped - ring_dropped);
+		ring_dropped = dropped;
+	}
+
+	if (n) {
+		ramon_flush();
+		if (sock_up >= 0)
+			flush_up();
+	}
+}
+
+void handle_ring_efd()
+{
+	char buf[256];
+
+	while (read(ring_efd, buf, sizeof buf) > 0)
+		;
+	drain_ring();
+}
+
+void handle_msg_conn(int fd, uint32_t events)
+{
+	struct msg_conn *c = msg_conn_get(fd);
+	bool eof = false;
+	ssize_t rc = 0;
+
+	if (events & EPOLLIN) {
+		if (c->cap - c->len < 4096) {
+			c->cap = c->cap ? 2 * c->cap : 1 << 16;
+			c->buf = realloc(c->buf, c->cap);
+			if (!c->buf)
+				quit("realloc connection buffer");
+		}
+		rc = read(fd, c->buf + c->len, c->cap - c->len);
+		if (rc > 0)
+			c->len += rc;
+	}
+	if (rc == 0 || (rc < 0 && errno != EINTR && errno != EAGAIN) || (events & (EPOLLHUP | EPOLLERR)))
+		eof = rc <= 0;
+
+	if (!c->framed && !c->legacy && (c->len >= sizeof (uint32_t) || eof)) {
+		uint32_t magic = 0;
+		memcpy(&magic, c->buf, c->len < sizeof magic ? c->len : sizeof magic);
+		if (magic == RAMON_MSG_MAGIC)
+			c->framed = true;
+		else if (c->len > 0)
+			c->legacy = true;
+	}
+
+	if (c->legacy && c->len > 0) {
+		handle_mark(c->buf, c->len, 0, mono_ns());
+		if (sock_up >= 0)
+			notify_up(RAMON_MSG_MARK, c->buf, c->len);
+		c->len = 0;
+	}
+
+	if (c->framed) {
+		size_t off = 0;
+		struct ramon_msg_hdr h;
+
+		while (c->len - off >= sizeof h) {
+			memcpy(&h, c->buf + off, sizeof h);
+			if (h.magic != RAMON_MSG_MAGIC) {
+				warn("Garbage on mark connection, dropping it");
+				eof = true;
+				break;
+			}
+			if (c->len - off < sizeof h + h.len)
+				break;
+			handle_msg(&h, c->buf + off + sizeof h);
+			off += sizeof h + h.len;
+		}
+		memmove(c->buf, c->buf + off, c->len - off);
+		c->len -= off;
+	}
+
+	ramon_flush();
+	if (sock_up >= 0 && up_len)
+		flush_up();
+
+	if (eof)
+		msg_conn_close(fd);
+}
+
+/*
+ * Taskstats exit records. The kernel sends a record over generic
+ * netlink for every task that exits on the CPUs we register for,
+ * including the ones that live for less than a poll interval, which
+ * polling /proc never sees. Records carry no cgroup, so we filter
+ * them by checking whether the task or its parent (which is still
+ * alive when the child exits) is in our group.
+ */
+int ts_sock = -1;
+int ts_family;
+char ts_cpumask[32];
+unsigned long ts_nrecs;
+unsigned long ts_lost;
+bool ts_delayacct = true;  /* the blkio, swapin and reclaim delays are filled */
+
+/* Per-command aggregation, keyed by ac_comm */
+struct ts_agg
+{
+	char comm[TS_COMM_LEN];
+	unsigned long n;
+	unsigned long utime_us;
+	unsigned long stime_us;
+	unsigned long maxrss_kb;
+	unsigned long read_bytes;
+	unsigned long write_bytes;
+	unsigned long cpu_delay_ns;
+	unsigned long blkio_delay_ns;
+	unsigned long swapin_delay_ns;
+	unsigned long freepages_delay_ns;
+};
+
+struct ts_agg *ts_aggs;
+int ts_naggs, ts_capaggs;
+
+/* Cache of membership checks, indexed by pid modulo size */
+#define TS_MEMB_SZ 4096
+struct { int pid; bool ours; } ts_memb[TS_MEMB_SZ];
+
+/* cgroup path relative to the mount, as seen in /proc/pid/cgroup */
+const char *cgroup_relpath()
+{
+	size_t n = strlen(cgroup_mnt);
+	if (strncmp(cgroup_path, cgroup_mnt, n))
+		return cgroup_path;
+	return cgroup_path + n;
+}
+
+bool pid_in_group(int pid)
+{
+	char fn[64], line[PATH_MAX + 8];
+	const char *rel = cgroup_relpath();
+	size_t rlen = strlen(rel);
+	bool ret = false;
+	FILE *f;
+
+	sprintf(fn, "/proc/%i/cgroup", pid);
+	f = fopen(fn, "re");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof line, f)) {
+		/* the cgroup2 line is "0::/path" */
+		if (strncmp(line, "0::", 3))
+			continue;
+		const char *p = line + 3;
+		ret = !strncmp(p, rel, rlen) && (p[rlen] == '/' || p[rlen] == '\n' || !p[rlen]);
+		break;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+bool ts_pid_ours(int pid)
+{
+	int i = pid % TS_MEMB_SZ;
+
+	if (pid <= 0)
+		return false;
+	if (ts_memb[i].pid != pid) {
+		ts_memb[i].pid = pid;
+		ts_memb[i].ours = pid == child_pid || pid_in_group(pid);
+	}
+	return ts_memb[i].ours;
+}
+
+int nl_open(int proto, unsigned groups)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = groups };
+	int s, sz;
+
+	s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, proto);
+	if (s < 0)
+		return -1;
+
+	/* Event storms should not overflow the socket; best effort */
+	sz = 16 << 20;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof sz) < 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int genl_send(int s, int family, int cmd, int attr, const void *data, int len)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[256];
+	} req;
+	struct nlattr *na;
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+
+	memset(&req, 0, sizeof req);
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = family;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_pid = getpid();
+	req.g.cmd = cmd;
+	req.g.version = 1;
+
+	na = (struct nlattr *)((char *)&req + NLMSG_ALIGN(req.n.nlmsg_len));
+	na->nla_type = attr;
+	na->nla_len = NLA_HDRLEN + len;
+	memcpy((char *)na + NLA_HDRLEN, data, len);
+	req.n.nlmsg_len += NLA_ALIGN(na->nla_len);
+
+	return sendto(s, &req, req.n.nlmsg_len, 0, (struct sockaddr *)&addr, sizeof addr);
+}
+
+int genl_family_id(int s, const char *name)
+{
+	char buf[4096];
+	int rc;
+
+	if (genl_send(s, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME, name, strlen(name) + 1) < 0)
+		return -1;
 
-	rc = sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	rc = recv(s, buf, sizeof buf, 0);
 	if (rc < 0)
-		return rc;
+		return -1;
 
-	sfd = signalfd(-1, &sigmask, SFD_CLOEXEC);
-	return sfd;
+	struct nlmsghdr *n = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(n, (unsigned)rc) || n->nlmsg_type == NLMSG_ERROR)
+		return -1;
+
+	struct nlattr *na = (struct nlattr *)((char *)NLMSG_DATA(n) + GENL_HDRLEN);
+	int left = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	while (left >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN && na->nla_len <= left) {
+		if (na->nla_type == CTRL_ATTR_FAMILY_ID)
+			return *(uint16_t *)((char *)na + NLA_HDRLEN);
+		left -= NLA_ALIGN(na->nla_len);
+		na = (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+	}
+
+	return -1;
 }
 
-void restore_signals()
+void setup_taskstats()
 {
-	sigset_t sigmask;
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	sigaddset(&sigmask, SIGCHLD);
-	sigaddset(&sigmask, SIGALRM);
-	sigaddset(&sigmask, TIMEOUT_SIGNAL);
-	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+	ts_sock = nl_open(NETLINK_GENERIC, 0);
+	if (ts_sock < 0)
+		goto fail;
+
+	ts_family = genl_family_id(ts_sock, TASKSTATS_GENL_NAME);
+	if (ts_family < 0)
+		goto fail;
+
+	/* Tasks may exit anywhere, listen on all possible CPUs */
+	snprintf(ts_cpumask, sizeof ts_cpumask, "0-%li", ncpu - 1);
+	if (genl_send(ts_sock, ts_family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
+		      ts_cpumask, strlen(ts_cpumask) + 1) < 0)
+		goto fail;
+
+	fcntl(ts_sock, F_SETFL, O_NONBLOCK);
+	epfd_add(ts_sock);
+
+	/*
+	 * cpudelay comes from the scheduler, the other delays only with
+	 * delay accounting on. Kernels before 5.14 have no sysctl, and it
+	 * is on unless booted with nodelayacct.
+	 */
+	FILE *f = fopen("/proc/sys/kernel/task_delayacct", "re");
+	int on = 1;
+	if (f) {
+		if (fscanf(f, "%i", &on) != 1)
+			on = 1;
+		fclose(f);
+	}
+	ts_delayacct = on;
+	if (!ts_delayacct) {
+		errno = 0;
+		warn("Delay accounting is off, no blkio, swapin and reclaim delays (sysctl kernel.task_delayacct=1)");
+	}
+	return;
+
+fail:
+	warn("Could not set up taskstats, not collecting exit records");
+	if (ts_sock >= 0)
+		close(ts_sock);
+	ts_sock = -1;
+	opt_taskstats = false;
 }
 
-int sfd, epfd;
+struct ts_agg *ts_agg_get(const char *comm)
+{
+	for (int i = 0; i < ts_naggs; i++)
+		if (!strncmp(ts_aggs[i].comm, comm, TS_COMM_LEN))
+			return &ts_aggs[i];
+
+	if (ts_naggs == ts_capaggs) {
+		ts_capaggs = ts_capaggs ? 2 * ts_capaggs : 64;
+		ts_aggs = realloc(ts_aggs, ts_capaggs * sizeof ts_aggs[0]);
+		if (!ts_aggs)
+			quit("realloc taskstats");
+	}
 
-void set_poll_timer()
+	struct ts_agg *a = &ts_aggs[ts_naggs++];
+	memset(a, 0, sizeof *a);
+	strncpy(a->comm, comm, TS_COMM_LEN - 1);
+	return a;
+}
+
+void ts_account(int pid, const struct taskstats *t)
 {
-	struct timeval t;
-	struct itimerval it;
+	/* The exiting task may already be gone from /proc; its parent is not */
+	bool ours = ts_pid_ours(pid) || ts_pid_ours(t->ac_ppid);
+
+	/* pid will be reused, maybe by one of ours, forget about it */
+	if (ts_memb[pid % TS_MEMB_SZ].pid == pid)
+		ts_memb[pid % TS_MEMB_SZ].pid = 0;
+	if (!ours)
+		return;
+
+	struct ts_agg *a = ts_agg_get(t->ac_comm);
+	a->n++;
+	a->utime_us += t->ac_utime;
+	a->stime_us += t->ac_stime;
+	if (t->hiwater_rss > a->maxrss_kb)
+		a->maxrss_kb = t->hiwater_rss;
+	a->read_bytes += t->read_bytes;
+	a->write_bytes += t->write_bytes;
+	a->cpu_delay_ns += t->cpu_delay_total;
+	a->blkio_delay_ns += t->blkio_delay_total;
+	a->swapin_delay_ns += t->swapin_delay_total;
+	a->freepages_delay_ns += t->freepages_delay_total;
+	ts_nrecs++;
+}
+
+/* Look for AGGR_PID records, the per-TGID ones only repeat a subset */
+void ts_parse(struct nlmsghdr *n)
+{
+	struct nlattr *na = (struct nlattr *)((char *)NLMSG_DATA(n) + GENL_HDRLEN);
+	int left = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+	while (left >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN && na->nla_len <= left) {
+		if (na->nla_type == TASKSTATS_TYPE_AGGR_PID) {
+			struct nlattr *in = (struct nlattr *)((char *)na + NLA_HDRLEN);
+			int ileft = na->nla_len - NLA_HDRLEN;
+			int pid = -1;
+
+			while (ileft >= NLA_HDRLEN && in->nla_len >= NLA_HDRLEN && in->nla_len <= ileft) {
+				void *data = (char *)in + NLA_HDRLEN;
+				size_t dlen = in->nla_len - NLA_HDRLEN;
+
+				if (in->nla_type == TASKSTATS_TYPE_PID) {
+					pid = *(uint32_t *)data;
+				} else if (in->nla_type == TASKSTATS_TYPE_STATS) {
+					/* the kernel's struct may be older or newer than ours */
+					struct taskstats t;
+					memset(&t, 0, sizeof t);
+					memcpy(&t, data, dlen < sizeof t ? dlen : sizeof t);
+					ts_account(pid, &t);
+				}
+				ileft -= NLA_ALIGN(in->nla_len);
+				in = (struct nlattr *)((char *)in + NLA_ALIGN(in->nla_len));
+			}
+		}
+		left -= NLA_ALIGN(na->nla_len);
+		na = (struct nlattr *)((char *)na + NLA_ALIGN(na->nla_len));
+	}
+}
+
+/* Drain everything pending on the socket */
+void handle_taskstats()
+{
+	static char buf[1 << 16];
 	int rc;
 
+	while (1) {
+		rc = recv(ts_sock, buf, sizeof buf, MSG_DONTWAIT);
+		if (rc < 0 && errno == ENOBUFS) {
+			ts_lost++;
+			WARN_ONCE("taskstats socket overflowed, some exit records were lost");
+			continue;
+		}
+		if (rc <= 0)
+			break;
+
+		struct nlmsghdr *n = (struct nlmsghdr *)buf;
+		for (; NLMSG_OK(n, (unsigned)rc); n = NLMSG_NEXT(n, rc)) {
+			if (n->nlmsg_type == ts_family)
+				ts_parse(n);
+		}
+	}
+}
+
+void close_taskstats()
+{
+	genl_send(ts_sock, ts_family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK,
+		  ts_cpumask, strlen(ts_cpumask) + 1);
+	close(ts_sock);
+	ts_sock = -1;
+}
+
+static int ts_agg_cmp(const void *a, const void *b)
+{
+	const struct ts_agg *x = a, *y = b;
+	unsigned long cx = x->utime_us + x->stime_us;
+	unsigned long cy = y->utime_us + y->stime_us;
+	return (cx < cy) - (cx > cy);
+}
+
+/* Per-command summary, heaviest first */
+void print_taskstats()
+{
+	int nshow = opt_verbosity >= 2 ? ts_naggs : 20;
+
+	handle_taskstats();
+	close_taskstats();
+
+	qsort(ts_aggs, ts_naggs, sizeof ts_aggs[0], ts_agg_cmp);
+
+	outf(1, "exits.total", "%lu tasks, %i commands%s", ts_nrecs, ts_naggs,
+	     ts_lost ? " (some records lost)" : "");
+	for (int i = 0; i < ts_naggs && i < nshow; i++) {
+		struct ts_agg *a = &ts_aggs[i];
+		const char *rsuf, *rdsuf, *wrsuf;
+		unsigned long rss = humanize(a->maxrss_kb * 1024, &rsuf);
+		unsigned long rd = humanize(a->read_bytes, &rdsuf);
+		unsigned long wr = humanize(a->write_bytes, &wrsuf);
+		char blkio[32] = "-", swapin[32] = "-", reclaim[32] = "-";
+
+		/* zeros without delay accounting would read as no waiting */
+		if (ts_delayacct) {
+			snprintf(blkio, sizeof blkio, "%.3fs", a->blkio_delay_ns / 1e9);
+			snprintf(swapin, sizeof swapin, "%.3fs", a->swapin_delay_ns / 1e9);
+			snprintf(reclaim, sizeof reclaim, "%.3fs", a->freepages_delay_ns / 1e9);
+		}
+
+		outf(1, "exits", "cmd=%s n=%lu cpu=%.3fs user=%.3fs sys=%.3fs maxrss=%lu%sB "
+		     "read=%lu%sB write=%lu%sB cpudelay=%.3fs blkiodelay=%s swapindelay=%s reclaimdelay=%s",
+		     a->comm, a->n,
+		     (a->utime_us + a->stime_us) / 1e6, a->utime_us / 1e6, a->stime_us / 1e6,
+		     rss, rsuf, rd, rdsuf, wr, wrsuf,
+		     a->cpu_delay_ns / 1e9, blkio, swapin, reclaim);
+	}
+}
+
+/*
+ * Process timeline from the proc connector. The kernel multicasts a
+ * message for every fork, exec, comm change and exit in the system; we
+ * keep a hash set of the processes in our group (the child, and
+ * anything forked from something in the set) so that all other events
+ * are dropped after a single lookup. A span runs from a fork or exec
+ * to the next exec or the exit, and is output when it ends.
+ */
+int pc_sock = -1;
+unsigned long pc_forks, pc_execs, pc_spans, pc_lost;
+
+struct pc_proc
+{
+	int pid;         /* 0 = free, -1 = deleted */
+	int ppid;
+	long start_us;
+	char comm[16];
+};
+
+struct pc_proc *pc_tab;
+unsigned pc_cap, pc_used; /* used counts deleted slots too */
+unsigned pc_live;
+
+#define PC_DELETED (-1)
+
+static unsigned pc_hash(int pid)
+{
+	return (unsigned)pid * 2654435761u;
+}
+
+struct pc_proc *pc_find(int pid)
+{
+	if (!pc_tab)
+		return NULL;
+	for (unsigned i = pc_hash(pid) & (pc_cap - 1);; i = (i + 1) & (pc_cap - 1)) {
+		if (pc_tab[i].pid == pid)
+			return &pc_tab[i];
+		if (pc_tab[i].pid == 0)
+			return NULL;
+	}
+}
+
+struct pc_proc *pc_insert(int pid);
+
+void pc_grow()
+{
+	struct pc_proc *old = pc_tab;
+	unsigned oldcap = pc_cap;
+
 	/*
-	 * If pollms=0, then both values are zero,
-	 * and setitimer disables the timer.
+	 * Rehashing also drops deleted slots, so size by live entries,
+	 * with room for as many again before the next rehash.
 	 */
-	t.tv_sec = opt_pollms / 1000;
-	t.tv_usec = (opt_pollms % 1000) * 1000;
-	it.it_interval = t;
-	it.it_value    = t;
+	pc_cap = 1024;
+	while (4 * (pc_live + 1) > pc_cap)
+		pc_cap *= 2;
+	pc_tab = calloc(pc_cap, sizeof pc_tab[0]);
+	if (!pc_tab)
+		quit("calloc proc table");
+	pc_used = pc_live = 0;
+
+	for (unsigned i = 0; i < oldcap; i++)
+		if (old[i].pid > 0)
+			*pc_insert(old[i].pid) = old[i];
+	free(old);
+}
 
-	rc = setitimer(ITIMER_REAL, &it, NULL);
-	if (rc < 0)
-		quit("Could not set itimer; polling will not work without it");
+struct pc_proc *pc_insert(int pid)
+{
+	if (2 * (pc_used + 1) > pc_cap)
+		pc_grow();
+
+	/* pid may be further along than a deleted slot, look first */
+	unsigned i = pc_hash(pid) & (pc_cap - 1);
+	int del = -1;
+	while (pc_tab[i].pid != 0 && pc_tab[i].pid != pid) {
+		if (pc_tab[i].pid == PC_DELETED && del < 0)
+			del = i;
+		i = (i + 1) & (pc_cap - 1);
+	}
+	if (pc_tab[i].pid == pid)
+		return &pc_tab[i];
+
+	if (del >= 0)
+		i = del;
+	else
+		pc_used++;
+	pc_live++;
+	pc_tab[i].pid = pid;
+	return &pc_tab[i];
 }
 
-void epfd_add(int fd)
+static long pc_rel_us(uint64_t ts_ns)
 {
-	struct epoll_event ev;
+	/* event timestamps are CLOCK_MONOTONIC, as is cur_wall_us() */
+	return ts_ns / 1000 - zero_wall_us;
+}
+
+void pc_end_span(struct pc_proc *p, long end_us)
+{
+	char comm[sizeof p->comm];
+
+	/* keep the output line parseable */
+	strcpy(comm, p->comm);
+	for (char *c = comm; *c; c++)
+		if (*c == ' ' || *c == '=')
+			*c = '_';
+
+	outf(1, "proc", "pid=%i ppid=%i comm=%s start=%.3fs end=%.3fs",
+	     p->pid, p->ppid, comm[0] ? comm : "?", p->start_us / 1e6, end_us / 1e6);
+	if (trace_f)
+		trace_span(p->pid, p->ppid, comm[0] ? comm : "?", p->start_us, end_us);
+	pc_spans++;
+}
+
+void pc_event(struct proc_event *ev)
+{
+	struct pc_proc *p, *pp;
+	long t = pc_rel_us(ev->timestamp_ns);
+
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		/* threads are part of their process' span */
+		if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+			return;
+		pp = pc_find(ev->event_data.fork.parent_tgid);
+		if (!pp && ev->event_data.fork.parent_tgid != getpid())
+			return;
+		p = pc_insert(ev->event_data.fork.child_tgid);
+		/* pp may have moved */
+		pp = pc_find(ev->event_data.fork.parent_tgid);
+		p->ppid = ev->event_data.fork.parent_tgid;
+		p->start_us = t;
+		strcpy(p->comm, pp ? pp->comm : "ramon");
+		pc_forks++;
+		break;
+
+	case PROC_EVENT_EXEC:
+		p = pc_find(ev->event_data.exec.process_tgid);
+		if (!p)
+			return;
+		pc_end_span(p, t);
+		p->start_us = t;
+		pc_execs++;
+		/*
+		 * The event does not carry the new name. If the process is
+		 * already gone we keep the old one.
+		 */
+		{
+			char fn[64];
+			sprintf(fn, "/proc/%i/comm", p->pid);
+			FILE *f = fopen(fn, "re");
+			if (f) {
+				if (fgets(p->comm, sizeof p->comm, f))
+					p->comm[strcspn(p->comm, "\n")] = 0;
+				fclose(f);
+			}
+		}
+		break;
+
+	case PROC_EVENT_COMM:
+		/* prctl(PR_SET_NAME) */
+		p = pc_find(ev->event_data.comm.process_tgid);
+		if (!p)
+			return;
+		memcpy(p->comm, ev->event_data.comm.comm, sizeof p->comm);
+		p->comm[sizeof p->comm - 1] = 0;
+		break;
+
+	case PROC_EVENT_EXIT:
+		if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+			return;
+		p = pc_find(ev->event_data.exit.process_tgid);
+		if (!p)
+			return;
+		pc_end_span(p, t);
+		p->pid = PC_DELETED;
+		pc_live--;
+		break;
+
+	default:
+		break;
+	}
+}
+
+void setup_proc_connector()
+{
+	/* nlmsghdr + cn_msg + op, cn_msg has a flexible array at the end */
+	char req[NLMSG_SPACE(sizeof (struct cn_msg) + sizeof (enum proc_cn_mcast_op))];
+	struct nlmsghdr *n = (struct nlmsghdr *)req;
+	struct cn_msg *cn = NLMSG_DATA(n);
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+
+	pc_sock = nl_open(NETLINK_CONNECTOR, CN_IDX_PROC);
+	if (pc_sock < 0)
+		goto fail;
+
+	memset(req, 0, sizeof req);
+	n->nlmsg_len = NLMSG_LENGTH(sizeof *cn + sizeof op);
+	n->nlmsg_type = NLMSG_DONE;
+	n->nlmsg_pid = getpid();
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof op;
+	memcpy(cn->data, &op, sizeof op);
+
+	if (send(pc_sock, req, n->nlmsg_len, 0) != (ssize_t)n->nlmsg_len)
+		goto fail;
+
+	pc_grow();
+	fcntl(pc_sock, F_SETFL, O_NONBLOCK);
+	epfd_add(pc_sock);
+	return;
+
+fail:
+	warn("Could not subscribe to the proc connector, not recording processes");
+	if (pc_sock >= 0)
+		close(pc_sock);
+	pc_sock = -1;
+	opt_proctree = false;
+}
+
+void handle_proc_connector()
+{
+	static char buf[1 << 16];
 	int rc;
 
-	ev.events = EPOLLIN;
-	ev.data.fd = fd;
-	rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
-	if (rc < 0)
-		quit("epoll_ctl add %i", fd);
+	while (1) {
+		rc = recv(pc_sock, buf, sizeof buf, MSG_DONTWAIT);
+		if (rc < 0 && errno == ENOBUFS) {
+			pc_lost++;
+			WARN_ONCE("proc connector socket overflowed, some process events were lost");
+			continue;
+		}
+		if (rc <= 0)
+			break;
+
+		struct nlmsghdr *n = (struct nlmsghdr *)buf;
+		for (; NLMSG_OK(n, (unsigned)rc); n = NLMSG_NEXT(n, rc)) {
+			struct cn_msg *cn = NLMSG_DATA(n);
+			if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+				continue;
+			pc_event((struct proc_event *)cn->data);
+		}
+	}
+}
+
+/* Close the spans of whatever is still alive, and summarize */
+void print_proctree()
+{
+	long now = cur_wall_us();
+
+	handle_proc_connector();
+	close(pc_sock);
+	pc_sock = -1;
+
+	for (unsigned i = 0; i < pc_cap; i++)
+		if (pc_tab[i].pid > 0)
+			pc_end_span(&pc_tab[i], now);
+
+	outf(1, "proctree", "forks=%lu execs=%lu spans=%lu%s", pc_forks, pc_execs, pc_spans,
+	     pc_lost ? " (some events lost)" : "");
+}
+
+/*
+ * Figure out which CPUs the group can actually run on, and set nproc
+ * accordingly. If the cpuset controller is enabled for our group we
+ * trust cpuset.cpus.effective, otherwise we take our own affinity mask,
+ * which is inherited by the child.
+ */
+void read_effective_cpus()
+{
+	cpu_set_t set;
+	char buf[sizeof cpus_effective];
+	bool ok = false;
+	FILE *f;
+
+	f = fopenat(cgroup_fd, "cpuset.cpus.effective", "r");
+	if (f) {
+		if (fgets(buf, sizeof buf, f) && parse_cpulist(buf, &set) == 0 && CPU_COUNT(&set) > 0)
+			ok = true;
+		fclose(f);
+	}
+
+	if (!ok && sched_getaffinity(0, sizeof set, &set) == 0)
+		ok = true;
+
+	if (!ok) {
+		nproc = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus_effective[0] = 0;
+		return;
+	}
+
+	nproc = CPU_COUNT(&set);
+	cpus_set = set;
+	fmt_cpulist(cpus_effective, sizeof cpus_effective, &set);
 }
 
 void print_sysinfo()
@@ -952,11 +5134,13 @@ void print_sysinfo()
 	struct sysinfo info;
 	int rc;
 
-	nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	read_effective_cpus();
 	if (nproc < 0)
 		warn("could not read nproc");
 	else
 		outf(1, "nproc", "%i", nproc);
+	if (cpus_effective[0])
+		outf(1, "cpus", "%s", cpus_effective);
 
 	rc = sysinfo(&info);
 	if (rc < 0) {
@@ -998,6 +5182,17 @@ void prepare_monitor()
 	if (sfd < 0)
 		quit("signalfd");
 
+	if (opt_interference) {
+		setup_host_sampling();
+		if (read_host(&host_zero) < 0) {
+			warn("Could not read host counters, not measuring interference");
+			opt_interference = false;
+		}
+	}
+
+	if (opt_percpu)
+		setup_percpu();
+
 	/* Set zero timestamp */
 	zero_wall_us = cur_wall_us();
 
@@ -1013,6 +5208,23 @@ void prepare_monitor()
 	/* sock down */
 	if (sock_down >= 0)
 		epfd_add(sock_down);
+
+	if (opt_taskstats)
+		setup_taskstats();
+
+	if (opt_proctree)
+		setup_proc_connector();
+
+	if (ring_efd >= 0)
+		epfd_add(ring_efd);
+
+	if (opt_serve)
+		setup_serve();
+
+	if (opt_tui) {
+		setup_tui();
+		epfd_add(tui_pipe[0]);
+	}
 }
 
 void print_overhead(long total_usec)
@@ -1061,22 +5273,72 @@ int handle_sig()
 	case SIGINT:
 		/* Just forward. Is this sensible? If running
 		 * on a tty, the subprocess will also get the signal. */
+		thaw_group("Interrupted");
 		kill(child_pid, SIGINT);
 		return 0;
 	case SIGCHLD:
 		return -1;
 	case SIGALRM:
+		if (ring)
+			drain_ring();
 		poll();
 		return 0;
 	case TIMEOUT_SIGNAL:
 		timeout_wall();
 		return 0;
+	case SIGUSR1:
+		manual_thaw();
+		return 0;
 	default:
 		warn("Unexpected signal: %i", si.ssi_signo);
 		return 0;
 	}
 }
 
+/* Handle whatever messages are pending, without blocking */
+void drain_msgs()
+{
+	struct epoll_event evs[16];
+	bool progress = true;
+
+	while (progress) {
+		int n = epoll_wait(epfd, evs, 16, 0);
+
+		progress = false;
+		for (int i = 0; i < n; i++) {
+			int fd = evs[i].data.fd;
+
+			/* signals are dealt with by our caller */
+			if (fd == sfd)
+				continue;
+
+			progress = true;
+			if (fd == ts_sock)
+				handle_taskstats();
+			else if (fd == pc_sock)
+				handle_proc_connector();
+			else if (fd == ring_efd)
+				handle_ring_efd();
+			else if (fd == serve_sock)
+				serve_accept();
+			else if (is_serve_conn(fd))
+				serve_conn(fd);
+			else if (fd == tui_pipe[0])
+				tui_child_output();
+			else if (fd == js_fd)
+				js_collect();
+			else if (fd == fz_events_fd)
+				handle_freeze_events();
+			else if (fd == sock_down) {
+				int c = accept(sock_down, NULL, NULL);
+				if (c >= 0)
+					epfd_add(c);
+			} else
+				handle_msg_conn(fd, evs[i].events);
+		}
+	}
+}
+
 void wait_monitor()
 {
 	struct epoll_event ev;
@@ -1102,6 +5364,46 @@ void wait_monitor()
 			continue;
 		}
 
+		if (ev.data.fd == ts_sock) {
+			handle_taskstats();
+			continue;
+		}
+
+		if (ev.data.fd == pc_sock) {
+			handle_proc_connector();
+			continue;
+		}
+
+		if (ev.data.fd == ring_efd) {
+			handle_ring_efd();
+			continue;
+		}
+
+		if (ev.data.fd == serve_sock) {
+			serve_accept();
+			continue;
+		}
+
+		if (is_serve_conn(ev.data.fd)) {
+			serve_conn(ev.data.fd);
+			continue;
+		}
+
+		if (ev.data.fd == tui_pipe[0]) {
+			tui_child_output();
+			continue;
+		}
+
+		if (ev.data.fd == js_fd) {
+			js_collect();
+			continue;
+		}
+
+		if (ev.data.fd == fz_events_fd) {
+			handle_freeze_events();
+			continue;
+		}
+
 		/* Child wants to connect */
 		if (ev.data.fd == sock_down) {
 			struct sockaddr_un cli;
@@ -1114,24 +5416,8 @@ void wait_monitor()
 			continue;
 		}
 
-		/* Got a message (hopefully... fixme) */
-		{
-			/* must be a client socket writing */
-			if (ev.events & EPOLLIN) {
-				char buf[200];
-				int rc = read(ev.data.fd, buf, sizeof buf - 1);
-				if (rc > 0) {
-					buf[rc] = 0;
-					outf(0, "mark", "str=%s wall=%.3fs", buf, cur_wall_us() / 1e6);
-					ramon_flush();
-				}
-				/* relay upwards if connected */
-				if (sock_up >= 0)
-					notify_up(buf, rc);
-			}
-			if (ev.events & EPOLLHUP)
-				close(ev.data.fd);
-		}
+		/* Must be a client socket writing */
+		handle_msg_conn(ev.data.fd, ev.events);
 	}
 }
 
@@ -1139,11 +5425,20 @@ void wait_monitor()
 int post_mortem(int pid)
 {
 	unsigned long wall_usec;
+	double intf = -1;
 	int status;
 	int rc;
 
 	wait_cgroup();
 
+	/* Anything nested invocations sent while we waited */
+	drain_msgs();
+	if (ring)
+		drain_ring();
+	if (opt_tui)
+		stop_tui();
+
+	out_summary = out_off;
 	print_current_time("end");
 
 	print_zombie_stats(pid);
@@ -1151,6 +5446,21 @@ int post_mortem(int pid)
 	struct cgroup_res_info res;
 	read_cgroup(&res);
 	print_cgroup_res_info(&res);
+	if (wss_peak >= 0) {
+		const char *suf;
+		unsigned long h = humanize(wss_peak, &suf);
+		outf(0, "group.wsspeak", "%lu%sB", h, suf);
+	}
+	if (peak_nprocs)
+		print_peak_procs();
+	if (opt_schedstat)
+		print_group_sched();
+	if (opt_taskstats)
+		print_taskstats();
+	if (opt_proctree)
+		print_proctree();
+	if (opt_phases)
+		print_phases();
 
 	rc = wait4(pid, &status, WNOHANG, NULL);
 	if (rc != pid)
@@ -1162,7 +5472,29 @@ int post_mortem(int pid)
 
 	outf(0, "walltime", "%.3fs", wall_usec / 1e6);
 	outf(0, "loadavg", "%.2f", 1.0f * res.usage_usec / wall_usec);
+	if (fz_count)
+		outf(0, "group.frozen", "%.3fs (%i times)", fz_total_us / 1e6, fz_count);
+	if (opt_interference)
+		intf = print_interference(&res);
+	if (opt_percpu)
+		print_percpu(wall_usec);
+	if (nproc > 0)
+		outf(1, "utilization", "%.1f%% of %li cpus", 100.0 * res.usage_usec / wall_usec / nproc, nproc);
+	if (cpus_effective[0])
+		outf(1, "cpus", "%s", cpus_effective);
+	if (nsubs)
+		print_subs(&res, wall_usec);
+	if (opt_critpath)
+		print_critpath(wall_usec);
+	if (opt_baseline)
+		print_baseline(&res, wall_usec);
+	if (js_fd >= 0)
+		stop_jobserver(wall_usec);
 	print_overhead(res.usage_usec);
+	if (trace_f)
+		close_trace(wall_usec);
+	if (serve_sock >= 0)
+		stop_serve();
 
 	if (!opt_keep)
 		try_rm_cgroup();
@@ -1170,13 +5502,31 @@ int post_mortem(int pid)
 		dbg(1, "Keeping cgroup in path '%s', you should manually delete it eventually.", cgroup_path);
 
 	if (WIFEXITED(status)) {
-		return WEXITSTATUS(status);
+		rc = WEXITSTATUS(status);
 	} else if (WIFSIGNALED(status)) {
-		return 128 + WTERMSIG(status);
+		rc = 128 + WTERMSIG(status);
 	} else {
 		assert(!"impos?");
-		return -1;
+		rc = -1;
 	}
+
+	if (sock_up >= 0)
+		send_summary(&res, wall_usec, rc);
+	if (stats_page)
+		update_stats_page(&res, wall_usec, 1.0 * res.usage_usec / wall_usec, 0,
+				  RAMON_STATS_DONE, rc);
+	if (opt_samples)
+		samples_close();
+	if (opt_fout)
+		write_trailer(&res, wall_usec, rc, intf);
+	if (opt_record)
+		record_run(&res, wall_usec, rc, intf);
+
+	/* the command's own failure comes first */
+	if (budget_exceeded && rc == 0)
+		rc = BUDGET_EXITCODE;
+
+	return rc;
 }
 
 void setup_sock_down()
@@ -1254,10 +5604,12 @@ void setup()
 		 * to listen for subinvocations. Expose the socket via an environment
 		 * variable.
 		 */
-		find_cgroup_fs();
+		find_cgroup_fs(cgroup_mnt);
+		strcpy(cgroupfs_root, cgroup_mnt);
 		make_new_cgroup();
 	} else {
 		/* subinvocation, nest within the parent's cgroup and connect */
+		find_cgroup_fs(cgroup_mnt);
 		strcpy(cgroupfs_root, e_ramonroot);
 		make_sub_cgroup(e_ramonroot);
 		rc = connect_to_upstream();
@@ -1275,8 +5627,36 @@ void setup()
 		if (rc != 13)
 			warn("couldn't enable memory controller?");
 		fclose(f);
-		write(gopipe[1], "x", 1);
-		close(gopipe[0]);
+	}
+
+	/*
+	 * Same for cpuset, but only if asked to: it is often not delegated,
+	 * and without it we simply measure on whatever CPUs we get.
+	 */
+	if (opt_cpus || opt_mems) {
+		int fd = openat(cgroup_fd, "cgroup.subtree_control", O_WRONLY);
+		if (fd < 0 || write(fd, "+cpuset", 7) != 7)
+			warn("couldn't enable cpuset controller");
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (opt_cpus) {
+		FILE *f = fopenat(cgroup_fd, "cpuset.cpus", "w");
+		if (!f)
+			quit("cannot set cpuset.cpus");
+		fprintf(f, "%s", opt_cpus);
+		if (fclose(f) != 0)
+			quit("cannot set cpuset.cpus to '%s'", opt_cpus);
+	}
+
+	if (opt_mems) {
+		FILE *f = fopenat(cgroup_fd, "cpuset.mems", "w");
+		if (!f)
+			quit("cannot set cpuset.mems");
+		fprintf(f, "%s", opt_mems);
+		if (fclose(f) != 0)
+			quit("cannot set cpuset.mems to '%s'", opt_mems);
 	}
 
 
@@ -1289,13 +5669,19 @@ void setup()
 		fclose(f);
 	}
 
+	/* All limits are in place, release the child */
+	write(gopipe[1], "x", 1);
+	close(gopipe[0]);
+
 	/*
 	 * Re-set the root, even if we are subinvocation: messages are
-	 * passed upwards (TODO!).
+	 * passed upwards, and so is our summary when we finish.
 	 */
 	setenv(VAR_RAMONROOT, cgroup_path, 1);
 	dbg(2, "cgroup is '%s'", cgroup_path);
 	setup_sock_down();
+	if (opt_ring)
+		setup_ring();
 }
 
 int spawn(int argc, char **argv)
@@ -1305,6 +5691,11 @@ int spawn(int argc, char **argv)
 	for (int i = 0; i < argc; i++)
 		outf(1, "argv", "%i = %s", i, argv[i]);
 
+	cmd_argc = argc;
+	cmd_argv = argv;
+	for (int i = 0, off = 0; i < argc && off < (int)sizeof cmd_str; i++)
+		off += snprintf(cmd_str + off, sizeof cmd_str - off, "%s%s", i ? " " : "", argv[i]);
+
 	/* flush before forking */
 	fflush(NULL);
 
@@ -1332,6 +5723,12 @@ int spawn(int argc, char **argv)
 	if (opt_maxstack)
 		limit_own_stack(opt_maxstack);
 
+	/* Output goes above the panel, through us */
+	if (opt_tui) {
+		dup2(tui_pipe[1], STDOUT_FILENO);
+		dup2(tui_pipe[1], STDERR_FILENO);
+	}
+
 	/*
 	 * Close outfile if we opened one. All other files which remain
 	 * were opened with O_CLOEXEC.
@@ -1381,9 +5778,24 @@ int exec_and_monitor(int argc, char **argv)
 	int rc;
 
 	prepare_monitor();
+	if (opt_jobserver)
+		setup_jobserver();
+	if (opt_freeze)
+		setup_freeze();
 
 	child_pid = spawn(argc, argv);
 	outf(1, "childpid", "%lu", child_pid);
+	if (opt_tui)
+		close(tui_pipe[1]);
+	if (opt_jobserver) {
+		close(js_child_fds[0]);
+		close(js_child_fds[1]);
+	}
+
+	if (opt_stats_page)
+		setup_stats_page();
+	if (opt_samples && samples_open(opt_samples, opt_samples_max, opt_samples_keep, opt_pollms, cmd_str) < 0)
+		quit("could not open '%s'", opt_samples);
 
 	if (opt_timeout)
 		set_timeout();
@@ -1391,6 +5803,8 @@ int exec_and_monitor(int argc, char **argv)
 	wait_monitor();
 
 	rc = post_mortem(child_pid);
+	if (opt_ring)
+		stop_ring();
 
 	if (opt_outfile)
 		fclose(opt_fout);
@@ -1416,6 +5830,14 @@ int main(int argc, char **argv)
 	int rc;
 	int optind;
 
+	/* Subcommands, run a program with these names with `ramon -- name' */
+	if (argc > 1 && !strcmp(argv[1], "compare"))
+		return ramon_compare(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "history"))
+		return ramon_history(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "samples"))
+		return ramon_samples(argc - 1, argv + 1);
+
 	optind = parse_opts(argc, argv, false, ramon_opts);
 	if (optind < 0) {
 		fprintf(stderr, "Use '-h' to see the list of options.\n");
@@ -1436,6 +5858,52 @@ int main(int argc, char **argv)
 		warn("Carrying on anyway... but timeouts will not trigger.");
 	}
 
+	if (opt_tui && !isatty(STDERR_FILENO))
+		quit("--tui needs stderr to be a terminal");
+	if (opt_tui && opt_pollms == 0) {
+		errno = EINVAL;
+		quit("--tui needs polling");
+	}
+
+	if (!strcmp(opt_on_limit, "freeze")) {
+		opt_freeze = true;
+	} else if (strcmp(opt_on_limit, "kill")) {
+		errno = EINVAL;
+		quit("--on-limit must be kill or freeze, not '%s'", opt_on_limit);
+	}
+
+	if (opt_wss && opt_pollms == 0) {
+		errno = EINVAL;
+		quit("--wss needs polling");
+	}
+
+	if (opt_jobserver && opt_pollms == 0) {
+		errno = EINVAL;
+		quit("--jobserver needs polling");
+	}
+	if (opt_jobserver < 0) {
+		errno = EINVAL;
+		quit("invalid --jobserver %li", opt_jobserver);
+	}
+
+	if (opt_budget && !opt_baseline) {
+		errno = EINVAL;
+		quit("--budget needs --baseline");
+	}
+	if (opt_budget)
+		parse_budget(opt_budget);
+	if (opt_baseline)
+		load_baseline(opt_baseline);
+
+	if (opt_cpus || opt_mems) {
+		cpu_set_t set;
+		errno = EINVAL;
+		if (opt_cpus && (parse_cpulist(opt_cpus, &set) < 0 || CPU_COUNT(&set) == 0))
+			quit("invalid cpu list '%s'", opt_cpus);
+		if (opt_mems && (parse_cpulist(opt_mems, &set) < 0 || CPU_COUNT(&set) == 0))
+			quit("invalid memory node list '%s'", opt_mems);
+	}
+
 	/* Maybe redirect output */
 	if (opt_outfile) {
 		int flags = O_WRONLY | O_CREAT | O_TRUNC | (opt_noclobber ? O_EXCL : 0);
@@ -1471,12 +5939,19 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (opt_peek)
+		return peek(opt_peek);
+
 	if (opt_mark) {
 		/* If we cannot connect, just warn and exit successfully */
 		rc = connect_to_upstream();
 		if (rc < 0)
 			return 0;
-		notify_up(opt_mark, strlen(opt_mark));
+		/* Any further arguments are more marks, sent in the same batch */
+		notify_up(RAMON_MSG_MARK, opt_mark, strlen(opt_mark));
+		for (int i = optind; i < argc; i++)
+			notify_up(RAMON_MSG_MARK, argv[i], strlen(argv[i]));
+		flush_up();
 		return 0;
 	}
 
@@ -1488,18 +5963,28 @@ int main(int argc, char **argv)
 
 	pipe(gopipe);
 
+	if (opt_trace)
+		setup_trace();
+
 	setup();
 
 	rc = exec_and_monitor(argc - optind, argv + optind);
 
 	if (opt_render) {
 		assert(opt_outfile);
-		char cmd[500];
-		int rc;
-		snprintf(cmd, sizeof cmd, "ramon-render.py %s", opt_outfile);
-		rc = system(cmd);
-		if (rc)
-			warn("ramon-render failed");
+		char fn[PATH_MAX];
+		snprintf(fn, sizeof fn, "%s.svg", opt_outfile);
+		if (render_svg(fn) < 0)
+			warn("could not render '%s'", fn);
+		else
+			dbg(1, "Saved image in %s", fn);
+		if (opt_percpu) {
+			snprintf(fn, sizeof fn, "%s.percpu.svg", opt_outfile);
+			if (render_percpu_svg(fn, cpus_effective) < 0)
+				warn("could not render '%s'", fn);
+			else
+				dbg(1, "Saved image in %s", fn);
+		}
 	}
 
 	return rc;
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "render.h"
+
+/*
+ * Native version of ramon-render.py's plot, as SVG: load and rootload
+ * filled, memory (GiB) as a line, and marks as dashed lines, all on the
+ * same axis.
+ *
+ * Series are decimated to the plot's width before drawing: for every
+ * pixel column we keep only its lowest and highest point, in the order
+ * they came. That is all a column can show anyway, so every spike is
+ * still there, and a million polls come down to a few thousand points
+ * in one pass.
+ *
+ * With --percpu, the busy digits of each poll also go to a heatmap in a
+ * second file, one row per CPU, like ramon-render.py's .percpu.png.
+ * Each pixel column shows the busiest poll that fell in it.
+ */
+
+#define R_WIDTH    1200
+#define R_HEIGHT   400
+#define R_LEFT     60
+#define R_RIGHT    20
+#define R_TOP      30
+#define R_BOTTOM   40
+#define R_PW       (R_WIDTH - R_LEFT - R_RIGHT)
+#define R_PH       (R_HEIGHT - R_TOP - R_BOTTOM)
+#define R_LABEL_GAP 6      /* px between mark labels */
+
+#define C0 "#1f77b4"
+#define C1 "#ff7f0e"
+#define C2 "#2ca02c"
+
+#define R_CPU_H     4      /* px per CPU row of the heatmap */
+#define R_BAR_W     12     /* colour bar */
+
+struct rpoll
+{
+	long wall_us;
+	float load, rootload;
+	long mem;
+};
+
+struct rmark
+{
+	long wall_us;
+	char *label;
+};
+
+static struct rpoll *polls;
+static int npolls, cappolls;
+static struct rmark *marks;
+static int nmarks, capmarks;
+
+/* --percpu: ncpu digits per poll, '0' idle to '9' fully busy */
+static long *pc_wall;
+static char *pc_busy;
+static int pc_n, pc_cap, pc_ncpu;
+
+/* inferno, sampled at the middle of each digit's tenth */
+static const char *heat[10] = {
+	"#0c0826", "#320a5e", "#5f136e", "#8c2369", "#b8325a",
+	"#dd513a", "#f37819", "#fca50a", "#f6d746", "#f6f5a0",
+};
+
+struct pt
+{
+	double x, y;
+};
+
+static void *xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+void render_poll(long wall_us, double load, double rootload, long mem)
+{
+	if (npolls == cappolls) {
+		cappolls = cappolls ? 2 * cappolls : 1024;
+		polls = xrealloc(polls, cappolls * sizeof polls[0]);
+	}
+	polls[npolls++] = (struct rpoll){ wall_us, load, rootload, mem > 0 ? mem : 0 };
+}
+
+void render_mark(const char *label, int len, long wall_us)
+{
+	if (nmarks == capmarks) {
+		capmarks = capmarks ? 2 * capmarks : 64;
+		marks = xrealloc(marks, capmarks * sizeof marks[0]);
+	}
+	marks[nmarks].wall_us = wall_us;
+	marks[nmarks].label = strndup(label, len < 64 ? len : 64);
+	nmarks++;
+}
+
+void render_percpu(long wall_us, const char *busy)
+{
+	int ncpu = strlen(busy);
+
+	if (!pc_ncpu)
+		pc_ncpu = ncpu;
+	if (ncpu != pc_ncpu)
+		return;
+	if (pc_n == pc_cap) {
+		pc_cap = pc_cap ? 2 * pc_cap : 1024;
+		pc_wall = xrealloc(pc_wall, pc_cap * sizeof pc_wall[0]);
+		pc_busy = xrealloc(pc_busy, (size_t)pc_cap * pc_ncpu);
+	}
+	pc_wall[pc_n] = wall_us;
+	memcpy(pc_busy + (size_t)pc_n * pc_ncpu, busy, pc_ncpu);
+	pc_n++;
+}
+
+static double p_load(const struct rpoll *p)     { return p->load; }
+static double p_rootload(const struct rpoll *p) { return p->rootload; }
+static double p_mem(const struct rpoll *p)      { return p->mem / (double)(1L << 30); }
+
+/* Min-max decimation to one column per pixel, into out[2 * R_PW + 2] */
+static int decimate(double (*get)(const struct rpoll *), double maxx_us, struct pt *out)
+{
+	int n = 0;
+
+	for (int i = 0, j; i < npolls; i = j) {
+		int col = polls[i].wall_us / maxx_us * R_PW;
+		int imin = i, imax = i, a, b;
+
+		for (j = i + 1; j < npolls && (int)(polls[j].wall_us / maxx_us * R_PW) == col; j++) {
+			if (get(&polls[j]) < get(&polls[imin]))
+				imin = j;
+			if (get(&polls[j]) > get(&polls[imax]))
+				imax = j;
+		}
+		a = imin < imax ? imin : imax;
+		b = imin < imax ? imax : imin;
+		out[n++] = (struct pt){ polls[a].wall_us / 1e6, get(&polls[a]) };
+		if (b != a)
+			out[n++] = (struct pt){ polls[b].wall_us / 1e6, get(&polls[b]) };
+	}
+	return n;
+}
+
+static double px(double x, double maxx)
+{
+	return R_LEFT + x / maxx * R_PW;
+}
+
+static double py(double y, double maxy)
+{
+	return R_TOP + R_PH - y / maxy * R_PH;
+}
+
+static void path(FILE *f, const struct pt *pts, int n, double maxx, double maxy,
+		 bool fill, const char *style)
+{
+	fprintf(f, "<path style=\"%s\" d=\"", style);
+	if (fill)
+		fprintf(f, "M%.1f,%.1f", px(pts[0].x, maxx), py(0, maxy));
+	for (int i = 0; i < n; i++)
+		fprintf(f, "%c%.1f,%.1f", !fill && i == 0 ? 'M' : 'L',
+			px(pts[i].x, maxx), py(pts[i].y, maxy));
+	if (fill)
+		fprintf(f, "L%.1f,%.1fZ", px(pts[n - 1].x, maxx), py(0, maxy));
+	fprintf(f, "\"/>\n");
+}
+
+static void xml_str(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '<': fputs("&lt;", f); break;
+		case '>': fputs("&gt;", f); break;
+		case '&': fputs("&amp;", f); break;
+		case '"': fputs("&quot;", f); break;
+		default:
+			if ((unsigned char)*s >= 0x20)
+				fputc(*s, f);
+		}
+	}
+}
+
+/* 1, 2 or 5 times a power of 10, for about n ticks up to max */
+static double tick_step(double max, int n)
+{
+	double raw = max / n, p = pow(10, floor(log10(raw)));
+
+	if (raw <= p)
+		return p;
+	if (raw <= 2 * p)
+		return 2 * p;
+	if (raw <= 5 * p)
+		return 5 * p;
+	return 10 * p;
+}
+
+int render_svg(const char *fn)
+{
+	struct pt *pts;
+	double maxx = 1, maxy = 1, step;
+	int n, lastcol = -1;
+	double lastlabel = -1e9;
+	FILE *f;
+
+	for (int i = 0; i < npolls; i++) {
+		if (polls[i].wall_us / 1e6 > maxx)
+			maxx = polls[i].wall_us / 1e6;
+		if (polls[i].load > maxy)
+			maxy = polls[i].load;
+		if (p_mem(&polls[i]) > maxy)
+			maxy = p_mem(&polls[i]);
+	}
+	for (int i = 0; i < nmarks; i++)
+		if (marks[i].wall_us / 1e6 > maxx)
+			maxx = marks[i].wall_us / 1e6;
+	maxx = ceil(maxx);
+	maxy = ceil(maxy);
+
+	f = fopen(fn, "w");
+	if (!f)
+		return -1;
+
+	fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%i\" height=\"%i\" "
+		   "viewBox=\"0 0 %i %i\" font-family=\"sans-serif\">\n",
+		R_WIDTH, R_HEIGHT, R_WIDTH, R_HEIGHT);
+	fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+	fprintf(f, "<text x=\"%i\" y=\"18\" font-size=\"13\" text-anchor=\"middle\">"
+		   "Load average and memory across time</text>\n", R_LEFT + R_PW / 2);
+
+	/* grid and ticks */
+	step = tick_step(maxy, 10);
+	if (step < 1)
+		step = 1;
+	for (double y = 0; y <= maxy + 1e-9; y += step)
+		fprintf(f, "<line x1=\"%i\" x2=\"%i\" y1=\"%.1f\" y2=\"%.1f\" stroke=\"gray\" "
+			   "stroke-opacity=\"0.5\" stroke-width=\"0.5\"/>\n"
+			   "<text x=\"%i\" y=\"%.1f\" font-size=\"9\" text-anchor=\"end\">%g</text>\n",
+			R_LEFT, R_LEFT + R_PW, py(y, maxy), py(y, maxy),
+			R_LEFT - 4, py(y, maxy) + 3, y);
+	step = tick_step(maxx, 10);
+	for (double x = 0; x <= maxx + 1e-9; x += step)
+		fprintf(f, "<text x=\"%.1f\" y=\"%i\" font-size=\"9\" text-anchor=\"middle\">%g</text>\n",
+			px(x, maxx), R_TOP + R_PH + 14, x);
+	fprintf(f, "<rect x=\"%i\" y=\"%i\" width=\"%i\" height=\"%i\" fill=\"none\" stroke=\"black\" "
+		   "stroke-width=\"0.5\"/>\n", R_LEFT, R_TOP, R_PW, R_PH);
+	fprintf(f, "<text x=\"%i\" y=\"%i\" font-size=\"10\" text-anchor=\"middle\">Wall clock time</text>\n",
+		R_LEFT + R_PW / 2, R_HEIGHT - 10);
+	fprintf(f, "<text transform=\"translate(16 %i) rotate(-90)\" font-size=\"10\" "
+		   "text-anchor=\"middle\">Load / Memory(GiB)</text>\n", R_TOP + R_PH / 2);
+
+	pts = xrealloc(NULL, (2 * R_PW + 4) * sizeof *pts);
+	if (npolls) {
+		n = decimate(p_load, maxx * 1e6, pts);
+		path(f, pts, n, maxx, maxy, true, "fill:" C0 ";stroke:none");
+		n = decimate(p_rootload, maxx * 1e6, pts);
+		path(f, pts, n, maxx, maxy, true, "fill:" C1 ";stroke:none");
+		n = decimate(p_mem, maxx * 1e6, pts);
+		path(f, pts, n, maxx, maxy, false, "fill:none;stroke:" C2 ";stroke-width:0.8");
+	}
+	free(pts);
+
+	/*
+	 * Marks, one line per pixel column at most, labelled at staggered
+	 * heights unless too close to the previous label.
+	 */
+	for (int i = 0; i < nmarks; i++) {
+		double x = px(marks[i].wall_us / 1e6, maxx);
+		double y = py((double)(nmarks - i) / nmarks * maxy, maxy);
+
+		if ((int)x != lastcol)
+			fprintf(f, "<line x1=\"%.1f\" x2=\"%.1f\" y1=\"%i\" y2=\"%i\" stroke=\"" C1 "\" "
+				   "stroke-width=\"0.4\" stroke-dasharray=\"3 2\"/>\n",
+				x, x, R_TOP, R_TOP + R_PH);
+		lastcol = x;
+		if (x - lastlabel < R_LABEL_GAP)
+			continue;
+		lastlabel = x;
+		fprintf(f, "<text transform=\"translate(%.1f %.1f) rotate(-45)\" font-size=\"6\">", x, y);
+		xml_str(f, marks[i].label);
+		fprintf(f, "</text>\n");
+	}
+
+	fprintf(f, "<text x=\"4\" y=\"%i\" font-size=\"6\">Generated by ramon</text>\n", R_HEIGHT - 3);
+	fprintf(f, "</svg>\n");
+
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+int render_percpu_svg(const char *fn, const char *cpus)
+{
+	double maxx = 1, step;
+	int ph = pc_ncpu * R_CPU_H < 80 ? 80 : pc_ncpu * R_CPU_H;
+	int height = R_TOP + ph + R_BOTTOM;
+	int right = R_RIGHT + R_BAR_W + 30;
+	int pw = R_WIDTH - R_LEFT - right;
+	char *cols;
+	FILE *f;
+
+	if (!pc_n)
+		return 0;
+
+	for (int i = 0; i < pc_n; i++)
+		if (pc_wall[i] / 1e6 > maxx)
+			maxx = pc_wall[i] / 1e6;
+	maxx = ceil(maxx);
+
+	/*
+	 * The busiest poll of every column. A poll covers the time since
+	 * the previous one, so columns without a poll of their own take
+	 * the next one's digits.
+	 */
+	cols = calloc((size_t)pw * pc_ncpu, 1);
+	if (!cols)
+		return -1;
+	for (int i = 0; i < pc_n; i++) {
+		int col = pc_wall[i] / (maxx * 1e6) * pw;
+		char *c = cols + (size_t)(col < pw ? col : pw - 1) * pc_ncpu;
+
+		for (int j = 0; j < pc_ncpu; j++)
+			if (pc_busy[(size_t)i * pc_ncpu + j] > c[j])
+				c[j] = pc_busy[(size_t)i * pc_ncpu + j];
+	}
+	for (int col = pw - 2; col >= 0; col--)
+		if (!cols[(size_t)col * pc_ncpu])
+			memcpy(cols + (size_t)col * pc_ncpu, cols + (size_t)(col + 1) * pc_ncpu, pc_ncpu);
+
+	f = fopen(fn, "w");
+	if (!f) {
+		free(cols);
+		return -1;
+	}
+
+	fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%i\" height=\"%i\" "
+		   "viewBox=\"0 0 %i %i\" font-family=\"sans-serif\" shape-rendering=\"crispEdges\">\n",
+		R_WIDTH, height, R_WIDTH, height);
+	fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+	fprintf(f, "<text x=\"%i\" y=\"18\" font-size=\"13\" text-anchor=\"middle\">"
+		   "Per-CPU utilization</text>\n", R_LEFT + pw / 2);
+	fprintf(f, "<rect x=\"%i\" y=\"%i\" width=\"%i\" height=\"%i\" fill=\"%s\"/>\n",
+		R_LEFT, R_TOP, pw, ph, heat[0]);
+
+	/* one rect per run of equal digits along a CPU's row; CPU 0 at the bottom */
+	for (int j = 0; j < pc_ncpu; j++) {
+		double y = R_TOP + ph - (j + 1) * (double)ph / pc_ncpu;
+
+		for (int col = 0, end; col < pw; col = end) {
+			char d = cols[(size_t)col * pc_ncpu + j];
+
+			for (end = col + 1; end < pw && cols[(size_t)end * pc_ncpu + j] == d; end++)
+				;
+			if (d > '0' && d <= '9')
+				fprintf(f, "<rect x=\"%i\" y=\"%.1f\" width=\"%i\" height=\"%.1f\" fill=\"%s\"/>\n",
+					R_LEFT + col, y, end - col, (double)ph / pc_ncpu, heat[d - '0']);
+		}
+	}
+	free(cols);
+
+	step = tick_step(maxx, 10);
+	for (double x = 0; x <= maxx + 1e-9; x += step)
+		fprintf(f, "<text x=\"%.1f\" y=\"%i\" font-size=\"9\" text-anchor=\"middle\">%g</text>\n",
+			R_LEFT + x / maxx * pw, R_TOP + ph + 14, x);
+	step = tick_step(pc_ncpu, 8);
+	if (step < 1)
+		step = 1;
+	for (int j = 0; j < pc_ncpu; j += step)
+		fprintf(f, "<text x=\"%i\" y=\"%.1f\" font-size=\"9\" text-anchor=\"end\">%i</text>\n",
+			R_LEFT - 4, R_TOP + ph - (j + 0.5) * ph / pc_ncpu + 3, j);
+	fprintf(f, "<rect x=\"%i\" y=\"%i\" width=\"%i\" height=\"%i\" fill=\"none\" stroke=\"black\" "
+		   "stroke-width=\"0.5\"/>\n", R_LEFT, R_TOP, pw, ph);
+	fprintf(f, "<text x=\"%i\" y=\"%i\" font-size=\"10\" text-anchor=\"middle\">Wall clock time</text>\n",
+		R_LEFT + pw / 2, height - 10);
+	fprintf(f, "<text transform=\"translate(16 %i) rotate(-90)\" font-size=\"10\" "
+		   "text-anchor=\"middle\">CPU (of ", R_TOP + ph / 2);
+	xml_str(f, cpus);
+	fprintf(f, ")</text>\n");
+
+	/* colour bar */
+	for (int d = 0; d < 10; d++)
+		fprintf(f, "<rect x=\"%i\" y=\"%.1f\" width=\"%i\" height=\"%.1f\" fill=\"%s\"/>\n",
+			R_WIDTH - right + 10, R_TOP + ph - (d + 1) * ph / 10.0, R_BAR_W, ph / 10.0, heat[d]);
+	for (int p = 0; p <= 100; p += 50)
+		fprintf(f, "<text x=\"%i\" y=\"%.1f\" font-size=\"9\">%i</text>\n",
+			R_WIDTH - right + 12 + R_BAR_W, R_TOP + ph - p / 100.0 * ph + 3, p);
+	fprintf(f, "<text transform=\"translate(%i %i) rotate(-90)\" font-size=\"10\" "
+		   "text-anchor=\"middle\">Busy %%</text>\n", R_WIDTH - 4, R_TOP + ph / 2);
+
+	fprintf(f, "<text x=\"4\" y=\"%i\" font-size=\"6\">Generated by ramon</text>\n", height - 3);
+	fprintf(f, "</svg>\n");
+
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __RENDER_H
+#define __RENDER_H 1
+
+/* Polls and marks kept in memory for --render */
+void render_poll(long wall_us, double load, double rootload, long mem);
+void render_mark(const char *label, int len, long wall_us);
+/* One --percpu row of busy digits */
+void render_percpu(long wall_us, const char *busy);
+
+/* Writes the plot to path. Returns 0, or -1 with errno set. */
+int render_svg(const char *path);
+/* Writes the per-CPU heatmap, if there were rows, labelled with cpus */
+int render_percpu_svg(const char *path, const char *cpus);
+
+#endif
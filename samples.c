@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "opts.h"
+#include "samples.h"
+
+/*
+ * Compact poll storage for `ramon --samples=<file>'. The file is a
+ * header followed by chunks, each a header and then its values, column
+ * by column, as zigzag varints of the delta to the previous value.
+ * The chunk header has the values before the first one, so every chunk
+ * decodes on its own.
+ *
+ * Level 0 chunks have every poll. Level L+1 chunks are rollups of level
+ * L ones, SMP_FANOUT rows into one: the cumulative counters at the end
+ * of the bucket, and the min/max/mean of memory and load over it. With
+ * --samples-max, when the file grows past the limit the oldest chunks
+ * of the lowest level are rolled up, level by level, until it is under
+ * 3/4 of it, and then rewritten and renamed into place. Chunks in the
+ * last --samples-keep seconds, around the memory peak and where ramon
+ * pinned them (limits hit) are left alone. If that is not enough, the
+ * oldest chunks are dropped.
+ *
+ * When ramon is done it appends an index of the chunks and a footer
+ * pointing to it. Readers without one (still running, or crashed) walk
+ * the chunk headers instead.
+ */
+
+#define SMP_MAGIC        0x504d5352 /* "RSMP" */
+#define SMP_CHUNK_MAGIC  0x48435352 /* "RSCH" */
+#define SMP_IDX_MAGIC    0x58495352 /* "RSIX" */
+#define SMP_VERSION      1
+#define SMP_CHUNK_N      256
+#define SMP_FANOUT       16
+#define SMP_MAX_LEVEL    6
+#define SMP_NCOLS0       6
+#define SMP_NCOLS        10
+
+#define SMP_PINNED       1
+
+struct smp_file_hdr
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t  start_us;     /* realtime */
+	int32_t  pollms;
+	int32_t  _pad;
+	char     cmd[232];
+};
+
+struct smp_chunk_hdr
+{
+	uint32_t magic;
+	uint8_t  level;
+	uint8_t  flags;
+	uint16_t _pad;
+	uint32_t n;            /* rows */
+	uint32_t len;          /* bytes of values after the header */
+	int64_t  t0, t1;       /* wall_us of the first and last rows */
+	int64_t  mem_max;
+	int64_t  base[SMP_NCOLS0]; /* the sample before the first row */
+};
+
+struct smp_idx_ent
+{
+	uint64_t off;
+	int64_t  t0, t1;
+	uint32_t n;
+	uint8_t  level;
+	uint8_t  flags;
+	uint16_t _pad;
+};
+
+struct smp_footer
+{
+	uint32_t magic;
+	uint32_t n;
+	uint64_t off;
+};
+
+/* A decoded row, of any level. Loads are in thousandths of a CPU. */
+struct smp_row
+{
+	int64_t wall, usage, user, sys, root;
+	int64_t mem_min, mem_max, mem_mean;
+	int64_t load_min, load_max;
+};
+
+struct smp_chunk
+{
+	struct smp_chunk_hdr h;
+	uint64_t off;          /* of the header in the file */
+	unsigned char *data;   /* if not written yet */
+};
+
+static struct {
+	int fd;
+	const char *path;
+	long max, keep_us;
+	int64_t size;
+
+	struct smp_chunk *chunks;
+	int nchunks, capchunks;
+
+	struct smp_sample cur[SMP_CHUNK_N];
+	int ncur;
+	struct smp_sample last;
+	int pin;               /* chunks still to pin, this one included */
+} smp = { .fd = -1 };
+
+static void *xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static unsigned char *put_varint(unsigned char *p, int64_t v)
+{
+	uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+	while (z >= 0x80) {
+		*p++ = z | 0x80;
+		z >>= 7;
+	}
+	*p++ = z;
+	return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, int64_t *v)
+{
+	uint64_t z = 0;
+	int shift = 0;
+
+	while (p < end && shift < 64) {
+		z |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+static int64_t row_col(const struct smp_row *r, int c)
+{
+	switch (c) {
+	case 0: return r->wall;
+	case 1: return r->usage;
+	case 2: return r->user;
+	case 3: return r->sys;
+	case 4: return r->root;
+	case 5: return r->mem_min;
+	case 6: return r->mem_max;
+	case 7: return r->mem_mean;
+	case 8: return r->load_min;
+	default: return r->load_max;
+	}
+}
+
+static void row_set(struct smp_row *r, int c, int64_t v)
+{
+	switch (c) {
+	case 0: r->wall = v; break;
+	case 1: r->usage = v; break;
+	case 2: r->user = v; break;
+	case 3: r->sys = v; break;
+	case 4: r->root = v; break;
+	case 5: r->mem_min = v; break;
+	case 6: r->mem_max = v; break;
+	case 7: r->mem_mean = v; break;
+	case 8: r->load_min = v; break;
+	default: r->load_max = v; break;
+	}
+}
+
+/* What column c is relative to, before the first row */
+static int64_t col_base(const struct smp_chunk_hdr *h, int c)
+{
+	if (c < 5)
+		return h->base[c];
+	if (c < 8)
+		return h->base[5];
+	return 0;
+}
+
+static int64_t load_of(int64_t usage, int64_t wall, int64_t pusage, int64_t pwall)
+{
+	return wall > pwall ? 1000 * (usage - pusage) / (wall - pwall) : 0;
+}
+
+/* Encodes rows into a new chunk */
+static struct smp_chunk mkchunk(int level, const int64_t base[SMP_NCOLS0],
+				const struct smp_row *rows, int n)
+{
+	int ncols = level ? SMP_NCOLS : SMP_NCOLS0;
+	unsigned char *buf = xrealloc(NULL, (size_t)n * ncols * 10 + 1), *p = buf;
+	struct smp_chunk c;
+
+	memset(&c, 0, sizeof c);
+	c.h.magic = SMP_CHUNK_MAGIC;
+	c.h.level = level;
+	c.h.n = n;
+	c.h.t0 = rows[0].wall;
+	c.h.t1 = rows[n - 1].wall;
+	memcpy(c.h.base, base, sizeof c.h.base);
+	c.h.mem_max = -1;
+	for (int i = 0; i < n; i++)
+		if (rows[i].mem_max > c.h.mem_max)
+			c.h.mem_max = rows[i].mem_max;
+
+	/* level 0 has mem in mem_min, and no loads */
+	for (int col = 0; col < ncols; col++) {
+		int64_t prev = col_base(&c.h, col);
+		for (int i = 0; i < n; i++) {
+			int64_t v = row_col(&rows[i], col);
+			p = put_varint(p, v - prev);
+			prev = v;
+		}
+	}
+	c.h.len = p - buf;
+	c.data = buf;
+	return c;
+}
+
+/* Decodes a chunk into rows[h->n]. Returns 0, or -1 if it is corrupt. */
+static int decode(const struct smp_chunk_hdr *h, const unsigned char *data, struct smp_row *rows)
+{
+	const unsigned char *p = data, *end = data + h->len;
+	int ncols = h->level ? SMP_NCOLS : SMP_NCOLS0;
+
+	for (int col = 0; col < ncols; col++) {
+		int64_t v = col_base(h, col);
+		for (uint32_t i = 0; i < h->n; i++) {
+			int64_t d;
+			p = get_varint(p, end, &d);
+			if (!p)
+				return -1;
+			v += d;
+			row_set(&rows[i], col, v);
+		}
+	}
+
+	if (h->level == 0) {
+		int64_t pwall = h->base[0], pusage = h->base[1];
+		for (uint32_t i = 0; i < h->n; i++) {
+			struct smp_row *r = &rows[i];
+			r->mem_max = r->mem_mean = r->mem_min;
+			r->load_min = r->load_max = load_of(r->usage, r->wall, pusage, pwall);
+			pwall = r->wall;
+			pusage = r->usage;
+		}
+	}
+	return 0;
+}
+
+/* Merges rows SMP_FANOUT at a time, in place. Returns how many are left. */
+static int coarsen(struct smp_row *rows, int n, int64_t pwall)
+{
+	int out = 0;
+
+	for (int i = 0; i < n; i += SMP_FANOUT) {
+		struct smp_row b = rows[i];
+		int64_t t = pwall;
+		double mean = 0;
+
+		for (int j = i; j < n && j < i + SMP_FANOUT; j++) {
+			struct smp_row *r = &rows[j];
+			if (r->mem_min < b.mem_min)
+				b.mem_min = r->mem_min;
+			if (r->mem_max > b.mem_max)
+				b.mem_max = r->mem_max;
+			if (r->load_min < b.load_min)
+				b.load_min = r->load_min;
+			if (r->load_max > b.load_max)
+				b.load_max = r->load_max;
+			mean += (double)r->mem_mean * (r->wall - t);
+			t = r->wall;
+			b.wall = r->wall;
+			b.usage = r->usage;
+			b.user = r->user;
+			b.sys = r->sys;
+			b.root = r->root;
+		}
+		b.mem_mean = b.wall > pwall ? mean / (b.wall - pwall) : rows[i].mem_mean;
+		pwall = b.wall;
+		rows[out++] = b;
+	}
+	return out;
+}
+
+static int read_chunk_data(int fd, const struct smp_chunk *c, unsigned char **data)
+{
+	if (c->data) {
+		*data = c->data;
+		return 0;
+	}
+	*data = xrealloc(NULL, c->h.len + 1);
+	if (pread(fd, *data, c->h.len, c->off + sizeof c->h) != (ssize_t)c->h.len) {
+		free(*data);
+		return -1;
+	}
+	return 0;
+}
+
+static void push_chunk(struct smp_chunk **cs, int *n, int *cap, struct smp_chunk c)
+{
+	if (*n == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		*cs = xrealloc(*cs, *cap * sizeof **cs);
+	}
+	(*cs)[(*n)++] = c;
+}
+
+static int64_t chunk_bytes(const struct smp_chunk *c)
+{
+	return sizeof c->h + c->h.len;
+}
+
+/*
+ * Rolls up the old unpinned chunks of level L, merging neighbours into
+ * chunks of up to SMP_CHUNK_N rows.
+ */
+static void rollup_level(int level, int64_t cutoff, int64_t keep0, int64_t keep1)
+{
+	struct smp_chunk *out = NULL;
+	int nout = 0, capout = 0;
+	struct smp_row *pend = xrealloc(NULL, (SMP_CHUNK_N + SMP_CHUNK_N) * sizeof *pend);
+	struct smp_row *rows = xrealloc(NULL, SMP_CHUNK_N * SMP_FANOUT * sizeof *rows);
+	int npend = 0;
+	int64_t pbase[SMP_NCOLS0];
+
+	for (int i = 0; i < smp.nchunks; i++) {
+		struct smp_chunk *c = &smp.chunks[i];
+		unsigned char *data;
+		int n;
+
+		if (c->h.level != level || (c->h.flags & SMP_PINNED) || c->h.t1 >= cutoff ||
+		    (c->h.t1 >= keep0 && c->h.t0 <= keep1) ||
+		    c->h.n > SMP_CHUNK_N * SMP_FANOUT || read_chunk_data(smp.fd, c, &data) < 0) {
+			if (npend)
+				push_chunk(&out, &nout, &capout, mkchunk(level + 1, pbase, pend, npend));
+			npend = 0;
+			push_chunk(&out, &nout, &capout, *c);
+			continue;
+		}
+
+		if (decode(&c->h, data, rows) < 0)
+			n = 0;
+		else
+			n = coarsen(rows, c->h.n, c->h.base[0]);
+		if (data != c->data)
+			free(data);
+		free(c->data);
+
+		if (npend && npend + n > SMP_CHUNK_N) {
+			push_chunk(&out, &nout, &capout, mkchunk(level + 1, pbase, pend, npend));
+			npend = 0;
+		}
+		if (!npend)
+			memcpy(pbase, c->h.base, sizeof pbase);
+		memcpy(pend + npend, rows, n * sizeof *rows);
+		npend += n;
+	}
+	if (npend)
+		push_chunk(&out, &nout, &capout, mkchunk(level + 1, pbase, pend, npend));
+
+	free(smp.chunks);
+	smp.chunks = out;
+	smp.nchunks = nout;
+	smp.capchunks = capout;
+	free(pend);
+	free(rows);
+}
+
+/* Writes all chunks to a new file and puts it in place of the old one */
+static int rewrite(void)
+{
+	char tmp[PATH_MAX];
+	struct smp_file_hdr fh;
+	int64_t off;
+	int fd;
+
+	if (pread(smp.fd, &fh, sizeof fh, 0) != sizeof fh)
+		return -1;
+	snprintf(tmp, sizeof tmp, "%s.%i.tmp", smp.path, getpid());
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (write(fd, &fh, sizeof fh) != sizeof fh)
+		goto fail;
+	off = sizeof fh;
+
+	for (int i = 0; i < smp.nchunks; i++) {
+		struct smp_chunk *c = &smp.chunks[i];
+		unsigned char *data;
+
+		if (read_chunk_data(smp.fd, c, &data) < 0)
+			goto fail;
+		if (write(fd, &c->h, sizeof c->h) != sizeof c->h ||
+		    write(fd, data, c->h.len) != (ssize_t)c->h.len) {
+			if (data != c->data)
+				free(data);
+			goto fail;
+		}
+		if (data != c->data)
+			free(data);
+		free(c->data);
+		c->data = NULL;
+		c->off = off;
+		off += chunk_bytes(c);
+	}
+
+	if (rename(tmp, smp.path) < 0)
+		goto fail;
+	close(smp.fd);
+	smp.fd = fd;
+	smp.size = off;
+	return 0;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+static void compact(void)
+{
+	int64_t target = smp.max / 4 * 3, size = sizeof (struct smp_file_hdr);
+	int64_t cutoff = smp.last.wall_us - smp.keep_us;
+	int64_t keep0 = INT64_MAX, keep1 = INT64_MIN;
+	int peak = -1;
+
+	/*
+	 * The memory peak so far, and its neighbours. Not pinned for good,
+	 * if a higher one comes this one can go.
+	 */
+	for (int i = 0; i < smp.nchunks; i++)
+		if (smp.chunks[i].h.level == 0 &&
+		    (peak < 0 || smp.chunks[i].h.mem_max > smp.chunks[peak].h.mem_max))
+			peak = i;
+	if (peak >= 0) {
+		keep0 = smp.chunks[peak > 0 ? peak - 1 : peak].h.t0;
+		keep1 = smp.chunks[peak < smp.nchunks - 1 ? peak + 1 : peak].h.t1;
+	}
+
+	for (int i = 0; i < smp.nchunks; i++)
+		size += chunk_bytes(&smp.chunks[i]);
+
+	for (int level = 0; size > target && level < SMP_MAX_LEVEL; level++) {
+		rollup_level(level, cutoff, keep0, keep1);
+		size = sizeof (struct smp_file_hdr);
+		for (int i = 0; i < smp.nchunks; i++)
+			size += chunk_bytes(&smp.chunks[i]);
+	}
+
+	/* Still too big, the oldest go */
+	int drop = 0;
+	while (size > target && drop < smp.nchunks - 1)
+		size -= chunk_bytes(&smp.chunks[drop++]);
+	if (drop) {
+		for (int i = 0; i < drop; i++)
+			free(smp.chunks[i].data);
+		memmove(smp.chunks, smp.chunks + drop, (smp.nchunks - drop) * sizeof smp.chunks[0]);
+		smp.nchunks -= drop;
+	}
+
+	if (rewrite() < 0)
+		perror("ramon: rewriting samples");
+}
+
+static void flush_chunk(void)
+{
+	struct smp_row rows[SMP_CHUNK_N];
+	struct smp_chunk c;
+	int64_t base[SMP_NCOLS0];
+
+	if (!smp.ncur)
+		return;
+
+	memset(rows, 0, sizeof rows);
+	for (int i = 0; i < smp.ncur; i++) {
+		rows[i].wall = smp.cur[i].wall_us;
+		rows[i].usage = smp.cur[i].usage_us;
+		rows[i].user = smp.cur[i].user_us;
+		rows[i].sys = smp.cur[i].sys_us;
+		rows[i].root = smp.cur[i].root_us;
+		rows[i].mem_min = rows[i].mem_max = smp.cur[i].mem;
+	}
+	memcpy(base, &smp.last, sizeof base);
+	c = mkchunk(0, base, rows, smp.ncur);
+	if (smp.pin > 0) {
+		c.h.flags |= SMP_PINNED;
+		smp.pin--;
+	}
+
+	c.off = smp.size;
+	if (pwrite(smp.fd, &c.h, sizeof c.h, c.off) != sizeof c.h ||
+	    pwrite(smp.fd, c.data, c.h.len, c.off + sizeof c.h) != (ssize_t)c.h.len) {
+		perror("ramon: writing samples");
+		free(c.data);
+	} else {
+		free(c.data);
+		c.data = NULL;
+		smp.size += chunk_bytes(&c);
+		push_chunk(&smp.chunks, &smp.nchunks, &smp.capchunks, c);
+	}
+
+	smp.last = smp.cur[smp.ncur - 1];
+	smp.ncur = 0;
+
+	if (smp.max > 0 && smp.size > smp.max)
+		compact();
+}
+
+int samples_open(const char *path, long max_bytes, long keep_s, long pollms, const char *cmd)
+{
+	struct smp_file_hdr fh;
+	struct timespec ts;
+
+	smp.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (smp.fd < 0)
+		return -1;
+	smp.path = path;
+	smp.max = max_bytes;
+	smp.keep_us = keep_s * 1000000L;
+
+	memset(&fh, 0, sizeof fh);
+	fh.magic = SMP_MAGIC;
+	fh.version = SMP_VERSION;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fh.start_us = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+	fh.pollms = pollms;
+	snprintf(fh.cmd, sizeof fh.cmd, "%s", cmd);
+	if (write(smp.fd, &fh, sizeof fh) != sizeof fh)
+		return -1;
+	smp.size = sizeof fh;
+	return 0;
+}
+
+void samples_add(const struct smp_sample *s)
+{
+	smp.cur[smp.ncur++] = *s;
+	if (smp.ncur == SMP_CHUNK_N)
+		flush_chunk();
+}
+
+void samples_pin(void)
+{
+	/* this chunk and the next, and the previous one if it is still whole */
+	smp.pin = 2;
+	if (smp.nchunks && smp.chunks[smp.nchunks - 1].h.level == 0 &&
+	    !(smp.chunks[smp.nchunks - 1].h.flags & SMP_PINNED)) {
+		struct smp_chunk *c = &smp.chunks[smp.nchunks - 1];
+		c->h.flags |= SMP_PINNED;
+		if (pwrite(smp.fd, &c->h, sizeof c->h, c->off) != sizeof c->h)
+			perror("ramon: writing samples");
+	}
+}
+
+void samples_close(void)
+{
+	struct smp_idx_ent *ix;
+	struct smp_footer ft;
+
+	if (smp.fd < 0)
+		return;
+	flush_chunk();
+
+	ix = xrealloc(NULL, (smp.nchunks + 1) * sizeof *ix);
+	memset(ix, 0, (smp.nchunks + 1) * sizeof *ix);
+	for (int i = 0; i < smp.nchunks; i++) {
+		ix[i].off = smp.chunks[i].off;
+		ix[i].t0 = smp.chunks[i].h.t0;
+		ix[i].t1 = smp.chunks[i].h.t1;
+		ix[i].n = smp.chunks[i].h.n;
+		ix[i].level = smp.chunks[i].h.level;
+		ix[i].flags = smp.chunks[i].h.flags;
+	}
+	ft.magic = SMP_IDX_MAGIC;
+	ft.n = smp.nchunks;
+	ft.off = smp.size;
+	if (pwrite(smp.fd, ix, smp.nchunks * sizeof *ix, smp.size) != (ssize_t)(smp.nchunks * sizeof *ix) ||
+	    pwrite(smp.fd, &ft, sizeof ft, smp.size + smp.nchunks * sizeof *ix) != sizeof ft)
+		perror("ramon: writing samples index");
+	free(ix);
+
+	for (int i = 0; i < smp.nchunks; i++)
+		free(smp.chunks[i].data);
+	free(smp.chunks);
+	smp.chunks = NULL;
+	smp.nchunks = smp.capchunks = 0;
+	close(smp.fd);
+	smp.fd = -1;
+}
+
+/* Reading */
+
+static void fmt_mem(char *buf, size_t sz, int64_t x, bool nohuman)
+{
+	static const char *sufs[] = { "", "Ki", "Mi", "Gi", "Ti", "Pi" };
+	int pow = 0;
+
+	while (!nohuman && x > 99999 && pow < 5) {
+		x /= 1024;
+		pow++;
+	}
+	snprintf(buf, sz, "%li%sB", (long)x, sufs[pow]);
+}
+
+/* The chunks of the file, from its index or else by walking them */
+static struct smp_idx_ent *load_index(int fd, int64_t size, int *n)
+{
+	struct smp_footer ft;
+	struct smp_idx_ent *ix = NULL;
+	struct smp_chunk_hdr h;
+	int cap = 0;
+	int64_t off;
+
+	*n = 0;
+	if (size >= (int64_t)(sizeof (struct smp_file_hdr) + sizeof ft) &&
+	    pread(fd, &ft, sizeof ft, size - sizeof ft) == sizeof ft &&
+	    ft.magic == SMP_IDX_MAGIC &&
+	    ft.off + ft.n * sizeof *ix + sizeof ft == (uint64_t)size) {
+		ix = xrealloc(NULL, (ft.n + 1) * sizeof *ix);
+		if (pread(fd, ix, ft.n * sizeof *ix, ft.off) == (ssize_t)(ft.n * sizeof *ix)) {
+			*n = ft.n;
+			return ix;
+		}
+		free(ix);
+		ix = NULL;
+	}
+
+	for (off = sizeof (struct smp_file_hdr);
+	     pread(fd, &h, sizeof h, off) == sizeof h && h.magic == SMP_CHUNK_MAGIC &&
+	     off + (int64_t)sizeof h + h.len <= size;
+	     off += sizeof h + h.len) {
+		if (*n == cap) {
+			cap = cap ? 2 * cap : 64;
+			ix = xrealloc(ix, cap * sizeof *ix);
+		}
+		ix[*n] = (struct smp_idx_ent){ .off = off, .t0 = h.t0, .t1 = h.t1, .n = h.n,
+					       .level = h.level, .flags = h.flags };
+		(*n)++;
+	}
+	return ix;
+}
+
+static void print_rows(const struct smp_chunk_hdr *h, const struct smp_row *rows, bool nohuman)
+{
+	int64_t pwall = h->base[0], proot = h->base[4];
+	char mem[32], mn[32], mx[32];
+
+	for (uint32_t i = 0; i < h->n; i++) {
+		const struct smp_row *r = &rows[i];
+		double dt = r->wall > pwall ? (double)(r->wall - pwall) : 1;
+		double rootload = (r->root - proot) / dt;
+
+		fmt_mem(mem, sizeof mem, r->mem_mean, nohuman);
+		if (h->level == 0) {
+			printf("%-15s wall=%.3fs usage=%.3fs user=%.3fs sys=%.3fs mem=%s roottime=%.3fs load=%.2f rootload=%.2f\n",
+			       "poll", r->wall / 1e6, r->usage / 1e6, r->user / 1e6, r->sys / 1e6, mem,
+			       r->root / 1e6, r->load_max / 1e3, rootload);
+		} else {
+			int64_t pusage = i ? rows[i - 1].usage : h->base[1];
+			fmt_mem(mn, sizeof mn, r->mem_min, nohuman);
+			fmt_mem(mx, sizeof mx, r->mem_max, nohuman);
+			printf("%-15s wall=%.3fs span=%.3fs usage=%.3fs user=%.3fs sys=%.3fs mem=%s memmin=%s memmax=%s "
+			       "roottime=%.3fs load=%.2f loadmin=%.2f loadmax=%.2f rootload=%.2f level=%i\n",
+			       "rollup", r->wall / 1e6, (r->wall - pwall) / 1e6, r->usage / 1e6, r->user / 1e6,
+			       r->sys / 1e6, mem, mn, mx, r->root / 1e6, (r->usage - pusage) / dt,
+			       r->load_min / 1e3, r->load_max / 1e3, rootload, h->level);
+		}
+		pwall = r->wall;
+		proot = r->root;
+	}
+}
+
+static void smp_help(const char *progname)
+{
+	fprintf(stderr, "Usage: %s samples [options] <file>\n", progname);
+	fprintf(stderr, "Print the polls stored with --samples, as polls or rollups.\n");
+}
+
+int ramon_samples(int argc, char **argv)
+{
+	const char *opt_from = NULL, *opt_to = NULL;
+	bool opt_index = false, opt_nohuman = false;
+	struct opt smp_opts[] = {
+		OPT_BOOL("index", 'i', "Only print the chunks", &opt_index),
+		OPT_STR("from", 0, "Start at <seconds> into the run", &opt_from),
+		OPT_STR("to", 0, "Stop at <seconds> into the run", &opt_to),
+		OPT_BOOL("unit", '1', "Output values in single units, no KMG prefixes", &opt_nohuman),
+		OPT_END,
+	};
+	struct smp_file_hdr fh;
+	struct smp_idx_ent *ix;
+	struct smp_row *rows = NULL;
+	unsigned char *data = NULL;
+	int64_t from, to;
+	struct stat st;
+	int optind, fd, n, rc = 1;
+
+	optind = parse_opts(argc, argv, false, smp_opts);
+	if (optind < 0 || argc - optind != 1) {
+		smp_help("ramon");
+		print_opts(stderr, smp_opts);
+		return 1;
+	}
+	from = opt_from ? strtod(opt_from, NULL) * 1e6 : INT64_MIN;
+	to = opt_to ? strtod(opt_to, NULL) * 1e6 : INT64_MAX;
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "ramon samples: %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (pread(fd, &fh, sizeof fh, 0) != sizeof fh || fh.magic != SMP_MAGIC || fh.version != SMP_VERSION) {
+		fprintf(stderr, "ramon samples: %s: not a samples file\n", argv[optind]);
+		close(fd);
+		return 1;
+	}
+	fh.cmd[sizeof fh.cmd - 1] = 0;
+
+	ix = load_index(fd, st.st_size, &n);
+	printf("%-15s %s\n", "cmd", fh.cmd);
+	printf("%-15s %i\n", "pollms", fh.pollms);
+	printf("%-15s %i\n", "chunks", n);
+
+	for (int i = 0; i < n; i++) {
+		struct smp_chunk_hdr h;
+
+		if (ix[i].t1 < from || ix[i].t0 > to)
+			continue;
+		if (opt_index) {
+			printf("%-15s off=%lu level=%i n=%u start=%.3fs end=%.3fs%s\n", "chunk",
+			       (unsigned long)ix[i].off, ix[i].level, ix[i].n, ix[i].t0 / 1e6,
+			       ix[i].t1 / 1e6, ix[i].flags & SMP_PINNED ? " pinned" : "");
+			continue;
+		}
+
+		if (pread(fd, &h, sizeof h, ix[i].off) != sizeof h || h.magic != SMP_CHUNK_MAGIC)
+			goto corrupt;
+		rows = xrealloc(rows, (h.n + 1) * sizeof *rows);
+		data = xrealloc(data, h.len + 1);
+		if (pread(fd, data, h.len, ix[i].off + sizeof h) != (ssize_t)h.len || decode(&h, data, rows) < 0)
+			goto corrupt;
+		print_rows(&h, rows, opt_nohuman);
+	}
+	rc = 0;
+	goto out;
+
+corrupt:
+	fprintf(stderr, "ramon samples: %s: corrupt chunk\n", argv[optind]);
+out:
+	free(ix);
+	free(rows);
+	free(data);
+	close(fd);
+	return rc;
+}
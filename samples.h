@@ -0,0 +1,31 @@
+#ifndef __SAMPLES_H
+#define __SAMPLES_H 1
+
+#include <stdint.h>
+
+/* One poll, as stored by --samples. All cumulative except mem. */
+struct smp_sample
+{
+	int64_t wall_us;
+	int64_t usage_us;
+	int64_t user_us;
+	int64_t sys_us;
+	int64_t root_us;       /* user time of the root process */
+	int64_t mem;           /* current, in bytes */
+};
+
+/*
+ * Start storing polls in path. If max_bytes > 0 the file is kept under
+ * it by merging old chunks into rollups, except for the last keep_s
+ * seconds and around pinned points. Returns 0, or -1 with errno set.
+ */
+int samples_open(const char *path, long max_bytes, long keep_s, long pollms, const char *cmd);
+void samples_add(const struct smp_sample *s);
+/* Keep full resolution around the current poll */
+void samples_pin(void);
+void samples_close(void);
+
+/* `ramon samples <file>', argv[0] is "samples" */
+int ramon_samples(int argc, char **argv);
+
+#endif
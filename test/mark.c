@@ -0,0 +1,18 @@
+/* marks from a hot loop, through the shared-memory ring */
+#include <stdio.h>
+#include "../ramon-mark.h"
+
+int main()
+{
+	char label[32];
+	int i;
+
+	ramon_mark_begin("loop");
+	for (i = 0; i < 1000; i++) {
+		sprintf(label, "iter%i", i % 4);
+		ramon_mark_begin(label);
+		ramon_mark_end(label);
+	}
+	ramon_mark_end("loop");
+	return 0;
+}